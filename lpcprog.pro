@@ -4,15 +4,15 @@
 #
 #-------------------------------------------------
 
-QT       += core gui
+QT       += core gui network
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets serialport
 
 TARGET = lpcprog
 TEMPLATE = app
 
 
-SOURCES += main.cpp qappmainwindow.cpp qlpcprog.cpp qhexloader.cpp
-HEADERS +=          qappmainwindow.h   qlpcprog.h   qhexloader.h
+SOURCES += main.cpp qappmainwindow.cpp qlpcprog.cpp qhexloader.cpp qlpcjob.cpp qlpctransport.cpp qlpcstubprog.cpp qlpcverify.cpp qlpcdiscovery.cpp qlpcportwatcher.cpp qlpcjournal.cpp qlpcsession.cpp qlpcgang.cpp qlpcencoder.cpp qlpcinjector.cpp qlpcmanifest.cpp qlpcpreloader.cpp
+HEADERS +=          qappmainwindow.h   qlpcprog.h   qhexloader.h   qlpcjob.h   qlpctransport.h   qlpcstubprog.h   qlpcverify.h   qlpcdiscovery.h   qlpcportwatcher.h   qlpcjournal.h   qlpcsession.h   qlpcgang.h   qlpcencoder.h   qlpcinjector.h   qlpcmanifest.h   qlpcpreloader.h
 FORMS   +=          qappmainwindow.ui
 
 equals(QT_MAJOR_VERSION, 4) {
@@ -1,11 +1,306 @@
 #include "qappmainwindow.h"
+#include "qlpcjob.h"
+#include "qlpcdiscovery.h"
+#include "qlpcgang.h"
+#include "qlpcmanifest.h"
+#include "qhexloader.h"
 #include <QApplication>
+#include <QTextStream>
+
+static int runJob(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QTextStream out(stdout);
+    QLpcJob job;
+
+    if (job.parseArguments(a.arguments()) == false)
+    {
+        out << job.errorText() << "\n";
+        out << "Usage: lpcprog --port <port> [--crystal <KHz>] [--low-latency] [--reset normal|inverted|none] [--sync-timeout <ms>] [--stub <loader.bin>] [--encode-cache <dir>] [--merge <file.hex>] [--fingerprint [address]] [--manifest <file.manifest>] [--delta] [--job <file>] [--baud <rate>] [--erase] [--program <file.hex>] [--verify] [--verify-all] [--serial] [--go [address]]" << "\n";
+
+        return 2;
+    }
+
+    bool ok = job.run();
+
+    out << job.report();
+
+    return ok ? 0 : 1;
+}
+
+static int runDiscovery(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QTextStream out(stdout);
+    QLpcDiscovery discovery;
+    int index = a.arguments().indexOf("--crystal");
+    int found = 0;
+
+    if ((index >= 0)&&(index + 1 < a.arguments().count()))
+    {
+        discovery.setCrystalValue(a.arguments().at(index + 1).toInt());
+    }
+
+    foreach(QLpcDiscovery::Target target, discovery.discover())
+    {
+        if (target.m_Found)
+        {
+            out << target.m_Port << " " << QLpcDiscovery::partName(target.m_PartID) << " " << target.m_BootVersion << "\n";
+            found++;
+        }
+    }
+
+    return found ? 0 : 1;
+}
+
+// lpcprog --gang <port>...|all --program <file.hex> [--merge <file.hex>]... [--crystal <KHz>] [--baud <rate>] [--verify] [--encode-cache <dir>]
+static int runGang(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList arguments = a.arguments();
+    QTextStream out(stdout);
+    QStringList ports;
+    QStringList files;
+    QLpcGang gang;
+    QLpcProg prog;
+    QHexLoader loader;
+    QByteArray image;
+
+    gang.setVerify(false);
+
+    for(int c = 1; c < arguments.count(); c++)
+    {
+        QString value = (c + 1 < arguments.count()) ? arguments.at(c + 1) : QString();
+
+        if (arguments.at(c) == "--gang")
+        {
+            while((c + 1 < arguments.count())&&(!arguments.at(c + 1).startsWith("--")))
+            {
+                ports.append(arguments.at(++c));
+            }
+        }
+        else if (arguments.at(c) == "--program")
+        {
+            files.prepend(value);
+            c++;
+        }
+        else if (arguments.at(c) == "--merge")
+        {
+            files.append(value);
+            c++;
+        }
+        else if (arguments.at(c) == "--crystal")
+        {
+            gang.setCrystalValue(value.toInt());
+            c++;
+        }
+        else if (arguments.at(c) == "--baud")
+        {
+            gang.setBaudRate(value.toInt());
+            c++;
+        }
+        else if (arguments.at(c) == "--verify")
+        {
+            gang.setVerify(true);
+        }
+        else if (arguments.at(c) == "--encode-cache")
+        {
+            gang.setEncodeCacheDir(value);
+            c++;
+        }
+    }
+
+    if ((ports.isEmpty())||(ports == QStringList("all")))
+    {
+        ports = QLpcProg::detectSerialPorts();
+    }
+
+    if (files.count() > 1)
+    {
+        QString error;
+
+        image = QHexLoader::merge(files, &error);
+
+        if (image.isEmpty())
+        {
+            out << error << "\n";
+
+            return 2;
+        }
+    }
+    else if ((!files.isEmpty())&&(loader.load(files.first())))
+    {
+        image = loader.data();
+    }
+
+    if (image.length() < 32)
+    {
+        out << "Error loading hex file(" << files.join(", ") << ")." << "\n";
+        out << "Usage: lpcprog --gang <port>...|all --program <file.hex> [--merge <file.hex>]... [--crystal <KHz>] [--baud <rate>] [--verify] [--encode-cache <dir>]" << "\n";
+
+        return 2;
+    }
+
+    prog.patchFirmware(image);
+    gang.setImage(image);
+
+    bool ok = gang.run(ports);
+
+    foreach(QLpcGang::Result result, gang.results())
+    {
+        out << QString("%1 %2 %3 ms %4").arg(result.m_Port, -16).arg(result.m_Ok ? "OK" : "FAILED", -6).arg(result.m_Elapsed, 8).arg(result.m_Error) << "\n";
+    }
+
+    return ok ? 0 : 1;
+}
+
+// A .manifest file is loaded, anything else is taken for a hex file.
+static bool loadManifest(QLpcManifest &manifest, const QString &file, int partID = 0)
+{
+    if (file.endsWith(".manifest", Qt::CaseInsensitive))
+    {
+        return manifest.load(file);
+    }
+
+    QHexLoader loader;
+
+    if ((loader.load(file) == false)||(loader.data().length() < 32))
+    {
+        return false;
+    }
+
+    QByteArray image = loader.data();
+
+    QLpcProg::patchFirmware(image);
+
+    return manifest.fromImage(image, partID, loader.entryPoint());
+}
+
+// lpcprog --write-manifest <file.hex> [<file.manifest>] [--part <name|id>]
+// lpcprog --diff <file.hex|file.manifest> <file.hex|file.manifest>
+static int runManifest(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList arguments = a.arguments();
+    QTextStream out(stdout);
+    QLpcManifest first;
+    QLpcManifest second;
+    int index = arguments.indexOf("--part");
+    int partID = 0;
+
+    if ((index >= 0)&&(index + 1 < arguments.count()))
+    {
+        partID = qMax(QLpcDiscovery::partFromName(arguments.at(index + 1)), 0);
+    }
+
+    index = arguments.indexOf("--diff");
+
+    if (index >= 0)
+    {
+        if (index + 2 >= arguments.count())
+        {
+            out << "Usage: lpcprog --diff <file.hex|file.manifest> <file.hex|file.manifest>" << "\n";
+
+            return 2;
+        }
+
+        for(int c = 1; c <= 2; c++)
+        {
+            QLpcManifest &manifest = (c == 1) ? first : second;
+
+            if (!loadManifest(manifest, arguments.at(index + c)))
+            {
+                out << "Error loading " << arguments.at(index + c) << ". " << manifest.errorText() << "\n";
+
+                return 2;
+            }
+        }
+
+        QList<int> sectors = first.diff(second);
+
+        foreach(int sector, sectors)
+        {
+            int start = QLpcProg::sectorAddress(sector);
+
+            out << QString("Sector %1 (%2-%3) differs").arg(sector, 2).arg(start, 5, 16, QChar('0')).arg(start + QLpcProg::sectorSize(sector) - 1, 5, 16, QChar('0')).toUpper() << "\n";
+        }
+
+        if (first.entry() != second.entry())
+        {
+            out << QString("Entry point differs (%1, %2)").arg(first.entry(), 8, 16, QChar('0')).arg(second.entry(), 8, 16, QChar('0')).toUpper() << "\n";
+        }
+
+        return sectors.isEmpty() ? 0 : 1;
+    }
+
+    index = arguments.indexOf("--write-manifest");
+
+    if ((index < 0)||(index + 1 >= arguments.count())||(arguments.at(index + 1).startsWith("--")))
+    {
+        out << "Usage: lpcprog --write-manifest <file.hex> [<file.manifest>] [--part <name|id>]" << "\n";
+
+        return 2;
+    }
+
+    QString file = arguments.at(index + 1);
+    QString output = QLpcManifest::defaultFilename(file);
+
+    if ((index + 2 < arguments.count())&&(!arguments.at(index + 2).startsWith("--")))
+    {
+        output = arguments.at(index + 2);
+    }
+
+    if (!loadManifest(first, file, partID))
+    {
+        out << "Error loading hex file(" << file << "). " << first.errorText() << "\n";
+
+        return 2;
+    }
+
+    if (!first.save(output))
+    {
+        out << "Could't write manifest file(" << output << ")." << "\n";
+
+        return 1;
+    }
+
+    out << output << ": " << first.sectors().count() << " sectors" << "\n";
+
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    QStringList arguments;
+
+    for(int c = 0; c < argc; c++)
+    {
+        arguments.append(QString::fromLocal8Bit(argv[c]));
+    }
+
+    if (arguments.contains("--gang"))
+    {
+        return runGang(argc, argv);
+    }
+
+    if ((arguments.contains("--write-manifest"))||(arguments.contains("--diff")))
+    {
+        return runManifest(argc, argv);
+    }
+
+    if (arguments.contains("--find"))
+    {
+        return runDiscovery(argc, argv);
+    }
+
+    if (QLpcJob::hasJobArguments(arguments))
+    {
+        return runJob(argc, argv);
+    }
+
     QApplication a(argc, argv);
     QAppMainWindow w;
     w.show();
-    
+
     return a.exec();
 }
@@ -2,9 +2,16 @@
 #include "ui_qappmainwindow.h"
 #include "qhexloader.h"
 #include "qlpcprog.h"
+#include "qlpcverify.h"
+#include "qlpcjournal.h"
+#include "qlpcencoder.h"
+#include "qlpcdiscovery.h"
+#include "qlpcportwatcher.h"
 
+#include <QElapsedTimer>
 #include <QApplication>
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QMessageBox>
 #include <QSettings>
 
@@ -14,14 +21,17 @@
 
 QAppMainWindow::QAppMainWindow(QWidget *parent) :
     QMainWindow(parent),
-    m_SerialPortTimer(0),
+    m_SerialPortWatcher(0),
+    m_WatchProg(0),
     ui(new Ui::QMainWindow)
 {
     QSettings settings(QSettings::IniFormat, QSettings::UserScope, "BokiCSoft", "LPCProg");
 
     ui->setupUi(this);
 
-    updateSerialPorts();
+    connect(&m_Preloader, SIGNAL(prepared(QString,bool,QString)), this, SLOT(imagePrepared(QString,bool,QString)));
+
+    ui->ports_comboBox->addItems(QLpcProg::detectSerialPorts());
     if (ui->ports_comboBox->count() > 0)
     {
         ui->ports_comboBox->setCurrentIndex(ui->ports_comboBox->count() - 1);
@@ -32,43 +42,47 @@ QAppMainWindow::QAppMainWindow(QWidget *parent) :
         ui->file_lineEdit->setText(settings.value("Filename").toString());
     }
 
-    m_SerialPortTimer = startTimer(500);
+    // Port changes come from a background thread, nothing is scanned while idle.
+    m_SerialPortWatcher = new QLpcPortWatcher();
+    m_SerialPortWatcher->moveToThread(&m_SerialPortThread);
+
+    connect(m_SerialPortWatcher, SIGNAL(portAdded(QString)), this, SLOT(serialPortAdded(QString)));
+    connect(m_SerialPortWatcher, SIGNAL(portRemoved(QString)), this, SLOT(serialPortRemoved(QString)));
+
+    m_SerialPortThread.start();
+    QMetaObject::invokeMethod(m_SerialPortWatcher, "start");
 }
 
 QAppMainWindow::~QAppMainWindow()
 {
-    killTimer(m_SerialPortTimer);
-    m_SerialPortTimer = 0;
+    QMetaObject::invokeMethod(m_SerialPortWatcher, "stop", Qt::BlockingQueuedConnection);
+    m_SerialPortThread.quit();
+    m_SerialPortThread.wait();
+
+    delete m_SerialPortWatcher;
+    m_SerialPortWatcher = 0;
+
+    watchStop();
 
     delete ui;
 	ui = 0;
 }
 
-void QAppMainWindow::timerEvent(QTimerEvent *event)
+void QAppMainWindow::serialPortAdded(const QString &port)
 {
-    if (event->timerId() == m_SerialPortTimer)
+    if (ui->ports_comboBox->findText(port) == -1)
     {
-        updateSerialPorts();
+        ui->ports_comboBox->addItem(port);
     }
 }
 
-void QAppMainWindow::updateSerialPorts()
+void QAppMainWindow::serialPortRemoved(const QString &port)
 {
-    QStringList ports = QLpcProg::detectSerialPorts();
+    int index = ui->ports_comboBox->findText(port);
 
-    for(int c = 0; c < ports.count(); c++)
+    if (index != -1)
     {
-        if (c < ui->ports_comboBox->count())
-        {
-            if (ui->ports_comboBox->itemText(c) != ports.at(c))
-            {
-                ui->ports_comboBox->setItemText(c, ports.at(c));
-            }
-        }
-        else
-        {
-            ui->ports_comboBox->addItem(ports.at(c));
-        }
+        ui->ports_comboBox->removeItem(index);
     }
 }
 
@@ -513,6 +527,11 @@ void QAppMainWindow::on_decompile_pushButton_clicked()
 
 void QAppMainWindow::on_file_lineEdit_textChanged(const QString &text)
 {
+    if (ui->watch_checkBox->isChecked())
+    {
+        ui->watch_checkBox->setChecked(false);
+    }
+
     if (text.isEmpty())
     {
         ui->fileOperation_pushButton->setEnabled(false);
@@ -521,25 +540,72 @@ void QAppMainWindow::on_file_lineEdit_textChanged(const QString &text)
     {
         ui->fileOperation_pushButton->setEnabled(true);
     }
+
+    // Typed paths are prepared once they name a file.
+    if (QFileInfo(text).isFile())
+    {
+        m_Preloader.start(text);
+    }
+    else
+    {
+        m_Preloader.stop();
+    }
 }
 
-void QAppMainWindow::fileProgram(const QString &file)
+void QAppMainWindow::imagePrepared(const QString &file, bool ok, const QString &text)
 {
-    if (ui->ports_comboBox->currentIndex() == -1)
+    if (file != ui->file_lineEdit->text())
     {
         return;
     }
 
-    QHexLoader loader;
+    if (ok)
+    {
+        ui->statusbar->showMessage(text, STATUSBAR_TIMEOUT);
+    }
+    else
+    {
+        ui->statusbar->showMessage(text);
+    }
 
-    if (loader.load(file) == false)
+    // Every build that settles is prepared again, watch mode programs it from there. A file
+    // that is still being written fails, its next change tries again.
+    if (ui->watch_checkBox->isChecked())
     {
-        QMessageBox::critical(this, tr("Error"), tr("Error loading hex file."));
+        if (ok)
+        {
+            watchProgram();
+        }
+        else
+        {
+            watchMessage(text);
+        }
+    }
+}
 
+void QAppMainWindow::fileProgram(const QString &file)
+{
+    if (ui->ports_comboBox->currentIndex() == -1)
+    {
         return;
     }
 
-    QByteArray data = loader.data();
+    // Loaded, patched and encoded in the background, unless the file changed a moment ago.
+    QByteArray data = m_Preloader.image(file);
+
+    if (data.isEmpty())
+    {
+        QHexLoader loader;
+
+        if (loader.load(file) == false)
+        {
+            QMessageBox::critical(this, tr("Error"), tr("Error loading hex file."));
+
+            return;
+        }
+
+        data = loader.data();
+    }
 
     if (data.isEmpty())
     {
@@ -628,39 +694,87 @@ void QAppMainWindow::fileProgram(const QString &file)
         return;
     }*/
 
-    ui->statusbar->showMessage(tr("Chip erase."), STATUSBAR_TIMEOUT);
-    QApplication::processEvents();
+    // patch the firmware.
+    prog.patchFirmware(data);
 
-    prog.chipErase();
-    switch (prog.getStatus())
+    QLpcJournal journal(&prog);
+
+    if (!journal.open(data))
     {
-    case QLpcProg::StatusNoError:
-        break;
-    case QLpcProg::StatusTimeOut:
-        QMessageBox::critical(this, tr("Error"), tr("LPC chip erase timeout."));
-        return;
-    case QLpcProg::StatusError:
-        QMessageBox::critical(this, tr("Error"), tr("LPC chip erase failed.\n Error string: %1.").arg(prog.getStatusText()));
-        return;
-    default:
-        QMessageBox::critical(this, tr("Error"), tr("LPC chip erase failed(unknown error type).\n Error string: %1.").arg(prog.getStatusText()));
-        return;
+        ui->statusbar->showMessage(tr("No serial number, interrupted programming can't be resumed."), STATUSBAR_TIMEOUT);
+        QApplication::processEvents();
     }
 
-    // patch the firmware.
-    prog.patchFirmware(data);
+    // An interrupted run of the same image continues without erasing.
+    int done = data.length();
+
+    if (journal.isResumable())
+    {
+        ui->statusbar->showMessage(tr("Resuming interrupted programming."), STATUSBAR_TIMEOUT);
+        QApplication::processEvents();
+
+        done = journal.resume();
+        if (prog.getStatus() != QLpcProg::StatusNoError)
+        {
+            QMessageBox::critical(this, tr("Error"), tr("Resuming failed(%1).").arg(prog.getStatusText()));
+
+            return;
+        }
+    }
+    else
+    {
+        ui->statusbar->showMessage(tr("Chip erase."), STATUSBAR_TIMEOUT);
+        QApplication::processEvents();
+
+        prog.chipEraseNonBlank(); // Blank sectors are skipped.
+        switch (prog.getStatus())
+        {
+        case QLpcProg::StatusNoError:
+            break;
+        case QLpcProg::StatusTimeOut:
+            QMessageBox::critical(this, tr("Error"), tr("LPC chip erase timeout."));
+            return;
+        case QLpcProg::StatusError:
+            QMessageBox::critical(this, tr("Error"), tr("LPC chip erase failed.\n Error string: %1.").arg(prog.getStatusText()));
+            return;
+        default:
+            QMessageBox::critical(this, tr("Error"), tr("LPC chip erase failed(unknown error type).\n Error string: %1.").arg(prog.getStatusText()));
+            return;
+        }
+    }
+
+    // program 4096byte blocks, each one stays in a single sector.
+    int chunks = data.length() / 4096;
+    if (data.length() % 4096) chunks++;
+
+    // The next blocks are UU encoded while the current one is on the wire.
+    QLpcEncoder encoder;
+    QList<int> offsets;
+
+    for(int c = chunks - 1; c >= 0; c--)
+    {
+        if (c * 4096 < done)
+        {
+            offsets.append(c * 4096);
+        }
+    }
 
-    // program 1024byte blocks.
-    int chunks = data.length() / 1024;
-    if (data.length() % 1024) chunks++;
+    encoder.start(data, offsets);
 
     for(int c = chunks - 1; c >= 0; c--)
     {
+        if (c * 4096 >= done)
+        {
+            continue;
+        }
+
         ui->statusbar->showMessage(tr("Programming (%1% complete).").arg(((chunks - c - 1) * 100) / chunks), STATUSBAR_TIMEOUT);
         QApplication::processEvents();
 
-        QByteArray chunk = data.mid(c * 1024, 1024);
-        prog.chipProgram(chunk, c * 1024);
+        journal.startBlock(c * 4096);
+
+        QByteArray chunk = data.mid(c * 4096, 4096);
+        prog.chipProgram(chunk, c * 4096, encoder.take(c * 4096));
 
         if (prog.getStatus() != QLpcProg::StatusNoError)
         {
@@ -668,14 +782,240 @@ void QAppMainWindow::fileProgram(const QString &file)
 
             return;
         }
+
+        journal.finishBlock(c * 4096);
     }
 
+    journal.finish();
+
     prog.deinit();
 
     ui->statusbar->clearMessage();
     QMessageBox::information(this, tr("Info"), tr("Chip firmware is programmed successfully."));
 }
 
+void QAppMainWindow::on_findTargets_pushButton_clicked()
+{
+    QLpcDiscovery discovery;
+    int found = 0;
+
+    ui->findTargets_pushButton->setEnabled(false);
+    ui->statusbar->showMessage(tr("Searching for targets."));
+    ui->listWidget->clear();
+
+    discovery.setCrystalValue(ui->crystal_spinBox->value());
+
+    foreach(QLpcDiscovery::Target target, discovery.discover())
+    {
+        if (!target.m_Found)
+        {
+            continue;
+        }
+
+        ui->listWidget->addItem(tr("%1: %2, boot code %3").arg(target.m_Port).arg(QLpcDiscovery::partName(target.m_PartID)).arg(target.m_BootVersion));
+
+        if (found == 0)
+        {
+            ui->ports_comboBox->setCurrentIndex(ui->ports_comboBox->findText(target.m_Port));
+        }
+
+        found++;
+    }
+
+    ui->statusbar->showMessage(tr("%1 target(s) found.").arg(found), STATUSBAR_TIMEOUT);
+    ui->findTargets_pushButton->setEnabled(true);
+}
+
+void QAppMainWindow::on_watch_checkBox_toggled(bool checked)
+{
+    QString file = ui->file_lineEdit->text();
+
+    if (!checked)
+    {
+        watchStop();
+
+        return;
+    }
+
+    if ((ui->ports_comboBox->currentIndex() == -1)||(!QFileInfo(file).isFile()))
+    {
+        ui->watch_checkBox->setChecked(false);
+
+        return;
+    }
+
+    ui->ports_comboBox->setEnabled(false);
+    ui->fileOperation_pushButton->setEnabled(false);
+    ui->listWidget->clear();
+
+    if (m_Preloader.image(file).isEmpty())
+    {
+        m_Preloader.start(file);
+    }
+    else
+    {
+        watchProgram();
+    }
+}
+
+// Programs the sectors that changed since the last build and starts the firmware. The target is
+// synchronized again for the next build, the old image is compared without reading the chip.
+void QAppMainWindow::watchProgram()
+{
+    QString file = ui->file_lineEdit->text();
+    QElapsedTimer timer;
+    QLpcManifest manifest;
+    QList<int> sectors;
+
+    timer.start();
+
+    QByteArray data = m_Preloader.image(file);
+
+    if (data.isEmpty())
+    {
+        return;
+    }
+
+    if (!manifest.fromImage(data))
+    {
+        watchMessage(manifest.errorText());
+
+        return;
+    }
+
+    if (m_WatchProg)
+    {
+        // The firmware of the last build is running, unless reset is disabled.
+        m_WatchProg->readPartID();
+        if (m_WatchProg->getStatus() != QLpcProg::StatusNoError)
+        {
+            m_WatchProg->resync();
+        }
+    }
+    else
+    {
+        m_WatchProg = new QLpcProg();
+
+        m_WatchProg->init(ui->ports_comboBox->currentText());
+        if (m_WatchProg->getStatus() == QLpcProg::StatusNoError) m_WatchProg->setCrystalValue(ui->crystal_spinBox->value());
+        if (m_WatchProg->getStatus() == QLpcProg::StatusNoError) m_WatchProg->setEcho(false);
+    }
+
+    if (m_WatchProg->getStatus() != QLpcProg::StatusNoError)
+    {
+        watchMessage(tr("LPC could\'t be initialized(%1).").arg(m_WatchProg->getStatusText()));
+
+        delete m_WatchProg;
+        m_WatchProg = 0;
+        m_WatchManifest.clear();
+
+        return;
+    }
+
+    // The chip is only read when nothing is known about its content.
+    if (m_WatchManifest.isEmpty())
+    {
+        sectors = manifest.compareDevice(m_WatchProg);
+        if (m_WatchProg->getStatus() != QLpcProg::StatusNoError)
+        {
+            watchMessage(tr("LPC read sector CRC failed(%1).").arg(m_WatchProg->getStatusText()));
+
+            return;
+        }
+    }
+    else
+    {
+        sectors = m_WatchManifest.diff(manifest);
+    }
+
+    // Half programmed sectors are found by reading the chip next time.
+    m_WatchManifest.clear();
+
+    for(int c = 0; c < sectors.count(); c++)
+    {
+        int start = sectors.at(c);
+
+        while((c + 1 < sectors.count())&&(sectors.at(c + 1) == sectors.at(c) + 1))
+        {
+            c++;
+        }
+
+        m_WatchProg->chipErase(start, sectors.at(c));
+        if (m_WatchProg->getStatus() != QLpcProg::StatusNoError)
+        {
+            watchMessage(tr("LPC chip erase failed(%1).").arg(m_WatchProg->getStatusText()));
+
+            return;
+        }
+    }
+
+    int chunks = data.length() / 4096;
+    if (data.length() % 4096) chunks++;
+
+    // The preloader left every block of this image in the encode cache.
+    QLpcEncoder encoder;
+    QList<int> offsets;
+
+    for(int c = chunks - 1; c >= 0; c--)
+    {
+        QByteArray block = data.mid(c * 4096, 4096);
+
+        if ((sectors.contains(QLpcProg::sectorFromAddress(c * 4096)))&&(block.count((char)0xFF) != block.length()))
+        {
+            offsets.append(c * 4096);
+        }
+    }
+
+    encoder.start(data, offsets);
+
+    foreach(int offset, offsets)
+    {
+        m_WatchProg->chipProgram(data.mid(offset, 4096), offset, encoder.take(offset));
+        if (m_WatchProg->getStatus() != QLpcProg::StatusNoError)
+        {
+            watchMessage(tr("Programming failed(%1).").arg(m_WatchProg->getStatusText()));
+
+            return;
+        }
+    }
+
+    m_WatchManifest.fromImage(data);
+
+    // Resets into the new firmware, the next build finds the port closed and resyncs.
+    m_WatchProg->deinit();
+
+    watchMessage(tr("%1 changed sector(s) programmed in %2 ms.").arg(sectors.count()).arg(timer.elapsed()));
+}
+
+// The reset on close starts the last programmed firmware.
+void QAppMainWindow::watchStop()
+{
+    if (m_WatchProg)
+    {
+        m_WatchProg->deinit();
+
+        delete m_WatchProg;
+        m_WatchProg = 0;
+    }
+
+    m_WatchManifest.clear();
+
+    ui->ports_comboBox->setEnabled(true);
+    ui->fileOperation_pushButton->setEnabled(!ui->file_lineEdit->text().isEmpty());
+}
+
+void QAppMainWindow::watchMessage(const QString &text)
+{
+    ui->listWidget->addItem(text);
+    ui->statusbar->showMessage(text);
+}
+
+void QAppMainWindow::verifyProgress(int percent)
+{
+    ui->statusbar->showMessage(tr("Verify (%1% complete).").arg(percent), STATUSBAR_TIMEOUT);
+    QApplication::processEvents();
+}
+
 void QAppMainWindow::fileVerify(const QString &file)
 {
     if (ui->ports_comboBox->currentIndex() == -1)
@@ -684,16 +1024,21 @@ void QAppMainWindow::fileVerify(const QString &file)
     }
 
     // Read file
-    QHexLoader loader;
+    QByteArray data = m_Preloader.image(file);
 
-    if (loader.load(file) == false)
+    if (data.isEmpty())
     {
-        QMessageBox::critical(this, tr("Error"), tr("Error loading hex file."));
+        QHexLoader loader;
 
-        return;
-    }
+        if (loader.load(file) == false)
+        {
+            QMessageBox::critical(this, tr("Error"), tr("Error loading hex file."));
+
+            return;
+        }
 
-    QByteArray data = loader.data();
+        data = loader.data();
+    }
 
     if (data.isEmpty())
     {
@@ -782,38 +1127,31 @@ void QAppMainWindow::fileVerify(const QString &file)
     // patch the firmware.
     prog.patchFirmware(data);
 
-    // verify 1024byte blocks.
-    int chunks = data.length() / 1024;
-    if (data.length() % 1024) chunks++;
+    // verify CRC32 of every sector, read back with R.
+    QLpcVerify verify(&prog);
 
-    for(int c = 0; c < chunks; c++)
-    {
-        ui->statusbar->showMessage(tr("Verify (%1% complete).").arg((c * 100) / chunks), STATUSBAR_TIMEOUT);
-        QApplication::processEvents();
+    connect(&verify, SIGNAL(progress(int)), this, SLOT(verifyProgress(int)));
 
-        if (c != 0) // Do not verify first 32 bytes.
-        {
-            QByteArray chunk = data.mid(c * 1024, 1024);
-            prog.chipVerify(chunk, c * 1024);
-        }
-        else
-        {
-            QByteArray chunk = data.mid(64, 1024 - 64);
-            prog.chipVerify(chunk, 64);
-        }
+    bool matches = verify.verify(data, ui->fastFail_checkBox->isChecked());
 
-        if (prog.getStatus() != QLpcProg::StatusNoError)
-        {
-            QMessageBox::warning(this, tr("Verify Failed"), tr("Chip firmware <b>does not match</b> file."));
+    ui->listWidget->clear();
 
-            break;
-        }
-        else
-        {
-            QMessageBox::information(this, tr("Verify Successfull"), tr("Chip firmware <b>matches</b> file."));
+    foreach(QString line, verify.resultText())
+    {
+        ui->listWidget->addItem(line);
+    }
 
-            break;
-        }
+    if (verify.getStatus() != QLpcProg::StatusNoError)
+    {
+        QMessageBox::critical(this, tr("Error"), tr("LPC verify failed.\n Error string: %1.").arg(verify.getStatusText()));
+    }
+    else if (matches)
+    {
+        QMessageBox::information(this, tr("Verify Successfull"), tr("Chip firmware <b>matches</b> file."));
+    }
+    else
+    {
+        QMessageBox::warning(this, tr("Verify Failed"), tr("Chip firmware <b>does not match</b> file."));
     }
 
     prog.deinit();
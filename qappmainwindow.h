@@ -1,12 +1,19 @@
 #ifndef QAPPMAINWINDOW_H
 #define QAPPMAINWINDOW_H
 
+#include "qlpcmanifest.h"
+#include "qlpcpreloader.h"
+
 #include <QMainWindow>
+#include <QThread>
 
 namespace Ui {
 class QMainWindow;
 }
 
+class QLpcPortWatcher;
+class QLpcProg;
+
 class QAppMainWindow : public QMainWindow
 {
     Q_OBJECT
@@ -14,9 +21,6 @@ class QAppMainWindow : public QMainWindow
 public:
     explicit QAppMainWindow(QWidget *parent = 0);
     ~QAppMainWindow();
-
-protected:
-    void timerEvent (QTimerEvent *event);
     
 private slots:
     void on_chipID_pushButton_clicked();
@@ -28,14 +32,28 @@ private slots:
     void on_read_pushButton_clicked();
     void on_decompile_pushButton_clicked();
     void on_file_lineEdit_textChanged(const QString &text);
+    void on_findTargets_pushButton_clicked();
+    void on_watch_checkBox_toggled(bool checked);
+    void watchProgram();
+    void imagePrepared(const QString &file, bool ok, const QString &text);
+    void verifyProgress(int percent);
+    void serialPortAdded(const QString &port);
+    void serialPortRemoved(const QString &port);
 
 private:
-    void updateSerialPorts();
     void fileProgram(const QString &file);
     void fileVerify(const QString &file);
     void fileDecompile(const QString &file);
+    void watchStop();
+    void watchMessage(const QString &text);
+
+    QThread m_SerialPortThread;
+    QLpcPortWatcher *m_SerialPortWatcher;
+
+    QLpcProg *m_WatchProg;
+    QLpcManifest m_WatchManifest;
 
-    int m_SerialPortTimer;
+    QLpcPreloader m_Preloader;
 
     Ui::QMainWindow *ui;
 };
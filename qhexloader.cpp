@@ -1,4 +1,5 @@
 #include "qhexloader.h"
+#include "qlpcprog.h"
 #include <QString>
 #include <QFile>
 
@@ -101,13 +102,104 @@ bool QHexLoader::load(const QString& p_Filename)
 QByteArray QHexLoader::data()
 {
     QByteArray ret;
+    QByteArray used;
 
+    if (!image(ret, used))
+    {
+        return QByteArray();
+    }
+
+    return ret;
+}
+
+// Start linear address record(type 5), 0 if the file has none.
+quint32 QHexLoader::entryPoint()
+{
+    quint32 ret = 0;
+
+    foreach(QHexRow row, m_Rows)
+    {
+        if ((row.m_Type == 5)&&(row.m_Data.count() == 4))
+        {
+            ret = ((quint8)row.m_Data.at(0) << 24)|((quint8)row.m_Data.at(1) << 16)|((quint8)row.m_Data.at(2) << 8)|((quint8)row.m_Data.at(3) << 0);
+        }
+    }
+
+    return ret;
+}
+
+// Combines bootloader, application and other hex files into one image. Gaps are filled with
+// 0xFF and the end is padded to a sector boundary, so erase and programming cover the same
+// sectors. Files may overlap only where they hold the same bytes.
+QByteArray QHexLoader::merge(const QStringList &p_Filenames, QString *p_Error)
+{
+    QByteArray ret;
+    QByteArray owner; // Index + 1 of the file that wrote each byte, 0 for gaps.
+
+    for(int c = 0; c < p_Filenames.count(); c++)
+    {
+        QHexLoader loader;
+        QByteArray data;
+        QByteArray used;
+
+        if ((loader.load(p_Filenames.at(c)) == false)||(loader.image(data, used) == false))
+        {
+            if (p_Error) *p_Error = tr("Error loading hex file(%1).").arg(p_Filenames.at(c));
+
+            return QByteArray();
+        }
+
+        if (data.count() > ret.count())
+        {
+            owner.append(QByteArray(data.count() - ret.count(), (char)0));
+            ret.append(QByteArray(data.count() - ret.count(), (char)0xFF));
+        }
+
+        for(int pos = 0; pos < data.count(); pos++)
+        {
+            if (used.at(pos) == 0)
+            {
+                continue;
+            }
+
+            if ((owner.at(pos) != 0)&&(ret.at(pos) != data.at(pos)))
+            {
+                if (p_Error) *p_Error = tr("%1 overlaps %2 at %3.").arg(p_Filenames.at(c)).arg(p_Filenames.at(owner.at(pos) - 1)).arg(QString::number(pos, 16).toUpper());
+
+                return QByteArray();
+            }
+
+            ret[pos] = data.at(pos);
+            owner[pos] = (char)(c + 1);
+        }
+    }
+
+    int sector = QLpcProg::sectorFromAddress(ret.count() - 1);
+
+    if ((ret.isEmpty())||(sector < 0))
+    {
+        if (p_Error) *p_Error = tr("Merged image does not fit in flash.");
+
+        return QByteArray();
+    }
+
+    ret.append(QByteArray(QLpcProg::sectorAddress(sector) + QLpcProg::sectorSize(sector) - ret.count(), (char)0xFF));
+
+    return ret;
+}
+
+// Lays the data records out from address 0, p_Used is 1 for every byte a record wrote and
+// gaps are 0xFF.
+bool QHexLoader::image(QByteArray &p_Data, QByteArray &p_Used)
+{
     quint16 page = 0;
-    bool unknown = false;
-    bool last = false;
     int pos;
 
-    ret.reserve(512 * 1024); // Preallocate maximum size.
+    p_Data.clear();
+    p_Used.clear();
+
+    p_Data.reserve(512 * 1024); // Preallocate maximum size.
+    p_Used.reserve(512 * 1024);
 
     foreach(QHexRow row, m_Rows)
     {
@@ -115,36 +207,38 @@ QByteArray QHexLoader::data()
         {
         case 0:
             pos = (page * 0x10000) + row.m_Address;
-            ret.resize(pos + row.m_Data.count());
+
+            if (pos + row.m_Data.count() > p_Data.count())
+            {
+                p_Used.append(QByteArray(pos + row.m_Data.count() - p_Data.count(), (char)0));
+                p_Data.append(QByteArray(pos + row.m_Data.count() - p_Data.count(), (char)0xFF));
+            }
 
             for(int c = 0; c < row.m_Data.count(); c++)
             {
-                ret[pos + c] = row.m_Data.at(c);
+                p_Data[pos + c] = row.m_Data.at(c);
+                p_Used[pos + c] = 1;
             }
             break;
         case 1:
-            last = true;
-            break;
         case 3:
-            unknown = true; // TODO: Unknown hex line.
+        case 5:
             break;
         case 4:
             if (row.m_Data.count() != 2)
             {
-                return QByteArray();
+                return false;
             }
 
             page = (row.m_Data.at(0) << 8)|(row.m_Data.at(1) << 0);
             break;
-        case 5:
-            unknown = true; // TODO: Unknown hex line.
-            break;
         default:
-            return QByteArray();
+            return false;
         }
     }
 
-    ret.squeeze(); // Reallocate down to needed size.
+    p_Data.squeeze(); // Reallocate down to needed size.
+    p_Used.squeeze();
 
-    return ret;
+    return true;
 }
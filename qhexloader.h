@@ -2,6 +2,7 @@
 #define QHEXLOADER_H
 
 #include <QByteArray>
+#include <QStringList>
 #include <QObject>
 
 struct QHexRow{
@@ -17,8 +18,12 @@ public:
     bool load(const QString &p_Filename);
 
     QByteArray data();
+    quint32 entryPoint();
+
+    static QByteArray merge(const QStringList &p_Filenames, QString *p_Error = NULL);
 
 private:
+    bool image(QByteArray &p_Data, QByteArray &p_Used);
 
     QList<QHexRow> m_Rows;
 };
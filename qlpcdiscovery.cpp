@@ -0,0 +1,170 @@
+#include "qlpcdiscovery.h"
+#include "qlpcprog.h"
+
+#include <QCoreApplication>
+#include <QThreadPool>
+#include <QRunnable>
+
+
+class QLpcDiscoveryTask : public QRunnable
+{
+public:
+    QLpcDiscoveryTask(QLpcDiscovery *discovery, const QString &port) :
+        m_discovery(discovery),
+        m_port(port)
+    {
+    }
+
+    void run()
+    {
+        m_discovery->probe(m_port);
+    }
+
+private:
+    QLpcDiscovery *m_discovery;
+    QString m_port;
+};
+
+
+QLpcDiscovery::QLpcDiscovery(QObject *parent) :
+    QObject(parent),
+    m_crystalValue(12000),
+    m_syncTimeout(500)
+{
+}
+
+void QLpcDiscovery::setCrystalValue(int value)
+{
+    m_crystalValue = value;
+}
+
+void QLpcDiscovery::setSyncTimeout(int msecs)
+{
+    m_syncTimeout = msecs;
+}
+
+// Every port is probed at the same time, so the whole pass takes about one sync timeout.
+// Events are processed while waiting, the results come in port order.
+QList<QLpcDiscovery::Target> QLpcDiscovery::discover(const QStringList &ports)
+{
+    QThreadPool pool;
+    QList<Target> ret;
+
+    m_targets.clear();
+
+    pool.setMaxThreadCount(qMax(ports.count(), 1));
+
+    foreach(QString port, ports)
+    {
+        pool.start(new QLpcDiscoveryTask(this, port));
+    }
+
+    while(!pool.waitForDone(50))
+    {
+        QCoreApplication::processEvents();
+    }
+
+    foreach(QString port, ports)
+    {
+        foreach(Target target, m_targets)
+        {
+            if (target.m_Port == port)
+            {
+                ret.append(target);
+            }
+        }
+    }
+
+    return ret;
+}
+
+QList<QLpcDiscovery::Target> QLpcDiscovery::discover()
+{
+    return discover(QLpcProg::detectSerialPorts());
+}
+
+QString QLpcDiscovery::partName(int partID)
+{
+    switch(partID)
+    {
+    case QLpcProg::LPC2141:
+        return "LPC2141";
+    case QLpcProg::LPC2142:
+        return "LPC2142";
+    case QLpcProg::LPC2144:
+        return "LPC2144";
+    case QLpcProg::LPC2146:
+        return "LPC2146";
+    case QLpcProg::LPC2148:
+        return "LPC2148";
+    default:
+        return QString::number(partID);
+    }
+}
+
+// Reverse of partName(), -1 if the name is neither a known part nor a number.
+int QLpcDiscovery::partFromName(const QString &name)
+{
+    QList<int> parts;
+    bool ok;
+
+    parts << QLpcProg::LPC2141 << QLpcProg::LPC2142 << QLpcProg::LPC2144 << QLpcProg::LPC2146 << QLpcProg::LPC2148;
+
+    foreach(int part, parts)
+    {
+        if (partName(part).compare(name, Qt::CaseInsensitive) == 0)
+        {
+            return part;
+        }
+    }
+
+    int ret = name.toInt(&ok, 0);
+
+    return ok ? ret : -1;
+}
+
+void QLpcDiscovery::probe(const QString &port)
+{
+    QLpcProg::SyncOptions options;
+    QLpcProg prog;
+    Target target;
+
+    options.m_SyncTimeout = m_syncTimeout;
+
+    target.m_Port = port;
+    target.m_Found = false;
+    target.m_PartID = 0;
+
+    prog.setSyncOptions(options);
+    prog.init(port);
+
+    if (prog.getStatus() == QLpcProg::StatusNoError)
+    {
+        prog.setCrystalValue(m_crystalValue);
+    }
+
+    if (prog.getStatus() == QLpcProg::StatusNoError)
+    {
+        target.m_PartID = prog.readPartID();
+    }
+
+    if (prog.getStatus() == QLpcProg::StatusNoError)
+    {
+        target.m_BootVersion = prog.readBootCodeVersion();
+    }
+
+    if (prog.getStatus() == QLpcProg::StatusNoError)
+    {
+        target.m_Found = true;
+    }
+    else
+    {
+        target.m_Error = prog.getStatusText();
+    }
+
+    prog.deinit();
+
+    QMutexLocker locker(&m_mutex);
+
+    m_targets.append(target);
+}
@@ -0,0 +1,44 @@
+#ifndef QLPCDISCOVERY_H
+#define QLPCDISCOVERY_H
+
+#include <QStringList>
+#include <QObject>
+#include <QMutex>
+#include <QList>
+
+// Probes serial ports for an LPC bootloader, one pool thread per port.
+class QLpcDiscovery : public QObject
+{
+    Q_OBJECT
+public:
+    struct Target {
+        QString m_Port;
+        bool m_Found;
+        int m_PartID;
+        QString m_BootVersion;
+        QString m_Error;
+    };
+
+    explicit QLpcDiscovery(QObject *parent = 0);
+
+    void setCrystalValue(int value);
+    void setSyncTimeout(int msecs);
+
+    QList<Target> discover(const QStringList &ports);
+    QList<Target> discover();
+
+    static QString partName(int partID);
+    static int partFromName(const QString &name);
+
+private:
+    void probe(const QString &port);
+
+    int m_crystalValue;
+    int m_syncTimeout;
+    QList<Target> m_targets;
+    QMutex m_mutex;
+
+    friend class QLpcDiscoveryTask;
+};
+
+#endif // QLPCDISCOVERY_H
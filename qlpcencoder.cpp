@@ -0,0 +1,305 @@
+#include "qlpcencoder.h"
+#include "qlpcprog.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QRunnable>
+#include <QFile>
+#include <QDir>
+
+#define ENCODER_THREADS 2
+#define ENCODER_WINDOW 4
+#define ENCODER_CACHED_IMAGES 4
+#define ENCODER_CACHE_VERSION 1
+
+static QMap<QString, QMap<int, QList<QByteArray> > > encodedCache;
+static QStringList encodedCacheOrder;
+static QMutex encodedCacheMutex;
+
+
+class QLpcEncoderTask : public QRunnable
+{
+public:
+    QLpcEncoderTask(QLpcEncoder *encoder, const QByteArray &image, int offset, int blockSize) :
+        m_encoder(encoder),
+        m_image(image),
+        m_offset(offset),
+        m_blockSize(blockSize)
+    {
+    }
+
+    void run()
+    {
+        m_encoder->encoded(m_offset, QLpcEncoder::encodeBlock(m_image, m_offset, m_blockSize));
+    }
+
+private:
+    QLpcEncoder *m_encoder;
+    QByteArray m_image;
+    int m_offset;
+    int m_blockSize;
+};
+
+
+QLpcEncoder::QLpcEncoder(QObject *parent) :
+    QObject(parent),
+    m_blockSize(4096),
+    m_window(ENCODER_WINDOW),
+    m_dirty(false)
+{
+    m_pool.setMaxThreadCount(ENCODER_THREADS);
+}
+
+QLpcEncoder::~QLpcEncoder()
+{
+    stop();
+}
+
+// Number of blocks that are encoded or being encoded ahead of the one in use.
+void QLpcEncoder::setWindow(int blocks)
+{
+    m_window = qMax(blocks, 1);
+}
+
+// Empty disables the disk cache.
+void QLpcEncoder::setCacheDir(const QString &dir)
+{
+    m_cacheDir = dir;
+}
+
+// Per device data(QLpcInjector::patches()) applied on top of the image given to start(). Only
+// the blocks they touch are encoded, the rest comes from the cache of the plain image.
+void QLpcEncoder::setPatches(const QMap<int, QByteArray> &patches)
+{
+    m_patches = patches;
+}
+
+// Offsets are the order the blocks will be taken in. Blocks cached by an earlier run are
+// not encoded again.
+void QLpcEncoder::start(const QByteArray &image, const QList<int> &offsets, int blockSize)
+{
+    stop();
+
+    m_key = QCryptographicHash::hash(image, QCryptographicHash::Sha1).toHex() + "-" + QString::number(blockSize);
+
+    encodedCacheMutex.lock();
+    m_cached = encodedCache.value(m_key);
+    encodedCacheMutex.unlock();
+
+    if (m_cached.isEmpty())
+    {
+        loadCache();
+    }
+
+    QMutexLocker locker(&m_mutex);
+
+    m_image = image;
+    m_blockSize = blockSize;
+    m_patched.clear();
+
+    foreach(int address, m_patches.keys())
+    {
+        const QByteArray &data = m_patches.value(address);
+
+        QLpcProg::injectData(m_image, address, data);
+
+        for(int offset = (address / blockSize) * blockSize; offset < address + data.length(); offset += blockSize)
+        {
+            m_patched.append(offset);
+        }
+
+        // The vector signature changes with the vectors.
+        if (address < 32)
+        {
+            m_patched.append(0);
+        }
+    }
+
+    // Data injected past the end grows the image, a block whose padded size changed with it
+    // can't come from the cache of the plain image either.
+    for(int offset = 0; offset < m_image.length(); offset += blockSize)
+    {
+        if ((QLpcProg::copySize(image.mid(offset, blockSize).length()) != QLpcProg::copySize(m_image.mid(offset, blockSize).length()))&&(!m_patched.contains(offset)))
+        {
+            m_patched.append(offset);
+        }
+    }
+
+    foreach(int offset, offsets)
+    {
+        if ((!m_cached.contains(offset))||(m_patched.contains(offset)))
+        {
+            m_waiting.append(offset);
+        }
+    }
+
+    schedule();
+}
+
+void QLpcEncoder::stop()
+{
+    m_mutex.lock();
+    m_waiting.clear();
+    m_mutex.unlock();
+
+    m_pool.waitForDone();
+
+    QMutexLocker locker(&m_mutex);
+
+    m_busy.clear();
+    m_encoded.clear();
+
+    if (m_dirty)
+    {
+        saveCache();
+    }
+}
+
+// Waits for the block if it is still being encoded. A block that wasn't scheduled is
+// encoded right here.
+QList<QByteArray> QLpcEncoder::take(int offset)
+{
+    QMutexLocker locker(&m_mutex);
+    QList<QByteArray> ret;
+
+    if ((m_cached.contains(offset))&&(!m_patched.contains(offset)))
+    {
+        return m_cached.value(offset);
+    }
+
+    if ((!m_encoded.contains(offset))&&(!m_busy.contains(offset)))
+    {
+        m_waiting.removeAll(offset);
+
+        locker.unlock();
+        ret = encodeBlock(m_image, offset, m_blockSize);
+        locker.relock();
+    }
+    else
+    {
+        while(!m_encoded.contains(offset))
+        {
+            m_ready.wait(&m_mutex);
+        }
+
+        ret = m_encoded.take(offset);
+
+        schedule();
+    }
+
+    // Patched blocks belong to one device only.
+    if (!m_patched.contains(offset))
+    {
+        m_cached.insert(offset, ret);
+        m_dirty = true;
+    }
+
+    return ret;
+}
+
+// The groups chipProgram() sends for the block at offset, padded to the copy size.
+QList<QByteArray> QLpcEncoder::encodeBlock(const QByteArray &image, int offset, int blockSize)
+{
+    QByteArray chunk = image.mid(offset, blockSize);
+    int size = QLpcProg::copySize(chunk.length());
+
+    if (chunk.length() < size)
+    {
+        chunk.append(QByteArray(size - chunk.length(), (char)255));
+    }
+
+    return QLpcProg::encodeUUGroups(chunk);
+}
+
+// Called with the mutex locked.
+void QLpcEncoder::schedule()
+{
+    while((!m_waiting.isEmpty())&&(m_busy.count() + m_encoded.count() < m_window))
+    {
+        int offset = m_waiting.takeFirst();
+
+        m_busy.append(offset);
+        m_pool.start(new QLpcEncoderTask(this, m_image, offset, m_blockSize));
+    }
+}
+
+QString QLpcEncoder::cacheFile() const
+{
+    return QDir(m_cacheDir).filePath(m_key + ".uu");
+}
+
+void QLpcEncoder::loadCache()
+{
+    if (m_cacheDir.isEmpty())
+    {
+        return;
+    }
+
+    QFile file(cacheFile());
+
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        return;
+    }
+
+    QDataStream stream(&file);
+    QMap<int, QList<QByteArray> > cached;
+    quint32 version;
+    QString key;
+
+    stream.setVersion(QDataStream::Qt_4_8);
+    stream >> version >> key >> cached;
+
+    if ((stream.status() == QDataStream::Ok)&&(version == ENCODER_CACHE_VERSION)&&(key == m_key))
+    {
+        m_cached = cached;
+    }
+}
+
+// Called with the mutex locked.
+void QLpcEncoder::saveCache()
+{
+    m_dirty = false;
+
+    encodedCacheMutex.lock();
+
+    encodedCache.insert(m_key, m_cached);
+    encodedCacheOrder.removeAll(m_key);
+    encodedCacheOrder.append(m_key);
+
+    while(encodedCacheOrder.count() > ENCODER_CACHED_IMAGES)
+    {
+        encodedCache.remove(encodedCacheOrder.takeFirst());
+    }
+
+    encodedCacheMutex.unlock();
+
+    if (m_cacheDir.isEmpty())
+    {
+        return;
+    }
+
+    QDir().mkpath(m_cacheDir);
+
+    QFile file(cacheFile());
+
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        return;
+    }
+
+    QDataStream stream(&file);
+
+    stream.setVersion(QDataStream::Qt_4_8);
+    stream << (quint32)ENCODER_CACHE_VERSION << m_key << m_cached;
+}
+
+void QLpcEncoder::encoded(int offset, const QList<QByteArray> &groups)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_busy.removeAll(offset);
+    m_encoded.insert(offset, groups);
+
+    m_ready.wakeAll();
+}
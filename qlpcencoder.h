@@ -0,0 +1,59 @@
+#ifndef QLPCENCODER_H
+#define QLPCENCODER_H
+
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QByteArray>
+#include <QObject>
+#include <QMutex>
+#include <QList>
+#include <QMap>
+
+// Encodes the blocks of an image into UU groups on worker threads while the link is busy
+// with the block before. Only a few blocks are encoded ahead, take() hands them out in the
+// order given to start(). Encoded blocks are kept per image hash and block size for the next
+// run, in memory and in the cache directory if one is set.
+class QLpcEncoder : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcEncoder(QObject *parent = 0);
+    virtual ~QLpcEncoder();
+
+    void setWindow(int blocks);
+    void setCacheDir(const QString &dir);
+    void setPatches(const QMap<int, QByteArray> &patches);
+    void start(const QByteArray &image, const QList<int> &offsets, int blockSize = 4096);
+    void stop();
+
+    QList<QByteArray> take(int offset);
+
+    static QList<QByteArray> encodeBlock(const QByteArray &image, int offset, int blockSize);
+
+private:
+    void schedule();
+    void encoded(int offset, const QList<QByteArray> &groups);
+    QString cacheFile() const;
+    void loadCache();
+    void saveCache();
+
+    QThreadPool m_pool;
+    QMutex m_mutex;
+    QWaitCondition m_ready;
+    QByteArray m_image;
+    int m_blockSize;
+    int m_window;
+    QList<int> m_waiting;
+    QList<int> m_busy;
+    QMap<int, QList<QByteArray> > m_encoded;
+    QString m_cacheDir;
+    QString m_key;
+    QMap<int, QList<QByteArray> > m_cached;
+    QMap<int, QByteArray> m_patches;
+    QList<int> m_patched;
+    bool m_dirty;
+
+    friend class QLpcEncoderTask;
+};
+
+#endif // QLPCENCODER_H
@@ -0,0 +1,280 @@
+#include "qlpcgang.h"
+#include "qlpcsession.h"
+#include "qlpcencoder.h"
+
+#include <QEventLoop>
+
+
+QLpcGang::QLpcGang(QObject *parent) :
+    QObject(parent),
+    m_crystalValue(12000),
+    m_baudRate(0),
+    m_verify(true),
+    m_running(0)
+{
+}
+
+QLpcGang::~QLpcGang()
+{
+    foreach(Target target, m_targets)
+    {
+        delete target.m_Session;
+    }
+}
+
+// The image should already be patched(QLpcProg::patchFirmware).
+void QLpcGang::setImage(const QByteArray &image)
+{
+    m_image = image;
+
+    // M compares whole words.
+    while(m_image.length() % 4)
+    {
+        m_image.append((char)255);
+    }
+}
+
+void QLpcGang::setCrystalValue(int value)
+{
+    m_crystalValue = value;
+}
+
+void QLpcGang::setBaudRate(int baudRate)
+{
+    m_baudRate = baudRate;
+}
+
+void QLpcGang::setVerify(bool verify)
+{
+    m_verify = verify;
+}
+
+void QLpcGang::setSyncOptions(const QLpcProg::SyncOptions &options)
+{
+    m_syncOptions = options;
+}
+
+void QLpcGang::setEncodeCacheDir(const QString &dir)
+{
+    m_encodeCacheDir = dir;
+}
+
+// Returns false if a previous run is still going or the image doesn't fit in flash.
+bool QLpcGang::start(const QStringList &ports)
+{
+    if ((m_running > 0)||(m_image.isEmpty())||(QLpcProg::sectorFromAddress(m_image.length() - 1) < 0))
+    {
+        return false;
+    }
+
+    foreach(Target target, m_targets)
+    {
+        delete target.m_Session;
+    }
+
+    m_targets.clear();
+
+    // Every target gets the same wire data, it is encoded once.
+    QLpcEncoder encoder;
+    QList<int> offsets;
+
+    for(int offset = 0; offset < m_image.length(); offset += 4096)
+    {
+        offsets.append(offset);
+    }
+
+    encoder.setCacheDir(m_encodeCacheDir);
+    encoder.start(m_image, offsets);
+
+    m_encoded.clear();
+
+    foreach(int offset, offsets)
+    {
+        m_encoded.insert(offset, encoder.take(offset));
+    }
+
+    foreach(QString port, ports)
+    {
+        Target target;
+
+        target.m_Session = new QLpcSession(this);
+        target.m_Result.m_Port = port;
+        target.m_Result.m_Ok = false;
+        target.m_Result.m_Elapsed = 0;
+        target.m_FirstId = 0;
+        target.m_LastId = 0;
+        target.m_Finished = false;
+        target.m_Timer.start();
+
+        connect(target.m_Session, SIGNAL(finished(int,QLpcProg::Status,QString,QVariant)), this, SLOT(sessionFinished(int,QLpcProg::Status,QString)));
+
+        m_targets.append(target);
+    }
+
+    m_running = m_targets.count();
+
+    for(int c = 0; c < m_targets.count(); c++)
+    {
+        Target &target = m_targets[c];
+
+        if (!target.m_Session->open(target.m_Result.m_Port))
+        {
+            finishTarget(target, false, tr("Could\'t open serial port(%1)").arg(target.m_Result.m_Port));
+
+            continue;
+        }
+
+        queueOperations(target);
+    }
+
+    return true;
+}
+
+// Blocks in a local event loop until every target is done. Returns true if all of them passed.
+bool QLpcGang::run(const QStringList &ports)
+{
+    QEventLoop loop;
+
+    connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
+
+    if (!start(ports))
+    {
+        return false;
+    }
+
+    if (isRunning())
+    {
+        loop.exec();
+    }
+
+    foreach(Target target, m_targets)
+    {
+        if (!target.m_Result.m_Ok)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool QLpcGang::isRunning() const
+{
+    return m_running > 0;
+}
+
+QList<QLpcGang::Result> QLpcGang::results() const
+{
+    QList<Result> ret;
+
+    foreach(Target target, m_targets)
+    {
+        ret.append(target.m_Result);
+    }
+
+    return ret;
+}
+
+void QLpcGang::sessionFinished(int id, QLpcProg::Status status, const QString &statusText)
+{
+    for(int c = 0; c < m_targets.count(); c++)
+    {
+        Target &target = m_targets[c];
+
+        if ((target.m_Session != sender())||(target.m_Finished))
+        {
+            continue;
+        }
+
+        if (status != QLpcProg::StatusNoError)
+        {
+            finishTarget(target, false, statusText);
+        }
+        else if (id == target.m_LastId)
+        {
+            finishTarget(target, true, QString());
+        }
+        else
+        {
+            emit progress(target.m_Result.m_Port, ((id - target.m_FirstId + 1) * 100) / (target.m_LastId - target.m_FirstId + 1));
+        }
+
+        return;
+    }
+}
+
+// Everything goes in at once, a failed operation cancels the rest of the queue.
+void QLpcGang::queueOperations(Target &target)
+{
+    QLpcSession *session = target.m_Session;
+    int last_sector = QLpcProg::sectorFromAddress(m_image.length() - 1);
+    int chunks = (m_image.length() + 4095) / 4096;
+    QList<int> ids;
+
+    session->setSyncOptions(m_syncOptions);
+
+    target.m_FirstId = session->sync(m_crystalValue);
+    ids.append(target.m_FirstId);
+
+    if (m_baudRate > 0)
+    {
+        ids.append(session->setBaudRate(m_baudRate));
+    }
+
+    target.m_LastId = session->erase(0, last_sector);
+    ids.append(target.m_LastId);
+
+    for(int c = chunks - 1; c >= 0; c--)
+    {
+        QByteArray block = m_image.mid(c * 4096, 4096);
+
+        // Erased flash reads as 0xFF, the block is already there.
+        if (block.count((char)0xFF) == block.length())
+        {
+            continue;
+        }
+
+        target.m_LastId = session->program(block, c * 4096, m_encoded.value(c * 4096));
+        ids.append(target.m_LastId);
+    }
+
+    if (m_verify)
+    {
+        for(int c = 0; c < chunks; c++)
+        {
+            // Vectors are not readable in ISP.
+            int start = (c == 0) ? 64 : c * 4096;
+
+            if (start < m_image.length())
+            {
+                target.m_LastId = session->verify(m_image.mid(start, (c + 1) * 4096 - start), start);
+                ids.append(target.m_LastId);
+            }
+        }
+    }
+
+    // Nothing would ever report the last id, don't wait for it.
+    if (ids.contains(-1))
+    {
+        finishTarget(target, false, tr("Couldn\'t queue the operations for %1").arg(target.m_Result.m_Port));
+    }
+}
+
+void QLpcGang::finishTarget(Target &target, bool ok, const QString &error)
+{
+    target.m_Finished = true;
+    target.m_Result.m_Ok = ok;
+    target.m_Result.m_Error = error;
+    target.m_Result.m_Elapsed = target.m_Timer.elapsed();
+
+    target.m_Session->close();
+
+    m_running--;
+
+    emit targetFinished(target.m_Result.m_Port, ok, error);
+
+    if (m_running == 0)
+    {
+        emit finished();
+    }
+}
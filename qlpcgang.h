@@ -0,0 +1,77 @@
+#ifndef QLPCGANG_H
+#define QLPCGANG_H
+
+#include "qlpcprog.h"
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QByteArray>
+#include <QObject>
+#include <QList>
+#include <QMap>
+
+class QLpcSession;
+
+// Programs one image into many targets at once from the thread it lives in. Each port gets a
+// QLpcSession with the whole sync/erase/program/verify sequence queued up front, the sessions
+// are driven by the event loop so waiting on the links costs no CPU.
+class QLpcGang : public QObject
+{
+    Q_OBJECT
+public:
+    struct Result {
+        QString m_Port;
+        bool m_Ok;
+        QString m_Error;
+        qint64 m_Elapsed;
+    };
+
+    explicit QLpcGang(QObject *parent = 0);
+    virtual ~QLpcGang();
+
+    void setImage(const QByteArray &image);
+    void setCrystalValue(int value);
+    void setBaudRate(int baudRate);
+    void setVerify(bool verify);
+    void setSyncOptions(const QLpcProg::SyncOptions &options);
+    void setEncodeCacheDir(const QString &dir);
+
+    bool start(const QStringList &ports);
+    bool run(const QStringList &ports);
+    bool isRunning() const;
+
+    QList<Result> results() const;
+
+signals:
+    void progress(const QString &port, int percent);
+    void targetFinished(const QString &port, bool ok, const QString &error);
+    void finished();
+
+private slots:
+    void sessionFinished(int id, QLpcProg::Status status, const QString &statusText);
+
+private:
+    struct Target {
+        QLpcSession *m_Session;
+        Result m_Result;
+        QElapsedTimer m_Timer;
+        int m_FirstId;
+        int m_LastId;
+        bool m_Finished;
+    };
+
+    void queueOperations(Target &target);
+    void finishTarget(Target &target, bool ok, const QString &error);
+
+    QByteArray m_image;
+    int m_crystalValue;
+    int m_baudRate;
+    bool m_verify;
+    QLpcProg::SyncOptions m_syncOptions;
+    QString m_encodeCacheDir;
+    QMap<int, QList<QByteArray> > m_encoded;
+    QList<Target> m_targets;
+    int m_running;
+};
+
+#endif // QLPCGANG_H
@@ -0,0 +1,226 @@
+#include "qlpcinjector.h"
+#include "qlpcprog.h"
+
+#include <QStringList>
+#include <QFile>
+
+
+QLpcInjector::QLpcInjector(QObject *parent) :
+    QObject(parent)
+{
+}
+
+// The 4 words of the device serial number(N command), little endian.
+void QLpcInjector::addSerialNumber(int address)
+{
+    Record record;
+
+    record.m_Address = address;
+    record.m_Source = SourceSerialNumber;
+    record.m_Size = 16;
+    record.m_BigEndian = false;
+
+    m_records.append(record);
+}
+
+// File holds a single number(decimal or 0x hex), it is incremented by commit().
+void QLpcInjector::addCounter(int address, const QString &file, int size, bool bigEndian)
+{
+    Record record;
+
+    record.m_Address = address;
+    record.m_Source = SourceCounter;
+    record.m_File = file;
+    record.m_Size = qBound(1, size, 8);
+    record.m_BigEndian = bigEndian;
+
+    m_records.append(record);
+}
+
+void QLpcInjector::addData(int address, const QByteArray &data)
+{
+    Record record;
+
+    record.m_Address = address;
+    record.m_Source = SourceData;
+    record.m_Size = data.length();
+    record.m_BigEndian = false;
+    record.m_Data = data;
+
+    m_records.append(record);
+}
+
+bool QLpcInjector::isEmpty() const
+{
+    return m_records.isEmpty();
+}
+
+// Builds the records of the connected device and patches them into the image. Needs ISP for
+// the serial number.
+bool QLpcInjector::apply(QByteArray &image, QLpcProg *prog)
+{
+    m_patches.clear();
+    m_errorText.clear();
+
+    foreach(Record record, m_records)
+    {
+        QByteArray data;
+
+        switch(record.m_Source)
+        {
+        case SourceSerialNumber:
+            {
+                QString serial = prog->readSerialNumber();
+
+                if (prog->getStatus() != QLpcProg::StatusNoError)
+                {
+                    m_errorText = tr("Error reading serial number(%1).").arg(prog->getStatusText());
+
+                    return false;
+                }
+
+                foreach(QString word, serial.split("-"))
+                {
+                    quint32 value = word.toUInt(0, 16);
+
+                    data.append((const char *)&value, 4);
+                }
+            }
+            break;
+
+        case SourceCounter:
+            {
+                quint64 value;
+
+                if (!readCounter(record.m_File, value))
+                {
+                    return false;
+                }
+
+                for(int c = 0; c < record.m_Size; c++)
+                {
+                    int shift = record.m_BigEndian ? (record.m_Size - c - 1) * 8 : c * 8;
+
+                    data.append((char)((value >> shift) & 0xFF));
+                }
+            }
+            break;
+
+        case SourceData:
+            data = record.m_Data;
+            break;
+        }
+
+        if ((record.m_Address < 0)||(QLpcProg::sectorFromAddress(record.m_Address + data.length() - 1) < 0))
+        {
+            m_errorText = tr("Record at %1 does not fit in flash.").arg(record.m_Address);
+
+            return false;
+        }
+
+        QLpcProg::injectData(image, record.m_Address, data);
+        m_patches.insert(record.m_Address, data);
+    }
+
+    return true;
+}
+
+// Moves the counters on, call after the device is programmed.
+bool QLpcInjector::commit()
+{
+    foreach(Record record, m_records)
+    {
+        quint64 value;
+        QByteArray text;
+
+        if (record.m_Source != SourceCounter)
+        {
+            continue;
+        }
+
+        if (!readCounter(record.m_File, value, &text))
+        {
+            return false;
+        }
+
+        QFile file(record.m_File);
+
+        if ((!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))||(file.write(formatCounter(text, value + 1) + "\n") < 0))
+        {
+            m_errorText = tr("Could't write counter file(%1).").arg(record.m_File);
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Address and data of every record applied by the last apply().
+QMap<int, QByteArray> QLpcInjector::patches() const
+{
+    return m_patches;
+}
+
+QString QLpcInjector::errorText() const
+{
+    return m_errorText;
+}
+
+bool QLpcInjector::readCounter(const QString &file, quint64 &value, QByteArray *text)
+{
+    QFile counter(file);
+    bool ok = false;
+
+    if (counter.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        QByteArray data = counter.readAll().trimmed();
+
+        value = data.toULongLong(&ok, 0);
+
+        if (text)
+        {
+            *text = data;
+        }
+    }
+
+    if (!ok)
+    {
+        m_errorText = tr("Could't read counter file(%1).").arg(file);
+    }
+
+    return ok;
+}
+
+// The new value is written in the radix, letter case and zero padded width of the old one.
+QByteArray QLpcInjector::formatCounter(const QByteArray &text, quint64 value)
+{
+    QByteArray ret;
+    QByteArray prefix;
+    int base = 10;
+
+    if ((text.startsWith("0x"))||(text.startsWith("0X")))
+    {
+        prefix = text.left(2);
+        base = 16;
+    }
+    else if ((text.length() > 1)&&(text.startsWith("0")))
+    {
+        prefix = "0";
+        base = 8;
+    }
+
+    ret = QByteArray::number(value, base);
+
+    if ((base == 16)&&(text.mid(2) != text.mid(2).toLower()))
+    {
+        ret = ret.toUpper();
+    }
+
+    if (ret.length() < text.length() - prefix.length())
+    {
+        ret.prepend(QByteArray(text.length() - prefix.length() - ret.length(), '0'));
+    }
+
+    return prefix + ret;
+}
@@ -0,0 +1,50 @@
+#ifndef QLPCINJECTOR_H
+#define QLPCINJECTOR_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QList>
+#include <QMap>
+
+class QLpcProg;
+
+// Per device records(serial number, counters like a MAC address, constant data) written into
+// the image at fixed addresses right before it is programmed.
+class QLpcInjector : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcInjector(QObject *parent = 0);
+
+    void addSerialNumber(int address);
+    void addCounter(int address, const QString &file, int size = 4, bool bigEndian = false);
+    void addData(int address, const QByteArray &data);
+
+    bool isEmpty() const;
+    bool apply(QByteArray &image, QLpcProg *prog);
+    bool commit();
+
+    QMap<int, QByteArray> patches() const;
+    QString errorText() const;
+
+private:
+    enum Source {SourceSerialNumber, SourceCounter, SourceData};
+
+    struct Record {
+        int m_Address;
+        Source m_Source;
+        QString m_File;
+        int m_Size;
+        bool m_BigEndian;
+        QByteArray m_Data;
+    };
+
+    bool readCounter(const QString &file, quint64 &value, QByteArray *text = 0);
+    static QByteArray formatCounter(const QByteArray &text, quint64 value);
+
+    QList<Record> m_records;
+    QMap<int, QByteArray> m_patches;
+    QString m_errorText;
+};
+
+#endif // QLPCINJECTOR_H
@@ -0,0 +1,1237 @@
+#include "qlpcjob.h"
+#include "qlpcverify.h"
+#include "qlpcencoder.h"
+#include "qhexloader.h"
+
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QRegExp>
+#include <QFile>
+#include <QDir>
+
+// Job file format, one command per line ('#' starts a comment):
+//
+//   port /dev/ttyUSB0      - serial port (setting)
+//   crystal 12000          - crystal value in KHz (setting)
+//   lowlatency             - low latency mode for USB-serial adapters, Linux only (setting)
+//   reset normal|inverted|none [hold boot]
+//                          - RESET(DTR) polarity, hold time and time before the first '?' in ms (setting)
+//   isp normal|inverted    - ISP entry(RTS) polarity (setting)
+//   synctimeout 3000 [100] - give up syncing after ms, '?' retry interval in ms (setting)
+//   image firmware.hex     - image used by erase/program/verify (setting)
+//   merge app.hex          - another hex file merged into the image, gaps are filled with 0xFF and
+//                            files must not overlap, may be given more than once (setting)
+//   stub loader.bin [baud] - flash loader stub used by program/verify, ISP is used if it doesn't start (setting)
+//   sync                   - reset into ISP, synchronize, disable echo
+//   baud 115200            - switch the link to a faster baud rate
+//   erase [start end]      - erase the given sectors, or the non blank sectors covered by the image or the whole chip
+//   blankcheck
+//   program [file.hex]
+//   verify                 - compare sector CRCs, stops at the first bad sector
+//   verifyall              - verify stops at the first bad sector unless this is set (setting)
+//   encodecache dir        - keep the UU encoded blocks of the image in dir for the next run (setting)
+//   inject address serial|counter file [bytes] [be]|hex 0011AABB
+//                          - per device record written into the image at address: device serial
+//                            number, number from file incremented after programming, or data (setting)
+//   fingerprint [address]  - store the image fingerprint in the page at address(default: last page of flash)
+//                            after programming, erase/program are skipped if it matches (setting)
+//   manifest file.manifest - sector manifest of the image(lpcprog --write-manifest), used by delta and by
+//                            verify when no image is set (setting)
+//   delta                  - read the image range back and erase/program only the sectors whose CRC
+//                            differs from the manifest(or the image), both are skipped if none does (setting)
+//   partid
+//   bootversion
+//   serial
+//   go [address]
+//
+// The steps run in order, in one ISP session. A missing leading "sync" is implied.
+
+static const char *jobArguments[] = {"--port", "--crystal", "--job", "--low-latency", "--verify-all", "--stub", "--encode-cache", "--merge", "--fingerprint", "--manifest", "--delta", "--reset", "--sync-timeout", "--baud", "--erase", "--program", "--verify", "--serial", "--go", 0};
+
+QLpcJob::QLpcJob(QObject *parent) :
+    QObject(parent),
+    m_stub(&m_prog),
+    m_journal(&m_prog),
+    m_journalOpen(false),
+    m_crystalValue(12000),
+    m_lowLatency(false),
+    m_stubBaudRate(0),
+    m_stubTried(false),
+    m_verifyAll(false),
+    m_fingerprint(false),
+    m_fingerprintAddress(-1),
+    m_fingerprintChecked(false),
+    m_upToDate(false),
+    m_delta(false),
+    m_deltaChecked(false),
+    m_elapsed(0)
+{
+}
+
+// Only the arguments parseArguments() knows start a job, anything else is left to the GUI.
+bool QLpcJob::hasJobArguments(const QStringList &arguments)
+{
+    for(int c = 0; jobArguments[c]; c++)
+    {
+        if (arguments.contains(jobArguments[c]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool QLpcJob::load(const QString &filename)
+{
+    QFile file(filename);
+
+    if (file.open(QIODevice::ReadOnly | QIODevice::Text) == false)
+    {
+        m_errorText = tr("Could't open job file(%1).").arg(filename);
+
+        return false;
+    }
+
+    m_baseDir = QFileInfo(filename).absolutePath();
+
+    while(!file.atEnd())
+    {
+        QString line = QString::fromLocal8Bit(file.readLine());
+
+        if (!addStep(line))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool QLpcJob::parseArguments(const QStringList &arguments)
+{
+    QString baudRate;
+    QString goAddress;
+    bool erase = false;
+    bool program = false;
+    bool verify = false;
+    bool serial = false;
+    bool go = false;
+
+    for(int c = 1; c < arguments.count(); c++)
+    {
+        const QString &argument = arguments.at(c);
+        QString value;
+
+        if ((c + 1 < arguments.count())&&(!arguments.at(c + 1).startsWith("--")))
+        {
+            value = arguments.at(c + 1);
+        }
+
+        if (argument == "--port")
+        {
+            m_port = value;
+        }
+        else if (argument == "--crystal")
+        {
+            m_crystalValue = value.toInt();
+        }
+        else if (argument == "--job")
+        {
+            if (!load(value))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--low-latency")
+        {
+            m_lowLatency = true;
+            value.clear();
+        }
+        else if (argument == "--verify-all")
+        {
+            m_verifyAll = true;
+            verify = true;
+            value.clear();
+        }
+        else if (argument == "--stub")
+        {
+            m_stubFile = value;
+        }
+        else if (argument == "--encode-cache")
+        {
+            m_encodeCacheDir = value;
+        }
+        else if (argument == "--merge")
+        {
+            if (!addStep("merge " + value))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--fingerprint")
+        {
+            if (!addStep("fingerprint " + value))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--manifest")
+        {
+            if (!addStep("manifest " + value))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--delta")
+        {
+            m_delta = true;
+            value.clear();
+        }
+        else if (argument == "--reset")
+        {
+            if (!addStep("reset " + value))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--sync-timeout")
+        {
+            if (!addStep("synctimeout " + value))
+            {
+                return false;
+            }
+        }
+        else if (argument == "--baud")
+        {
+            baudRate = value;
+        }
+        else if (argument == "--erase")
+        {
+            erase = true;
+            value.clear();
+        }
+        else if (argument == "--program")
+        {
+            if (!value.isEmpty())
+            {
+                setImage(value);
+            }
+            program = true;
+        }
+        else if (argument == "--verify")
+        {
+            if (!value.isEmpty())
+            {
+                setImage(value);
+            }
+            verify = true;
+        }
+        else if (argument == "--serial")
+        {
+            serial = true;
+            value.clear();
+        }
+        else if (argument == "--go")
+        {
+            goAddress = value;
+            go = true;
+        }
+        else
+        {
+            m_errorText = tr("Unknown argument(%1).").arg(argument);
+
+            return false;
+        }
+
+        if (!value.isEmpty())
+        {
+            c++;
+        }
+    }
+
+    if (!baudRate.isEmpty()) addStep("baud " + baudRate);
+    if (erase) addStep("erase");
+    if (program) addStep("program");
+    if (verify) addStep("verify");
+    if (serial) addStep("serial");
+    if (go) addStep("go " + goAddress);
+
+    if (m_port.isEmpty())
+    {
+        m_errorText = tr("Serial port is not set.");
+
+        return false;
+    }
+
+    return true;
+}
+
+bool QLpcJob::addStep(const QString &line)
+{
+    QString command = line.section('#', 0, 0).trimmed();
+    QStringList args;
+    Step step;
+
+    if (command.isEmpty())
+    {
+        return true;
+    }
+
+    args = command.split(QRegExp("\\s+"));
+    command = args.takeFirst().toLower();
+
+    if ((command == "port")&&(args.count() == 1))
+    {
+        m_port = args.at(0);
+
+        return true;
+    }
+    else if ((command == "crystal")&&(args.count() == 1))
+    {
+        m_crystalValue = args.at(0).toInt();
+
+        return true;
+    }
+    else if ((command == "lowlatency")&&(args.isEmpty()))
+    {
+        m_lowLatency = true;
+
+        return true;
+    }
+    else if ((command == "reset")&&(args.count() >= 1)&&(args.count() <= 3)&&(QString("normal inverted none").split(' ').contains(args.at(0))))
+    {
+        m_syncOptions.m_Reset = (args.at(0) != "none");
+        m_syncOptions.m_ResetInverted = (args.at(0) == "inverted");
+
+        if (args.count() >= 2) m_syncOptions.m_ResetTime = args.at(1).toInt();
+        if (args.count() >= 3) m_syncOptions.m_BootTime = args.at(2).toInt();
+
+        return true;
+    }
+    else if ((command == "isp")&&(args.count() == 1)&&((args.at(0) == "normal")||(args.at(0) == "inverted")))
+    {
+        m_syncOptions.m_IspInverted = (args.at(0) == "inverted");
+
+        return true;
+    }
+    else if ((command == "synctimeout")&&(args.count() >= 1)&&(args.count() <= 2))
+    {
+        m_syncOptions.m_SyncTimeout = args.at(0).toInt();
+
+        if (args.count() == 2) m_syncOptions.m_RetryInterval = args.at(1).toInt();
+
+        return true;
+    }
+    else if ((command == "stub")&&((args.count() == 1)||(args.count() == 2)))
+    {
+        m_stubFile = args.at(0);
+
+        if ((!m_baseDir.isEmpty())&&(QFileInfo(m_stubFile).isRelative()))
+        {
+            m_stubFile = QDir(m_baseDir).filePath(m_stubFile);
+        }
+
+        m_stubBaudRate = (args.count() == 2) ? args.at(1).toInt() : 0;
+
+        return true;
+    }
+    else if ((command == "encodecache")&&(!args.isEmpty()))
+    {
+        m_encodeCacheDir = args.join(" ");
+
+        if ((!m_baseDir.isEmpty())&&(QFileInfo(m_encodeCacheDir).isRelative()))
+        {
+            m_encodeCacheDir = QDir(m_baseDir).filePath(m_encodeCacheDir);
+        }
+
+        return true;
+    }
+    else if ((command == "inject")&&(args.count() >= 2))
+    {
+        bool ok;
+        int address = args.at(0).toInt(&ok, 0);
+        QString source = args.at(1).toLower();
+
+        if ((ok)&&(source == "serial")&&(args.count() == 2))
+        {
+            m_injector.addSerialNumber(address);
+
+            return true;
+        }
+
+        if ((ok)&&(source == "counter")&&(args.count() >= 3)&&(args.count() <= 5))
+        {
+            QString file = args.at(2);
+            int size = (args.count() >= 4) ? args.at(3).toInt() : 4;
+
+            if ((!m_baseDir.isEmpty())&&(QFileInfo(file).isRelative()))
+            {
+                file = QDir(m_baseDir).filePath(file);
+            }
+
+            m_injector.addCounter(address, file, size, (args.count() == 5)&&(args.at(4).toLower() == "be"));
+
+            return true;
+        }
+
+        if ((ok)&&(source == "hex")&&(args.count() == 3))
+        {
+            m_injector.addData(address, QByteArray::fromHex(args.at(2).toLatin1()));
+
+            return true;
+        }
+
+        m_errorText = tr("Invalid inject record(%1).").arg(line.trimmed());
+
+        return false;
+    }
+    else if ((command == "fingerprint")&&(args.count() <= 1))
+    {
+        bool ok = true;
+
+        m_fingerprint = true;
+        m_fingerprintAddress = args.isEmpty() ? -1 : args.at(0).toInt(&ok, 0);
+
+        if (!ok)
+        {
+            m_errorText = tr("Invalid fingerprint address(%1).").arg(args.at(0));
+
+            return false;
+        }
+
+        return true;
+    }
+    else if ((command == "merge")&&(!args.isEmpty()))
+    {
+        QString file = args.join(" ");
+
+        if ((!m_baseDir.isEmpty())&&(QFileInfo(file).isRelative()))
+        {
+            file = QDir(m_baseDir).filePath(file);
+        }
+
+        m_mergeFiles.append(file);
+        m_image.clear();
+        m_manifest.clear();
+
+        return true;
+    }
+    else if ((command == "manifest")&&(!args.isEmpty()))
+    {
+        m_manifestFile = args.join(" ");
+
+        if ((!m_baseDir.isEmpty())&&(QFileInfo(m_manifestFile).isRelative()))
+        {
+            m_manifestFile = QDir(m_baseDir).filePath(m_manifestFile);
+        }
+
+        m_manifest.clear();
+
+        return true;
+    }
+    else if ((command == "delta")&&(args.isEmpty()))
+    {
+        m_delta = true;
+
+        return true;
+    }
+    else if ((command == "verifyall")&&(args.isEmpty()))
+    {
+        m_verifyAll = true;
+
+        return true;
+    }
+    else if ((command == "image")&&(!args.isEmpty()))
+    {
+        setImage(args.join(" "));
+
+        return true;
+    }
+    else if ((command == "sync")&&(args.isEmpty()))
+    {
+        step.m_Type = StepSync;
+    }
+    else if ((command == "baud")&&(args.count() == 1))
+    {
+        step.m_Type = StepBaudRate;
+    }
+    else if ((command == "erase")&&((args.isEmpty())||(args.count() == 2)))
+    {
+        step.m_Type = StepErase;
+    }
+    else if ((command == "blankcheck")&&(args.isEmpty()))
+    {
+        step.m_Type = StepBlankCheck;
+    }
+    else if (command == "program")
+    {
+        step.m_Type = StepProgram;
+    }
+    else if (command == "verify")
+    {
+        step.m_Type = StepVerify;
+    }
+    else if ((command == "partid")&&(args.isEmpty()))
+    {
+        step.m_Type = StepReadPartID;
+    }
+    else if ((command == "bootversion")&&(args.isEmpty()))
+    {
+        step.m_Type = StepReadBootCodeVersion;
+    }
+    else if ((command == "serial")&&(args.isEmpty()))
+    {
+        step.m_Type = StepReadSerialNumber;
+    }
+    else if ((command == "go")&&(args.count() <= 1))
+    {
+        step.m_Type = StepGo;
+    }
+    else
+    {
+        m_errorText = tr("Invalid job line(%1).").arg(line.trimmed());
+
+        return false;
+    }
+
+    if (((step.m_Type == StepProgram)||(step.m_Type == StepVerify))&&(!args.isEmpty()))
+    {
+        setImage(args.join(" "));
+        args.clear();
+    }
+
+    step.m_Args = args;
+    step.m_Elapsed = 0;
+    step.m_Done = false;
+
+    m_steps.append(step);
+
+    return true;
+}
+
+void QLpcJob::setPort(const QString &port)
+{
+    m_port = port;
+}
+
+void QLpcJob::setCrystalValue(int value)
+{
+    m_crystalValue = value;
+}
+
+void QLpcJob::setImage(const QString &filename)
+{
+    QString file = filename;
+
+    if ((!m_baseDir.isEmpty())&&(QFileInfo(file).isRelative()))
+    {
+        file = QDir(m_baseDir).filePath(file);
+    }
+
+    if (file != m_imageFile)
+    {
+        m_imageFile = file;
+        m_image.clear();
+        m_manifest.clear();
+        m_deltaChecked = false;
+    }
+}
+
+bool QLpcJob::run()
+{
+    QElapsedTimer total;
+
+    total.start();
+    m_errorText.clear();
+
+    if ((m_steps.isEmpty())||(m_steps.first().m_Type != StepSync))
+    {
+        addStep("sync");
+        m_steps.move(m_steps.count() - 1, 0);
+    }
+
+    for(int c = 0; c < m_steps.count(); c++)
+    {
+        Step &step = m_steps[c];
+        QElapsedTimer timer;
+
+        emit stepStarted(stepName(step.m_Type));
+
+        timer.start();
+        step.m_Done = runStep(step);
+        step.m_Elapsed = timer.elapsed();
+
+        if (!step.m_Done)
+        {
+            break;
+        }
+    }
+
+    m_stub.stop();
+    m_prog.deinit();
+
+    m_elapsed = total.elapsed();
+
+    return m_errorText.isEmpty();
+}
+
+QString QLpcJob::report() const
+{
+    QString ret;
+
+    ret.append(QString("%1 %2 %3\n").arg(tr("Step"), -12).arg(tr("Result"), -36).arg(tr("Time(ms)"), 10));
+
+    foreach(Step step, m_steps)
+    {
+        QString result = step.m_Result;
+
+        if (result.isEmpty())
+        {
+            result = step.m_Done ? tr("OK") : tr("not run");
+        }
+
+        ret.append(QString("%1 %2 %3\n").arg(stepName(step.m_Type), -12).arg(result, -36).arg(step.m_Elapsed, 10));
+    }
+
+    ret.append(QString("%1 %2 %3\n").arg(tr("Total"), -12).arg(m_errorText.isEmpty() ? tr("OK") : tr("FAILED"), -36).arg(m_elapsed, 10));
+
+    if (m_prog.syncTime() >= 0)
+    {
+        ret.append(tr("Time to sync: %1 ms%2\n").arg(m_prog.syncTime()).arg(m_prog.resetSkipped() ? tr(" (already synchronized)") : QString()));
+    }
+
+    ret.append(tr("Average link latency: %1 ms\n").arg(m_prog.averageLatency()));
+
+    if (m_prog.recoveries() > 0)
+    {
+        ret.append(tr("Link recoveries: %1\n").arg(m_prog.recoveries()));
+    }
+
+    if (!m_stubResult.isEmpty())
+    {
+        ret.append(tr("Stub: %1\n").arg(m_stubResult));
+    }
+
+    if (!m_errorText.isEmpty())
+    {
+        ret.append(m_errorText + "\n");
+    }
+
+    return ret;
+}
+
+QString QLpcJob::errorText() const
+{
+    return m_errorText;
+}
+
+bool QLpcJob::loadImage()
+{
+    if (!m_image.isEmpty())
+    {
+        return true;
+    }
+
+    if (!m_mergeFiles.isEmpty())
+    {
+        m_image = QHexLoader::merge(QStringList(m_imageFile) + m_mergeFiles, &m_errorText);
+
+        if (m_image.isEmpty())
+        {
+            return false;
+        }
+    }
+    else
+    {
+        QHexLoader loader;
+
+        if (loader.load(m_imageFile) == false)
+        {
+            m_errorText = tr("Error loading hex file(%1).").arg(m_imageFile);
+
+            return false;
+        }
+
+        m_image = loader.data();
+    }
+
+    if (m_image.length() < 32)
+    {
+        m_image.clear();
+        m_errorText = tr("Error loading hex file(%1).").arg(m_imageFile);
+
+        return false;
+    }
+
+    m_prog.patchFirmware(m_image);
+    m_baseImage = m_image;
+
+    if (!m_injector.isEmpty())
+    {
+        if (!m_injector.apply(m_image, &m_prog))
+        {
+            m_errorText = m_injector.errorText();
+            m_image.clear();
+
+            return false;
+        }
+    }
+
+    return manifestMatches();
+}
+
+// A single R of the fingerprint page, done once per run before anything is erased.
+bool QLpcJob::checkFingerprint()
+{
+    if ((!m_fingerprint)||(m_fingerprintChecked))
+    {
+        return true;
+    }
+
+    if (!stopStub()) return false;
+
+    m_fingerprintChecked = true;
+
+    if (m_fingerprintAddress < 0)
+    {
+        m_fingerprintAddress = m_prog.defaultFingerprintAddress();
+        if (!checkStatus(tr("read part ID"))) return false;
+    }
+
+    m_upToDate = m_prog.checkFingerprint(m_image, m_fingerprintAddress);
+    if (!checkStatus(tr("read fingerprint"))) return false;
+
+    if (!m_upToDate)
+    {
+        m_prog.clearFingerprint(m_image, m_fingerprintAddress);
+        if (!checkStatus(tr("clear fingerprint"))) return false;
+    }
+
+    return true;
+}
+
+// The manifest file describes the plain image, with per device records it is made from the image.
+bool QLpcJob::loadManifest()
+{
+    if (!m_manifest.isEmpty())
+    {
+        return true;
+    }
+
+    if ((!m_manifestFile.isEmpty())&&(m_injector.isEmpty()))
+    {
+        if (!m_manifest.load(m_manifestFile))
+        {
+            m_errorText = m_manifest.errorText();
+
+            return false;
+        }
+
+        return manifestMatches();
+    }
+
+    if (m_imageFile.isEmpty())
+    {
+        m_errorText = tr("Image is not set.");
+
+        return false;
+    }
+
+    if (!loadImage()) return false;
+
+    if (!m_manifest.fromImage(m_image))
+    {
+        m_errorText = m_manifest.errorText();
+
+        return false;
+    }
+
+    return true;
+}
+
+// A stale manifest file would leave changed sectors unprogrammed.
+bool QLpcJob::manifestMatches()
+{
+    if ((m_manifest.isEmpty())||(m_image.isEmpty())||(m_manifest.matches(m_image)))
+    {
+        return true;
+    }
+
+    m_errorText = tr("Manifest file(%1) does not match the image.").arg(m_manifestFile);
+    m_image.clear();
+
+    return false;
+}
+
+// Reads every sector the image covers back over R to compare CRCs, so it costs about as much as
+// a verify, done once per run before anything is erased. It saves the erase and program of the
+// sectors that didn't change, not the read. The image is not needed when a manifest file is set
+// and nothing differs.
+bool QLpcJob::checkDelta()
+{
+    if ((!m_delta)||(m_deltaChecked))
+    {
+        return true;
+    }
+
+    if (!loadManifest()) return false;
+    if (!stopStub()) return false;
+
+    m_deltaChecked = true;
+
+    m_deltaSectors = m_manifest.compareDevice(&m_prog);
+    if (!checkStatus(tr("read sector CRC"))) return false;
+
+    if (m_deltaSectors.isEmpty())
+    {
+        m_upToDate = true;
+    }
+
+    return true;
+}
+
+// Needs ISP for the serial number, opened once per run.
+bool QLpcJob::openJournal()
+{
+    if (m_journalOpen)
+    {
+        return true;
+    }
+
+    if (!stopStub()) return false;
+
+    // Without a serial number the run goes on unjournaled.
+    m_journal.open(m_image);
+
+    m_journalOpen = true;
+
+    return true;
+}
+
+// Started once, by the first step that can use it.
+bool QLpcJob::startStub()
+{
+    if ((m_stubFile.isEmpty())||(m_stubTried))
+    {
+        return true;
+    }
+
+    m_stubTried = true;
+
+    if (!m_stub.load(m_stubFile))
+    {
+        m_errorText = m_stub.getStatusText();
+
+        return false;
+    }
+
+    if (!m_stub.start(m_stubBaudRate))
+    {
+        if (!checkStatus(tr("stub start"), m_stub.getStatus(), m_stub.getStatusText())) return false;
+
+        m_stubResult = m_stub.getStatusText();
+
+        return true;
+    }
+
+    m_stubResult = tr("running");
+
+    return true;
+}
+
+// ISP commands need the bootloader back.
+bool QLpcJob::stopStub()
+{
+    if (!m_stub.isRunning())
+    {
+        return true;
+    }
+
+    m_stub.stop();
+
+    return checkStatus(tr("stub stop"), m_stub.getStatus(), m_stub.getStatusText());
+}
+
+bool QLpcJob::runStep(Step &step)
+{
+    if ((step.m_Type != StepProgram)&&(step.m_Type != StepVerify)&&(step.m_Type != StepGo))
+    {
+        if (!stopStub()) return false;
+    }
+
+    switch(step.m_Type)
+    {
+    case StepSync:
+        m_prog.setSyncOptions(m_syncOptions);
+        m_prog.init(m_port, m_lowLatency);
+        if (!checkStatus(tr("initialization"))) return false;
+
+        m_prog.setCrystalValue(m_crystalValue);
+        if (!checkStatus(tr("set crystal value"))) return false;
+
+        m_prog.setEcho(false);
+        if (!checkStatus(tr("disable echo"))) return false;
+
+        return true;
+
+    case StepBaudRate:
+        m_prog.setBaudRate(step.m_Args.at(0).toInt());
+
+        return checkStatus(tr("set BaudRate"));
+
+    case StepErase:
+        if (step.m_Args.count() == 2)
+        {
+            m_prog.chipErase(step.m_Args.at(0).toInt(), step.m_Args.at(1).toInt());
+        }
+        else if (!m_imageFile.isEmpty())
+        {
+            if (!checkDelta()) return false;
+
+            if (!m_upToDate)
+            {
+                if (!loadImage()) return false;
+                if (!checkFingerprint()) return false;
+            }
+
+            if (m_upToDate)
+            {
+                step.m_Result = tr("skipped, up to date");
+
+                return true;
+            }
+
+            if (m_delta)
+            {
+                for(int c = 0; c < m_deltaSectors.count(); c++)
+                {
+                    int start = m_deltaSectors.at(c);
+
+                    while((c + 1 < m_deltaSectors.count())&&(m_deltaSectors.at(c + 1) == m_deltaSectors.at(c) + 1))
+                    {
+                        c++;
+                    }
+
+                    m_prog.chipErase(start, m_deltaSectors.at(c));
+                    if (!checkStatus(tr("chip erase"))) return false;
+                }
+
+                step.m_Result = tr("%1 erased, changed sectors").arg(m_deltaSectors.count());
+
+                return true;
+            }
+
+            if (!openJournal()) return false;
+
+            // An interrupted run of the same image is continued by program, not erased.
+            if (m_journal.isResumable())
+            {
+                step.m_Result = tr("skipped, resuming");
+
+                return true;
+            }
+
+            int last = QLpcProg::sectorFromAddress(m_image.length() - 1);
+
+            if (last < 0)
+            {
+                m_errorText = tr("Image does not fit in flash.");
+
+                return false;
+            }
+
+            // Sectors that are already blank are not erased again.
+            int erased = m_prog.chipEraseNonBlank(0, last);
+            step.m_Result = tr("%1 erased, sectors 0-%2").arg(erased).arg(last);
+        }
+        else
+        {
+            int erased = m_prog.chipEraseNonBlank();
+            step.m_Result = tr("%1 erased").arg(erased);
+        }
+
+        return checkStatus(tr("chip erase"));
+
+    case StepBlankCheck:
+        {
+            bool is_blank = m_prog.chipBlankCheck();
+            if (!checkStatus(tr("blank check"))) return false;
+
+            step.m_Result = is_blank ? tr("blank") : tr("not blank");
+        }
+
+        return true;
+
+    case StepProgram:
+        {
+            if (!checkDelta()) return false;
+
+            if (!m_upToDate)
+            {
+                if (!loadImage()) return false;
+                if (!checkFingerprint()) return false;
+            }
+
+            if (m_upToDate)
+            {
+                step.m_Result = tr("skipped, up to date");
+
+                return true;
+            }
+
+            // Delta runs are not journaled, the next run finds the sectors left over by itself.
+            bool journal = !m_delta;
+            int done = m_image.length();
+
+            if (journal)
+            {
+                if (!openJournal()) return false;
+
+                // Checks the block in flight over ISP, so before the stub takes over.
+                if (m_journal.isResumable())
+                {
+                    done = m_journal.resume();
+                    if (!checkStatus(tr("resume"))) return false;
+                }
+            }
+
+            if (!startStub()) return false;
+
+            // program 4096byte blocks.
+            int chunks = m_image.length() / 4096;
+            if (m_image.length() % 4096) chunks++;
+
+            // The stub takes raw blocks, ISP ones are UU encoded ahead on worker threads.
+            QLpcEncoder encoder;
+
+            encoder.setCacheDir(m_encodeCacheDir);
+            encoder.setPatches(m_injector.patches());
+
+            QList<int> offsets;
+
+            for(int c = chunks - 1; c >= 0; c--)
+            {
+                QByteArray block = m_image.mid(c * 4096, 4096);
+
+                // Erased flash reads as 0xFF, so the gap fill of merged images is not written.
+                if (block.count((char)0xFF) == block.length())
+                {
+                    continue;
+                }
+
+                if ((c * 4096 < done)&&((!m_delta)||(m_deltaSectors.contains(QLpcProg::sectorFromAddress(c * 4096)))))
+                {
+                    offsets.append(c * 4096);
+                }
+            }
+
+            if (!m_stub.isRunning())
+            {
+                encoder.start(m_baseImage, offsets);
+            }
+
+            for(int c = chunks - 1; c >= 0; c--)
+            {
+                if (!offsets.contains(c * 4096))
+                {
+                    continue;
+                }
+
+                emit progress(((chunks - c - 1) * 100) / chunks);
+
+                if (journal) m_journal.startBlock(c * 4096);
+
+                if (m_stub.isRunning())
+                {
+                    m_stub.chipProgram(m_image.mid(c * 4096, 4096), c * 4096);
+                    if (!checkStatus(tr("programming"), m_stub.getStatus(), m_stub.getStatusText())) return false;
+                }
+                else
+                {
+                    m_prog.chipProgram(m_image.mid(c * 4096, 4096), c * 4096, encoder.take(c * 4096));
+                    if (!checkStatus(tr("programming"))) return false;
+                }
+
+                if (journal) m_journal.finishBlock(c * 4096);
+            }
+
+            if (!m_injector.commit())
+            {
+                m_errorText = m_injector.errorText();
+
+                return false;
+            }
+
+            // Last, so an interrupted run never looks up to date.
+            if (m_fingerprint)
+            {
+                if (!stopStub()) return false;
+
+                m_prog.writeFingerprint(m_image, m_fingerprintAddress);
+                if (!checkStatus(tr("write fingerprint"))) return false;
+            }
+
+            if (journal) m_journal.finish();
+
+            if (m_delta)
+            {
+                step.m_Result = tr("%1 blocks, %2 changed sectors").arg(offsets.count()).arg(m_deltaSectors.count());
+            }
+            else if (done < m_image.length())
+            {
+                step.m_Result = tr("%1 bytes, resumed at %2").arg(m_image.length()).arg(done);
+            }
+            else
+            {
+                step.m_Result = tr("%1 bytes").arg(m_image.length());
+            }
+        }
+
+        return true;
+
+    case StepVerify:
+        {
+            // Without an image the sector CRCs are checked against the manifest.
+            if ((m_imageFile.isEmpty())&&(!m_manifestFile.isEmpty()))
+            {
+                if (!loadManifest()) return false;
+                if (!stopStub()) return false;
+
+                QStringList sectors;
+
+                foreach(int sector, m_manifest.compareDevice(&m_prog))
+                {
+                    sectors.append(QString::number(sector));
+                }
+
+                if (!checkStatus(tr("verify"))) return false;
+
+                if (!sectors.isEmpty())
+                {
+                    m_errorText = tr("Chip firmware does not match manifest in sectors %1.").arg(sectors.join(", "));
+
+                    return false;
+                }
+
+                step.m_Result = tr("%1 sectors").arg(m_manifest.sectors().count());
+
+                return true;
+            }
+
+            if (!loadImage()) return false;
+            if (!startStub()) return false;
+
+            QLpcVerify verify(&m_prog, &m_stub);
+
+            connect(&verify, SIGNAL(progress(int)), this, SIGNAL(progress(int)));
+
+            bool matches = verify.verify(m_image, !m_verifyAll);
+            if (!checkStatus(tr("verify"), verify.getStatus(), verify.getStatusText())) return false;
+
+            if (!matches)
+            {
+                m_errorText = tr("Chip firmware does not match file at offset %1.").arg(verify.firstMismatch());
+
+                foreach(QString line, verify.resultText())
+                {
+                    m_errorText.append("\n" + line);
+                }
+
+                return false;
+            }
+
+            step.m_Result = tr("%1 sectors").arg(verify.results().count());
+        }
+
+        return true;
+
+    case StepReadPartID:
+        {
+            int partID = m_prog.readPartID();
+            if (!checkStatus(tr("getPartID"))) return false;
+
+            step.m_Result = QString::number(partID);
+        }
+
+        return true;
+
+    case StepReadBootCodeVersion:
+        step.m_Result = m_prog.readBootCodeVersion();
+
+        return checkStatus(tr("read boot code version"));
+
+    case StepReadSerialNumber:
+        step.m_Result = m_prog.readSerialNumber();
+
+        return checkStatus(tr("read serial number"));
+
+    case StepGo:
+        {
+            quint32 address = 0;
+
+            if (!step.m_Args.isEmpty())
+            {
+                address = step.m_Args.at(0).toUInt(0, 0);
+            }
+
+            m_stub.go(address);
+        }
+
+        return checkStatus(tr("go"), m_stub.getStatus(), m_stub.getStatusText());
+    }
+
+    return false;
+}
+
+bool QLpcJob::checkStatus(const QString &operation)
+{
+    return checkStatus(operation, m_prog.getStatus(), m_prog.getStatusText());
+}
+
+bool QLpcJob::checkStatus(const QString &operation, QLpcProg::Status status, const QString &text)
+{
+    switch (status)
+    {
+    case QLpcProg::StatusNoError:
+        return true;
+    case QLpcProg::StatusTimeOut:
+        m_errorText = tr("LPC %1 timeout.").arg(operation);
+        return false;
+    case QLpcProg::StatusError:
+        m_errorText = tr("LPC %1 failed.\n Error string: %2.").arg(operation).arg(text);
+        return false;
+    default:
+        m_errorText = tr("LPC %1 failed(unknown error type).\n Error string: %2.").arg(operation).arg(text);
+        return false;
+    }
+}
+
+QString QLpcJob::stepName(StepType type)
+{
+    switch(type)
+    {
+    case StepSync:
+        return "sync";
+    case StepBaudRate:
+        return "baud";
+    case StepErase:
+        return "erase";
+    case StepBlankCheck:
+        return "blankcheck";
+    case StepProgram:
+        return "program";
+    case StepVerify:
+        return "verify";
+    case StepReadPartID:
+        return "partid";
+    case StepReadBootCodeVersion:
+        return "bootversion";
+    case StepReadSerialNumber:
+        return "serial";
+    case StepGo:
+        return "go";
+    }
+
+    return QString();
+}
@@ -0,0 +1,98 @@
+#ifndef QLPCJOB_H
+#define QLPCJOB_H
+
+#include "qlpcprog.h"
+#include "qlpcstubprog.h"
+#include "qlpcjournal.h"
+#include "qlpcinjector.h"
+#include "qlpcmanifest.h"
+
+#include <QStringList>
+#include <QByteArray>
+#include <QObject>
+#include <QList>
+
+class QLpcJob : public QObject
+{
+    Q_OBJECT
+public:
+    enum StepType {StepSync, StepBaudRate, StepErase, StepBlankCheck, StepProgram, StepVerify, StepReadPartID, StepReadBootCodeVersion, StepReadSerialNumber, StepGo};
+
+    struct Step {
+        StepType m_Type;
+        QStringList m_Args;
+        QString m_Result;
+        qint64 m_Elapsed;
+        bool m_Done;
+    };
+
+    explicit QLpcJob(QObject *parent = 0);
+
+    bool load(const QString &filename);
+    bool parseArguments(const QStringList &arguments);
+    bool addStep(const QString &line);
+
+    void setPort(const QString &port);
+    void setCrystalValue(int value);
+    void setImage(const QString &filename);
+
+    bool run();
+
+    QString report() const;
+    QString errorText() const;
+
+    static bool hasJobArguments(const QStringList &arguments);
+
+signals:
+    void stepStarted(const QString &name);
+    void progress(int percent);
+
+private:
+    bool loadImage();
+    bool checkFingerprint();
+    bool loadManifest();
+    bool manifestMatches();
+    bool checkDelta();
+    bool openJournal();
+    bool startStub();
+    bool stopStub();
+    bool runStep(Step &step);
+    bool checkStatus(const QString &operation);
+    bool checkStatus(const QString &operation, QLpcProg::Status status, const QString &text);
+    static QString stepName(StepType type);
+
+    QLpcProg m_prog;
+    QLpcStubProg m_stub;
+    QLpcJournal m_journal;
+    QLpcInjector m_injector;
+    QLpcManifest m_manifest;
+    bool m_journalOpen;
+    QList<Step> m_steps;
+    QString m_port;
+    QString m_baseDir;
+    int m_crystalValue;
+    bool m_lowLatency;
+    QLpcProg::SyncOptions m_syncOptions;
+    QString m_stubFile;
+    int m_stubBaudRate;
+    bool m_stubTried;
+    QString m_stubResult;
+    bool m_verifyAll;
+    QString m_encodeCacheDir;
+    bool m_fingerprint;
+    int m_fingerprintAddress;
+    bool m_fingerprintChecked;
+    bool m_upToDate;
+    QString m_manifestFile;
+    bool m_delta;
+    bool m_deltaChecked;
+    QList<int> m_deltaSectors;
+    QString m_imageFile;
+    QStringList m_mergeFiles;
+    QByteArray m_baseImage;
+    QByteArray m_image;
+    QString m_errorText;
+    qint64 m_elapsed;
+};
+
+#endif // QLPCJOB_H
@@ -0,0 +1,145 @@
+#include "qlpcjournal.h"
+#include "qlpcprog.h"
+
+#include <QCryptographicHash>
+#include <QSettings>
+#include <QRegExp>
+
+
+QLpcJournal::QLpcJournal(QLpcProg *prog, QObject *parent) :
+    QObject(parent),
+    m_prog(prog),
+    m_resumable(false),
+    m_done(0),
+    m_inFlight(-1)
+{
+}
+
+// Looks up the journal of the connected device. Returns false if the serial number can't be read
+// (not every bootloader has N), programming then goes on without a journal. The port alone
+// doesn't tell the boards plugged into it apart, a run can't be resumed by it.
+bool QLpcJournal::open(const QByteArray &image)
+{
+    QSettings settings(QSettings::IniFormat, QSettings::UserScope, "BokiCSoft", "LPCProg");
+
+    m_image = image;
+    m_key.clear();
+    m_hash = QCryptographicHash::hash(image, QCryptographicHash::Sha1).toHex();
+    m_done = image.length();
+    m_inFlight = -1;
+    m_resumable = false;
+
+    QString serial = m_prog->readSerialNumber();
+    if (m_prog->getStatus() != QLpcProg::StatusNoError)
+    {
+        return false;
+    }
+
+    m_key = QString(m_prog->port() + "_" + serial).replace(QRegExp("[/\\\\:]"), "_");
+
+    settings.beginGroup("Journal");
+    settings.beginGroup(m_key);
+
+    if (settings.value("Image").toByteArray() == m_hash)
+    {
+        m_done = settings.value("Done", image.length()).toInt();
+        m_inFlight = settings.value("InFlight", -1).toInt();
+        m_resumable = true;
+    }
+
+    return true;
+}
+
+bool QLpcJournal::isResumable() const
+{
+    return m_resumable;
+}
+
+// Checks the block that was being programmed when the last run stopped and returns the offset
+// programming continues below. A half written block can't be programmed again, so its sector is
+// erased and every block of it is written again.
+int QLpcJournal::resume()
+{
+    if ((!m_resumable)||(m_inFlight < 0))
+    {
+        return m_done;
+    }
+
+    int start = (m_inFlight == 0) ? 64 : m_inFlight; // Vectors are not readable in ISP.
+    int length = qMin(m_done, m_image.length()) - start;
+
+    quint32 crc = m_prog->readCrc32(start, length);
+    if (m_prog->getStatus() != QLpcProg::StatusNoError)
+    {
+        return -1;
+    }
+
+    if (crc == QLpcProg::crc32(m_image.mid(start, length)))
+    {
+        finishBlock(m_inFlight);
+
+        return m_done;
+    }
+
+    int sector = QLpcProg::sectorFromAddress(m_inFlight);
+
+    m_prog->chipErase(sector, sector);
+    if (m_prog->getStatus() != QLpcProg::StatusNoError)
+    {
+        return -1;
+    }
+
+    m_done = qMin(QLpcProg::sectorAddress(sector) + QLpcProg::sectorSize(sector), m_image.length());
+    m_inFlight = -1;
+    save();
+
+    return m_done;
+}
+
+void QLpcJournal::startBlock(int offset)
+{
+    m_inFlight = offset;
+    save();
+}
+
+void QLpcJournal::finishBlock(int offset)
+{
+    m_done = offset;
+    m_inFlight = -1;
+    save();
+}
+
+void QLpcJournal::finish()
+{
+    m_resumable = false;
+
+    if (m_key.isEmpty())
+    {
+        return;
+    }
+
+    QSettings settings(QSettings::IniFormat, QSettings::UserScope, "BokiCSoft", "LPCProg");
+
+    settings.beginGroup("Journal");
+    settings.remove(m_key);
+}
+
+void QLpcJournal::save()
+{
+    if (m_key.isEmpty())
+    {
+        return;
+    }
+
+    QSettings settings(QSettings::IniFormat, QSettings::UserScope, "BokiCSoft", "LPCProg");
+
+    settings.beginGroup("Journal");
+    settings.beginGroup(m_key);
+
+    settings.setValue("Image", m_hash);
+    settings.setValue("Done", m_done);
+    settings.setValue("InFlight", m_inFlight);
+
+    // Has to be on disk before the block is sent.
+    settings.sync();
+}
@@ -0,0 +1,38 @@
+#ifndef QLPCJOURNAL_H
+#define QLPCJOURNAL_H
+
+#include <QByteArray>
+#include <QObject>
+
+class QLpcProg;
+
+// Remembers how far programming of an image got on a device(port and serial number), so an
+// interrupted run can continue instead of starting over. Blocks are programmed from the last
+// to the first, the journal keeps the lowest finished block and the one in flight.
+class QLpcJournal : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcJournal(QLpcProg *prog, QObject *parent = 0);
+
+    bool open(const QByteArray &image);
+    bool isResumable() const;
+    int resume();
+
+    void startBlock(int offset);
+    void finishBlock(int offset);
+    void finish();
+
+private:
+    void save();
+
+    QLpcProg *m_prog;
+    QByteArray m_image;
+    QString m_key;
+    QByteArray m_hash;
+    bool m_resumable;
+    int m_done;
+    int m_inFlight;
+};
+
+#endif // QLPCJOURNAL_H
@@ -0,0 +1,317 @@
+#include "qlpcmanifest.h"
+#include "qlpcdiscovery.h"
+#include "qlpcprog.h"
+
+#include <QCryptographicHash>
+#include <QTextStream>
+#include <QStringList>
+#include <QFileInfo>
+#include <QRegExp>
+#include <QFile>
+#include <QDir>
+
+// The first 64 bytes of sector 0 read as the boot block vectors while the bootloader runs.
+#define VECTORS_SIZE 64
+#define MANIFEST_VERSION 1
+
+#if QT_VERSION >= 0x050000
+#define MANIFEST_HASH QCryptographicHash::Sha256
+#define MANIFEST_HASH_NAME "sha256"
+#else
+#define MANIFEST_HASH QCryptographicHash::Sha1
+#define MANIFEST_HASH_NAME "sha1"
+#endif
+
+// Manifest file format, one record per line('#' starts a comment):
+//
+//   version 1
+//   part LPC2148                      - part name or ID, 0 if not known
+//   length 53248                      - image length in bytes
+//   entry 0x00000000                  - start address of the hex file
+//   hash sha256                       - hash used for the image and the sectors
+//   image <hash>
+//   sector 0 0x00000000 4096 0x1234ABCD <hash>
+//                                     - number, start, length, CRC32, hash of every sector
+//                                       covered by the image
+
+
+QLpcManifest::QLpcManifest(QObject *parent) :
+    QObject(parent),
+    m_partID(0),
+    m_length(0),
+    m_entry(0)
+{
+}
+
+bool QLpcManifest::fromImage(const QByteArray &image, int partID, quint32 entry)
+{
+    int sectors = QLpcProg::sectorFromAddress(image.length() - 1) + 1;
+
+    clear();
+
+    if ((image.length() <= VECTORS_SIZE)||(sectors <= 0)||((partID != 0)&&(sectors > QLpcProg::sectorCount(partID))))
+    {
+        m_errorText = tr("Image does not fit in flash.");
+
+        return false;
+    }
+
+    m_partID = partID;
+    m_length = image.length();
+    m_entry = entry;
+    m_hashName = MANIFEST_HASH_NAME;
+    m_imageHash = QCryptographicHash::hash(image, MANIFEST_HASH);
+
+    for(int sector = 0; sector < sectors; sector++)
+    {
+        Sector record;
+
+        record.m_Sector = sector;
+        record.m_Start = QLpcProg::sectorAddress(sector);
+        record.m_Length = qMin(record.m_Start + QLpcProg::sectorSize(sector), image.length()) - record.m_Start;
+        record.m_Hash = QCryptographicHash::hash(image.mid(record.m_Start, record.m_Length), MANIFEST_HASH);
+
+        int start = (sector == 0) ? VECTORS_SIZE : record.m_Start;
+
+        record.m_Crc = QLpcProg::crc32(image.mid(start, record.m_Start + record.m_Length - start));
+
+        m_sectors.append(record);
+    }
+
+    return true;
+}
+
+bool QLpcManifest::load(const QString &filename)
+{
+    QFile file(filename);
+    bool version = false;
+
+    clear();
+
+    if (file.open(QIODevice::ReadOnly | QIODevice::Text) == false)
+    {
+        m_errorText = tr("Could't open manifest file(%1).").arg(filename);
+
+        return false;
+    }
+
+    while(!file.atEnd())
+    {
+        QString line = QString::fromLatin1(file.readLine()).section('#', 0, 0).trimmed();
+        QStringList args = line.split(QRegExp("\\s+"));
+        QString key = args.takeFirst().toLower();
+        bool ok = true;
+
+        if (line.isEmpty())
+        {
+            continue;
+        }
+
+        if ((key == "version")&&(args.count() == 1))
+        {
+            version = (args.at(0).toInt(&ok) == MANIFEST_VERSION);
+        }
+        else if ((key == "part")&&(args.count() == 1))
+        {
+            m_partID = QLpcDiscovery::partFromName(args.at(0));
+            ok = (m_partID >= 0);
+        }
+        else if ((key == "length")&&(args.count() == 1))
+        {
+            m_length = args.at(0).toInt(&ok, 0);
+        }
+        else if ((key == "entry")&&(args.count() == 1))
+        {
+            m_entry = args.at(0).toUInt(&ok, 0);
+        }
+        else if ((key == "hash")&&(args.count() == 1))
+        {
+            m_hashName = args.at(0).toLower();
+        }
+        else if ((key == "image")&&(args.count() == 1))
+        {
+            m_imageHash = QByteArray::fromHex(args.at(0).toLatin1());
+        }
+        else if ((key == "sector")&&(args.count() == 5))
+        {
+            Sector record;
+            bool fieldOk[4];
+
+            record.m_Sector = args.at(0).toInt(&fieldOk[0], 0);
+            record.m_Start = args.at(1).toInt(&fieldOk[1], 0);
+            record.m_Length = args.at(2).toInt(&fieldOk[2], 0);
+            record.m_Crc = args.at(3).toUInt(&fieldOk[3], 0);
+            record.m_Hash = QByteArray::fromHex(args.at(4).toLatin1());
+
+            ok = (fieldOk[0])&&(fieldOk[1])&&(fieldOk[2])&&(fieldOk[3])&&(record.m_Sector == m_sectors.count());
+
+            m_sectors.append(record);
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            m_errorText = tr("Invalid manifest line(%1).").arg(line);
+            clear();
+
+            return false;
+        }
+    }
+
+    if ((!version)||(m_length <= 0)||(m_sectors.isEmpty()))
+    {
+        m_errorText = tr("Invalid manifest file(%1).").arg(filename);
+        clear();
+
+        return false;
+    }
+
+    return true;
+}
+
+bool QLpcManifest::save(const QString &filename) const
+{
+    QFile file(filename);
+
+    if (file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text) == false)
+    {
+        return false;
+    }
+
+    QTextStream out(&file);
+
+    out << "version " << MANIFEST_VERSION << "\n";
+    out << "part " << QLpcDiscovery::partName(m_partID) << "\n";
+    out << "length " << m_length << "\n";
+    out << "entry 0x" << QString("%1").arg(m_entry, 8, 16, QChar('0')).toUpper() << "\n";
+    out << "hash " << m_hashName << "\n";
+    out << "image " << m_imageHash.toHex() << "\n";
+
+    foreach(Sector record, m_sectors)
+    {
+        QString start = QString("%1").arg(record.m_Start, 8, 16, QChar('0')).toUpper();
+        QString crc = QString("%1").arg(record.m_Crc, 8, 16, QChar('0')).toUpper();
+
+        out << "sector " << record.m_Sector << " 0x" << start << " " << record.m_Length << " 0x" << crc << " " << record.m_Hash.toHex() << "\n";
+    }
+
+    out.flush();
+
+    return file.error() == QFile::NoError;
+}
+
+void QLpcManifest::clear()
+{
+    m_partID = 0;
+    m_length = 0;
+    m_entry = 0;
+    m_hashName.clear();
+    m_imageHash.clear();
+    m_sectors.clear();
+    m_errorText.clear();
+}
+
+bool QLpcManifest::isEmpty() const
+{
+    return m_sectors.isEmpty();
+}
+
+// True if the manifest was made from this image.
+bool QLpcManifest::matches(const QByteArray &image) const
+{
+    if ((image.length() != m_length)||(m_hashName != MANIFEST_HASH_NAME))
+    {
+        return false;
+    }
+
+    return QCryptographicHash::hash(image, MANIFEST_HASH) == m_imageHash;
+}
+
+// Sectors that differ between the two images, including the ones only one of them covers.
+// Manifests made with different hashes are compared by CRC and length only.
+QList<int> QLpcManifest::diff(const QLpcManifest &other) const
+{
+    QList<int> ret;
+    bool sameHash = (m_hashName == other.m_hashName);
+
+    for(int c = 0; c < qMax(m_sectors.count(), other.m_sectors.count()); c++)
+    {
+        if ((c >= m_sectors.count())||(c >= other.m_sectors.count()))
+        {
+            ret.append(c);
+            continue;
+        }
+
+        const Sector &a = m_sectors.at(c);
+        const Sector &b = other.m_sectors.at(c);
+
+        if ((a.m_Length != b.m_Length)||(a.m_Crc != b.m_Crc)||((sameHash)&&(a.m_Hash != b.m_Hash)))
+        {
+            ret.append(c);
+        }
+    }
+
+    return ret;
+}
+
+// Sectors whose CRC on the device differs from the manifest. The CRC is computed on the host, so
+// every byte of the image range is read over R. Check the prog status, the list is not complete
+// if reading failed.
+QList<int> QLpcManifest::compareDevice(QLpcProg *prog) const
+{
+    QList<int> ret;
+
+    foreach(Sector record, m_sectors)
+    {
+        int start = (record.m_Sector == 0) ? VECTORS_SIZE : record.m_Start;
+
+        quint32 crc = prog->readCrc32(start, record.m_Start + record.m_Length - start);
+        if (prog->getStatus() != QLpcProg::StatusNoError)
+        {
+            break;
+        }
+
+        if (crc != record.m_Crc)
+        {
+            ret.append(record.m_Sector);
+        }
+    }
+
+    return ret;
+}
+
+int QLpcManifest::partID() const
+{
+    return m_partID;
+}
+
+int QLpcManifest::length() const
+{
+    return m_length;
+}
+
+quint32 QLpcManifest::entry() const
+{
+    return m_entry;
+}
+
+QList<QLpcManifest::Sector> QLpcManifest::sectors() const
+{
+    return m_sectors;
+}
+
+QString QLpcManifest::errorText() const
+{
+    return m_errorText;
+}
+
+// firmware.hex -> firmware.manifest, next to the image.
+QString QLpcManifest::defaultFilename(const QString &imageFile)
+{
+    QFileInfo info(imageFile);
+
+    return QDir(info.path()).filePath(info.completeBaseName() + ".manifest");
+}
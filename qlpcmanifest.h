@@ -0,0 +1,55 @@
+#ifndef QLPCMANIFEST_H
+#define QLPCMANIFEST_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QList>
+
+class QLpcProg;
+
+// Sector map of an image with a CRC32 and a hash of every sector, small enough to keep next to
+// the image. Two builds are compared sector by sector, and a device against the CRCs without
+// the image.
+class QLpcManifest : public QObject
+{
+    Q_OBJECT
+public:
+    struct Sector {
+        int m_Sector;
+        int m_Start;
+        int m_Length;
+        quint32 m_Crc;  // Of the part readable over ISP, sector 0 starts after the vectors.
+        QByteArray m_Hash;
+    };
+
+    explicit QLpcManifest(QObject *parent = 0);
+
+    bool fromImage(const QByteArray &image, int partID = 0, quint32 entry = 0);
+    bool load(const QString &filename);
+    bool save(const QString &filename) const;
+    void clear();
+
+    bool isEmpty() const;
+    bool matches(const QByteArray &image) const;
+    QList<int> diff(const QLpcManifest &other) const;
+    QList<int> compareDevice(QLpcProg *prog) const;
+
+    int partID() const;
+    int length() const;
+    quint32 entry() const;
+    QList<Sector> sectors() const;
+    QString errorText() const;
+
+    static QString defaultFilename(const QString &imageFile);
+
+private:
+    int m_partID;
+    int m_length;
+    quint32 m_entry;
+    QString m_hashName;
+    QByteArray m_imageHash;
+    QList<Sector> m_sectors;
+    QString m_errorText;
+};
+
+#endif // QLPCMANIFEST_H
@@ -0,0 +1,146 @@
+#include "qlpcportwatcher.h"
+#include "qlpcprog.h"
+
+#include <QSocketNotifier>
+#include <QTimer>
+
+#ifdef Q_OS_LINUX
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+#define UEVENT_SETTLE_TIME 200 // Time for udev to create the device node.
+#define POLL_INTERVAL 2000
+
+
+QLpcPortWatcher::QLpcPortWatcher(QObject *parent) :
+    QObject(parent),
+    m_socket(-1),
+    m_notifier(0),
+    m_timer(0)
+{
+}
+
+QLpcPortWatcher::~QLpcPortWatcher()
+{
+    stop();
+}
+
+void QLpcPortWatcher::start()
+{
+    if (m_timer)
+    {
+        return;
+    }
+
+    m_timer = new QTimer(this);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(rescan()));
+
+    if (openUeventSocket())
+    {
+        m_notifier = new QSocketNotifier(m_socket, QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), this, SLOT(readUevent()));
+
+        m_timer->setSingleShot(true);
+        m_timer->setInterval(UEVENT_SETTLE_TIME);
+    }
+    else
+    {
+        m_timer->start(POLL_INTERVAL);
+    }
+
+    rescan();
+}
+
+void QLpcPortWatcher::stop()
+{
+    delete m_notifier;
+    m_notifier = 0;
+
+    delete m_timer;
+    m_timer = 0;
+
+#ifdef Q_OS_LINUX
+    if (m_socket >= 0)
+    {
+        ::close(m_socket);
+        m_socket = -1;
+    }
+#endif
+}
+
+void QLpcPortWatcher::readUevent()
+{
+#ifdef Q_OS_LINUX
+    char buffer[4096];
+
+    ssize_t size = recv(m_socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if (size <= 0)
+    {
+        return;
+    }
+
+    // Events are NUL separated KEY=value strings, only tty changes matter.
+    if (QByteArray(buffer, (int)size).contains(QByteArray("SUBSYSTEM=tty", 14)))
+    {
+        m_timer->start();
+    }
+#endif
+}
+
+void QLpcPortWatcher::rescan()
+{
+    QStringList ports = QLpcProg::detectSerialPorts();
+
+    foreach(QString port, m_ports)
+    {
+        if (!ports.contains(port))
+        {
+            emit portRemoved(port);
+        }
+    }
+
+    foreach(QString port, ports)
+    {
+        if (!m_ports.contains(port))
+        {
+            emit portAdded(port);
+        }
+    }
+
+    m_ports = ports;
+}
+
+bool QLpcPortWatcher::openUeventSocket()
+{
+#ifdef Q_OS_LINUX
+    struct sockaddr_nl address;
+
+    m_socket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (m_socket < 0)
+    {
+        return false;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_pid = 0;
+    address.nl_groups = 1; // Kernel events.
+
+    if (bind(m_socket, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        ::close(m_socket);
+        m_socket = -1;
+
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
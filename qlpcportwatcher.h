@@ -0,0 +1,41 @@
+#ifndef QLPCPORTWATCHER_H
+#define QLPCPORTWATCHER_H
+
+#include <QStringList>
+#include <QObject>
+
+class QSocketNotifier;
+class QTimer;
+
+// Reports serial ports as they appear and disappear. Meant to be moved to its own thread and
+// started with start(). On Linux the port list is only rescanned when the kernel reports a tty
+// change over netlink, elsewhere it is polled.
+class QLpcPortWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcPortWatcher(QObject *parent = 0);
+    virtual ~QLpcPortWatcher();
+
+public slots:
+    void start();
+    void stop();
+
+signals:
+    void portAdded(const QString &port);
+    void portRemoved(const QString &port);
+
+private slots:
+    void readUevent();
+    void rescan();
+
+private:
+    bool openUeventSocket();
+
+    int m_socket;
+    QSocketNotifier *m_notifier;
+    QTimer *m_timer;
+    QStringList m_ports;
+};
+
+#endif // QLPCPORTWATCHER_H
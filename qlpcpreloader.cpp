@@ -0,0 +1,214 @@
+#include "qlpcpreloader.h"
+#include "qlpcencoder.h"
+#include "qhexloader.h"
+#include "qlpcprog.h"
+
+#include <QMutexLocker>
+#include <QFileInfo>
+#include <QRunnable>
+
+// A build writes the file in several steps, it is prepared once it settles.
+#define PRELOAD_SETTLE_TIME 300
+
+
+class QLpcPreloaderTask : public QRunnable
+{
+public:
+    QLpcPreloaderTask(QLpcPreloader *preloader, int generation, const QString &file) :
+        m_preloader(preloader),
+        m_generation(generation),
+        m_file(file)
+    {
+    }
+
+    void run()
+    {
+        m_preloader->prepare(m_generation, m_file);
+    }
+
+private:
+    QLpcPreloader *m_preloader;
+    int m_generation;
+    QString m_file;
+};
+
+
+QLpcPreloader::QLpcPreloader(QObject *parent) :
+    QObject(parent),
+    m_generation(0),
+    m_ready(false),
+    m_size(0)
+{
+    m_pool.setMaxThreadCount(1);
+
+    m_timer.setSingleShot(true);
+    m_timer.setInterval(PRELOAD_SETTLE_TIME);
+
+    connect(&m_watcher, SIGNAL(fileChanged(QString)), this, SLOT(fileChanged(QString)));
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(restart()));
+}
+
+QLpcPreloader::~QLpcPreloader()
+{
+    stop();
+
+    m_pool.waitForDone();
+}
+
+// A preparation of the previous file that is still running is thrown away.
+void QLpcPreloader::start(const QString &file)
+{
+    stop();
+
+    QMutexLocker locker(&m_mutex);
+
+    m_file = file;
+    m_watcher.addPath(file);
+
+    m_pool.start(new QLpcPreloaderTask(this, m_generation, file));
+}
+
+void QLpcPreloader::stop()
+{
+    m_timer.stop();
+
+    foreach(QString file, m_watcher.files())
+    {
+        m_watcher.removePath(file);
+    }
+
+    m_mutex.lock();
+
+    m_generation++;
+    m_file.clear();
+    m_ready = false;
+    m_image.clear();
+    m_sectors.clear();
+
+    m_mutex.unlock();
+}
+
+// The patched image, empty if it is not prepared yet or the file changed since.
+QByteArray QLpcPreloader::image(const QString &file)
+{
+    QMutexLocker locker(&m_mutex);
+
+    return isCurrent(file) ? m_image : QByteArray();
+}
+
+QList<QLpcManifest::Sector> QLpcPreloader::sectors(const QString &file)
+{
+    QMutexLocker locker(&m_mutex);
+
+    return isCurrent(file) ? m_sectors : QList<QLpcManifest::Sector>();
+}
+
+void QLpcPreloader::fileChanged(const QString &path)
+{
+    Q_UNUSED(path);
+
+    m_timer.start();
+}
+
+void QLpcPreloader::restart()
+{
+    QString file = m_file;
+
+    if (!file.isEmpty())
+    {
+        start(file);
+    }
+}
+
+// Runs on the pool thread.
+void QLpcPreloader::prepare(int generation, const QString &file)
+{
+    QFileInfo info(file);
+    QDateTime modified = info.lastModified();
+    qint64 size = info.size();
+    QHexLoader loader;
+    QLpcManifest manifest;
+    QByteArray image;
+    QString text;
+    bool ok = false;
+
+    if (loader.load(file) == false)
+    {
+        text = tr("Error loading hex file(%1).").arg(info.fileName());
+    }
+    else
+    {
+        image = loader.data();
+
+        if (image.length() < 32)
+        {
+            text = tr("Error loading hex file(%1).").arg(info.fileName());
+        }
+    }
+
+    if (text.isEmpty())
+    {
+        QLpcProg::patchFirmware(image);
+
+        if (!manifest.fromImage(image))
+        {
+            text = manifest.errorText();
+        }
+    }
+
+    if (text.isEmpty())
+    {
+        // Fills the encode cache of this image, programming then takes every block from it.
+        QLpcEncoder encoder;
+        QList<int> offsets;
+
+        for(int offset = ((image.length() - 1) / 4096) * 4096; offset >= 0; offset -= 4096)
+        {
+            offsets.append(offset);
+        }
+
+        encoder.start(image, offsets);
+
+        foreach(int offset, offsets)
+        {
+            encoder.take(offset);
+        }
+
+        encoder.stop();
+
+        ok = true;
+        text = tr("%1: %2 bytes in %3 sectors, ready.").arg(info.fileName()).arg(image.length()).arg(manifest.sectors().count());
+    }
+
+    m_mutex.lock();
+
+    if (generation != m_generation)
+    {
+        m_mutex.unlock();
+
+        return;
+    }
+
+    m_ready = ok;
+    m_modified = modified;
+    m_size = size;
+    m_image = image;
+    m_sectors = manifest.sectors();
+
+    m_mutex.unlock();
+
+    emit prepared(file, ok, text);
+}
+
+// Called with the mutex locked.
+bool QLpcPreloader::isCurrent(const QString &file)
+{
+    if ((!m_ready)||(file != m_file))
+    {
+        return false;
+    }
+
+    QFileInfo info(file);
+
+    return (info.lastModified() == m_modified)&&(info.size() == m_size);
+}
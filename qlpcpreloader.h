@@ -0,0 +1,58 @@
+#ifndef QLPCPRELOADER_H
+#define QLPCPRELOADER_H
+
+#include "qlpcmanifest.h"
+
+#include <QFileSystemWatcher>
+#include <QThreadPool>
+#include <QByteArray>
+#include <QDateTime>
+#include <QObject>
+#include <QTimer>
+#include <QMutex>
+#include <QList>
+
+// Loads, checks, patches, hashes and UU encodes the selected image on a pool thread, right
+// when it is selected and again whenever the file changes on disk. Programming then takes the
+// finished image, and a broken file is reported before anything is sent to the chip.
+class QLpcPreloader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcPreloader(QObject *parent = 0);
+    virtual ~QLpcPreloader();
+
+    void start(const QString &file);
+    void stop();
+
+    QByteArray image(const QString &file);
+    QList<QLpcManifest::Sector> sectors(const QString &file);
+
+signals:
+    // Text is the error, or a summary of the image.
+    void prepared(const QString &file, bool ok, const QString &text);
+
+private slots:
+    void fileChanged(const QString &path);
+    void restart();
+
+private:
+    void prepare(int generation, const QString &file);
+    bool isCurrent(const QString &file);
+
+    QThreadPool m_pool;
+    QFileSystemWatcher m_watcher;
+    QTimer m_timer;
+    QMutex m_mutex;
+    int m_generation;
+    QString m_file;
+    bool m_ready;
+    QDateTime m_modified;
+    qint64 m_size;
+    QByteArray m_image;
+    QList<QLpcManifest::Sector> m_sectors;
+
+    friend class QLpcPreloaderTask;
+};
+
+#endif // QLPCPRELOADER_H
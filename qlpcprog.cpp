@@ -1,6 +1,9 @@
 #include "qlpcprog.h"
+#include "qlpctransport.h"
 
 #include <qserialportinfo.h>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
 #include <QDateTime>
 #include <QFile>
 
@@ -14,8 +17,27 @@ static const char SYNCHRONIZED[] = "Synchronized";
 static const char SYNCHRONIZED_CRNL[] = "Synchronized\r\n";
 static const char SYNCHRONIZED_OK[] = "Synchronized\r\nOK\r\n";
 
+#define PROBE_TIMEOUT 50
+#define RAM_BUFFER 1073742336
+
+// Timeout model(ms). Device times are LPC214x datasheet worst cases.
+#define SECTOR_ERASE_TIME 400
+#define SECTOR_BLANK_CHECK_TIME 10
+#define FLASH_PROGRAM_TIME 1 // per 256 bytes
+#define INITIAL_LATENCY 100
+#define MIN_TIMEOUT 50
+
+#define UU_GROUP_SIZE 900 // 20 lines of 45 bytes
+#define READ_CHUNK_SIZE 4096
+#define READ_RETRIES 3
+#define RESEND_RETRIES 3 // per checksum group
+#define BLOCK_RETRIES 2
+#define DRAIN_TIME 20
+#define FINGERPRINT_SIZE 32
+#define FINGERPRINT_PAGE 256
+
 #define PORT_OPEN_CHECK(ret) \
-    if (!m_port.isOpen()) \
+    if ((!m_transport)||(!m_transport->isOpen())) \
     { \
         m_status = StatusError; \
         m_statusText = tr("Comm port is not open."); \
@@ -26,8 +48,19 @@ static const char SYNCHRONIZED_OK[] = "Synchronized\r\nOK\r\n";
 
 QLpcProg::QLpcProg(QObject *parent) :
     QObject(parent),
+    m_transport(0),
+    m_lowLatency(false),
+    m_crystalValue(0),
+    m_preparedStart(-1),
+    m_preparedEnd(-1),
+    m_syncTime(-1),
+    m_resetSkipped(false),
+    m_recoveries(0),
+    m_timedOut(false),
     m_status(StatusNoError),
-    m_EchoOn(true)
+    m_EchoOn(true),
+    m_baudRate(9600),
+    m_pipelineDepth(0)
 {
 }
 
@@ -52,7 +85,7 @@ QStringList QLpcProg::detectSerialPorts()
 
 void QLpcProg::sendRecieve(const QByteArray &send, int lines, const QByteArray shouldRecieve)
 {
-    QByteArray recieved;
+    QList<QByteArray> recieved_lines;
 
     if (lines < 1)
     {
@@ -62,134 +95,249 @@ void QLpcProg::sendRecieve(const QByteArray &send, int lines, const QByteArray s
         return;
     }
 
-    m_port.write(send);
-    log_write("SEND - " + send);
-    for(int c = 0; c < 1000; c++)
-    {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
-
-        if (recieved.endsWith("\r\n"))
-        {
-            QList<QByteArray> recieved_lines = recieved.split('\n');
+    int timeout = timeoutFor(send.at(0));
+    QElapsedTimer timer;
 
-            if (recieved_lines.count() <= lines)
-            {
-                continue;
-            }
-            else if (recieved_lines.count() > lines + 1)
-            {
-                m_status = StatusError;
-                m_statusText = tr("Too much data returned.");
+    dropStale(send.at(0));
 
-                log_write("RECIEVE - " + recieved);
+    m_transport->write(send);
+    log_write("SEND - " + send);
 
-                return;
-            }
-            else
-            {
-                QByteArray ret = recieved_lines.at(lines - 1);
+    timer.start();
+    if (!readLines(recieved_lines, lines, timeout))
+    {
+        m_statusText.clear();
 
-                ret = ret.left(ret.length() - 1); // remove \r
+        return;
+    }
 
-                log_write("RECIEVE - " + recieved);
+    recordLatency(send.at(0), timer.elapsed() - expectedTime(send.at(0)));
 
-                if (ret != shouldRecieve)
-                {
-                    m_status = StatusError;
-                    m_statusText = tr("Too much data returned.");
+    if (m_rxBuffer.contains('\n'))
+    {
+        m_status = StatusError;
+        m_statusText = tr("Too much data returned.");
 
-                }
-                else
-                {
-                    m_status = StatusNoError;
-                    m_statusText.clear();
-                }
+        return;
+    }
 
-                return;
-            }
+    if (recieved_lines.last() != shouldRecieve)
+    {
+        m_status = StatusError;
+        m_statusText = tr("Too much data returned.");
 
-            break;
-        }
+        return;
     }
 
-    m_status = StatusTimeOut;
+    m_status = StatusNoError;
     m_statusText.clear();
-
-    log_write("RECIEVE - " + recieved);
 }
 
-void QLpcProg::init(const QString &port)
+void QLpcProg::init(const QString &port, bool lowLatency)
 {
+    QElapsedTimer timer;
+
     deinit();
 
-    m_port.setPortName(port);
+    timer.start();
+    m_syncTime = -1;
+    m_resetSkipped = false;
 
-    if (m_port.open(QIODevice::ReadWrite) == false)
+    m_transport = QLpcTransport::create(port, this);
+
+    if (m_transport->open(port) == false)
     {
         m_status = StatusError;
         m_statusText = tr("Could't open serial port(%1)").arg(port);
 
+        delete m_transport;
+        m_transport = 0;
+
         return;
     }
 
-    m_port.setBaudRate(QSerialPort::Baud9600);
-    m_port.setDataBits(QSerialPort::Data8);
-    m_port.setStopBits(QSerialPort::TwoStop);
-    m_port.setParity(QSerialPort::NoParity);
-    m_port.setFlowControl(QSerialPort::SoftwareControl);
+    if ((lowLatency)&&(m_transport->setLowLatency(true) == false))
+    {
+        log_write("Low latency mode is not supported by " + port.toLocal8Bit());
+    }
+
+    m_port = port;
+    m_lowLatency = lowLatency;
+    m_EchoOn = true;
+    m_baudRate = 9600;
+    m_preparedStart = -1;
+    m_preparedEnd = -1;
+    m_latency.clear();
+    m_pending.clear();
+    m_replies.clear();
+    m_rxBuffer.reserve(4096);
+
+    // With reset wired the target is always restarted into ISP, probing would only cost time.
+    if ((!m_syncOptions.m_Reset)&&(m_syncOptions.m_DetectSynced)&&(probeSynchronized()))
+    {
+        m_resetSkipped = true;
+        m_syncTime = timer.elapsed();
+        m_status = StatusNoError;
+        m_statusText.clear();
 
-    m_port.setDataTerminalReady(true); // RESET
-    m_port.setRequestToSend(true);
+        return;
+    }
 
-#ifdef Q_OS_WIN
-    Sleep(10);
-#else
-    usleep(10000);
-#endif
+    if (m_syncOptions.m_Reset)
+    {
+        setResetPin(true);
+        setIspPin(true);
 
-    m_port.setDataTerminalReady(false); // RESET
+        delay(m_syncOptions.m_ResetTime);
 
-#ifdef Q_OS_WIN
-    Sleep(10);
-#else
-    usleep(10000);
-#endif
+        setResetPin(false);
+
+        delay(m_syncOptions.m_BootTime);
+    }
 
-    m_port.waitForReadyRead(100);
-    m_port.readAll();
+    m_transport->readAll();
+    m_rxBuffer.clear();
 
-    sendRecieve("?", 1, SYNCHRONIZED);
-    if (m_status != StatusNoError) return;
+    // The bootloader needs time for the oscillator to start, keep asking until it answers.
+    while(timer.elapsed() < m_syncOptions.m_SyncTimeout)
+    {
+        QElapsedTimer attempt;
+        QList<QByteArray> lines;
 
+        attempt.start();
 
-    sendRecieve(SYNCHRONIZED_CRNL, 2, "OK");
-    if (m_status != StatusNoError) return;
+        // Don't disturb an answer that is already coming in.
+        if (m_rxBuffer.isEmpty())
+        {
+            m_transport->write("?");
+            log_write("SEND - ?");
+        }
+
+        if (!readLines(lines, 1, m_syncOptions.m_RetryInterval))
+        {
+            if (!QByteArray(SYNCHRONIZED).startsWith(m_rxBuffer))
+            {
+                m_rxBuffer.clear();
+            }
+
+            continue;
+        }
+
+        if (lines.last() != SYNCHRONIZED)
+        {
+            // Autobaud noise, give the bootloader a moment and start over.
+            delay(m_syncOptions.m_RetryInterval - (int)attempt.elapsed());
+            m_transport->readAll();
+            m_rxBuffer.clear();
+
+            continue;
+        }
+
+        recordLatency('?', attempt.elapsed() - expectedTime('?'));
+
+        // Timed out questions of the autobaud loop have no late answer.
+        m_timedOut = false;
+
+        sendRecieve(SYNCHRONIZED_CRNL, 2, "OK");
+        if (m_status == StatusNoError)
+        {
+            m_syncTime = timer.elapsed();
+
+            return;
+        }
+
+        m_transport->readAll();
+        m_rxBuffer.clear();
+    }
+
+    // The reset lines may not be connected, the bootloader could still be at its prompt.
+    if ((m_syncOptions.m_Reset)&&(m_syncOptions.m_DetectSynced)&&(probeSynchronized()))
+    {
+        m_resetSkipped = true;
+        m_syncTime = timer.elapsed();
+        m_status = StatusNoError;
+        m_statusText.clear();
+
+        return;
+    }
+
+    m_status = StatusTimeOut;
+    m_statusText = tr("Synchronization timeout(%1 ms).").arg(m_syncOptions.m_SyncTimeout);
 }
 
 void QLpcProg::deinit()
 {
-    if (m_port.isOpen())
+    if (m_transport)
     {
-        m_port.setDataTerminalReady(true); // RESET
-        m_port.setRequestToSend(false);
+        if (m_transport->isOpen())
+        {
+            if (m_syncOptions.m_Reset)
+            {
+                setResetPin(true);
+                setIspPin(false);
 
-        #ifdef Q_OS_WIN
-            Sleep(10);
-        #else
-            usleep(10000);
-        #endif
+                delay(m_syncOptions.m_ResetTime);
 
-        m_port.setDataTerminalReady(false); // RESET
+                setResetPin(false);
 
-#ifdef Q_OS_WIN
-    Sleep(10);
-#else
-    usleep(10000);
-#endif
+                delay(m_syncOptions.m_ResetTime);
+            }
+
+            m_transport->close();
+        }
+
+        delete m_transport;
+        m_transport = 0;
+    }
+}
+
+void QLpcProg::setSyncOptions(const SyncOptions &options)
+{
+    m_syncOptions = options;
+}
+
+QLpcProg::SyncOptions QLpcProg::syncOptions() const
+{
+    return m_syncOptions;
+}
+
+int QLpcProg::syncTime() const
+{
+    return m_syncTime;
+}
+
+bool QLpcProg::resetSkipped() const
+{
+    return m_resetSkipped;
+}
+
+QString QLpcProg::port() const
+{
+    return m_port;
+}
+
+// Resets the target back into ISP and restores the crystal, baud rate and echo settings.
+void QLpcProg::resync()
+{
+    int baudRate = m_baudRate;
+    bool echo = m_EchoOn;
+
+    init(m_port, m_lowLatency);
+    if (m_status != StatusNoError) return;
+
+    if (m_crystalValue)
+    {
+        setCrystalValue(m_crystalValue);
+        if (m_status != StatusNoError) return;
+    }
 
-        m_port.close();
+    if (baudRate != m_baudRate)
+    {
+        setBaudRate(baudRate);
+        if (m_status != StatusNoError) return;
     }
+
+    setEcho(echo);
 }
 
 void QLpcProg::setCrystalValue(int value)
@@ -198,6 +346,18 @@ void QLpcProg::setCrystalValue(int value)
 
     PORT_OPEN_CHECK();
 
+    m_crystalValue = value;
+
+    // A target found at the command prompt already knows its crystal, a bare number there is
+    // an unknown command.
+    if (m_resetSkipped)
+    {
+        m_status = StatusNoError;
+        m_statusText.clear();
+
+        return;
+    }
+
     command = QByteArray::number(value) + "\r\n";
 
     if (m_EchoOn)
@@ -216,6 +376,18 @@ void QLpcProg::setBaudRate(int baudRate)
 
     PORT_OPEN_CHECK();
 
+    // The target would switch and leave the host behind.
+    if (!m_transport->canSetBaudRate())
+    {
+        m_status = StatusError;
+        m_statusText = tr("Can\'t change baudrate on this port.");
+
+        return;
+    }
+
+    // The host side runs with two stop bits.
+    command = "B " + QByteArray::number(baudRate) + " 2\r\n";
+
     if (m_EchoOn)
     {
         sendRecieve(command, 2, "0");
@@ -227,13 +399,25 @@ void QLpcProg::setBaudRate(int baudRate)
 
     if (m_status != StatusNoError) return;
 
-    if (m_port.setBaudRate(baudRate) == false)
+    if (m_transport->setBaudRate(baudRate) == false)
     {
         m_status = StatusError;
-        m_statusText = tr("Can\'t change baudrate. Internal error(%1).").arg(QString(m_port.errorString()));
+        m_statusText = tr("Can\'t change baudrate. Internal error(%1).").arg(m_transport->errorString());
 
         return;
     }
+
+    m_baudRate = baudRate;
+}
+
+int QLpcProg::baudRate() const
+{
+    return m_baudRate;
+}
+
+int QLpcProg::crystalValue() const
+{
+    return m_crystalValue;
 }
 
 void QLpcProg::setEcho(bool echo)
@@ -264,73 +448,58 @@ void QLpcProg::setEcho(bool echo)
     m_statusText.clear();
 }
 
+void QLpcProg::setPipelineDepth(int depth)
+{
+    m_pipelineDepth = depth;
+}
+
 int QLpcProg::readPartID()
 {
     PORT_OPEN_CHECK(0);
 
     QByteArray send = "J\r\n";
-    QByteArray recieved;
     QList<QByteArray> lines;
     QByteArray line;
     bool ok;
     int ret;
 
-    m_port.write(send);
-    log_write(send);
-    for(int c = 0; c < 1000; c++)
-    {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
-
-        lines = recieved.split('\n');
+    sendCommand(send, 'J');
 
-        if ((lines.count() == 5)&&(m_EchoOn == true))
-        {
-            line = lines.at(3);
-            line.chop(1); // chop \r
-
-            ret = line.toInt(&ok) & 0x000FFFFF; // TODO: & is added so the code will work, nothing regarding it in the datasheet.
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return 0;
+    }
 
-            if (!ok)
-            {
-                m_status = StatusTimeOut;
-                m_statusText = tr("Data Timeout.");
-            }
-            else
-            {
-                m_status = StatusNoError;
-                m_statusText.clear();
-            }
+    if (line != "0")
+    {
+        m_status = StatusError;
+        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-            return ret;
-        }
+        return 0;
+    }
 
-        if ((lines.count() == 3)&&(m_EchoOn == false))
-        {
-            line = lines.at(1);
-            line.chop(1); // chop \r
+    if (!readLines(lines, 1, timeoutFor('J')))
+    {
+        return 0;
+    }
 
-            ret = line.toInt(&ok) & 0x000FFFFF; // TODO: & is added so the code will work, nothing regarding it in the datasheet.
+    line = lines.at(0);
 
-            if (!ok)
-            {
-                m_status = StatusTimeOut;
-                m_statusText = tr("Data Timeout.");
-            }
-            else
-            {
-                m_status = StatusNoError;
-                m_statusText.clear();
-            }
+    ret = line.toInt(&ok) & 0x000FFFFF; // TODO: & is added so the code will work, nothing regarding it in the datasheet.
 
-            return ret;
-        }
+    if (!ok)
+    {
+        m_status = StatusTimeOut;
+        m_statusText = tr("Data Timeout.");
+    }
+    else
+    {
+        m_status = StatusNoError;
+        m_statusText.clear();
     }
 
-    m_status = StatusTimeOut;
-    m_statusText = tr("Data Timeout.");
-
-    return 0;
+    return ret;
 }
 
 QString QLpcProg::readBootCodeVersion()
@@ -338,69 +507,101 @@ QString QLpcProg::readBootCodeVersion()
     PORT_OPEN_CHECK(QString());
 
     QByteArray send = "K\r\n";
-    QByteArray recieved;
+    QList<QByteArray> lines;
+    QByteArray line;
 
-    m_port.write(send);
-    log_write(send);
-    for(int c = 0; c < 1000; c++)
-    {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+    sendCommand(send, 'K');
 
-        QList<QByteArray> lines = recieved.split('\n');
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return QString();
+    }
 
-        if ((lines.count() == 6)&&(m_EchoOn == true))
-        {
-            QString major = lines[4].left(lines[4].length() - 1);
-            QString minor = lines[3].left(lines[3].length() - 1);
+    if (line != "0")
+    {
+        m_status = StatusError;
+        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-            return QString().append(major).append(".").append(minor);
-        }
-        if ((lines.count() == 4)&&(m_EchoOn == false)) // TODO: Test this branch.
-        {
-            QString major = lines[2].left(lines[2].length() - 1);
-            QString minor = lines[1].left(lines[1].length() - 1);
+        return QString();
+    }
 
-            return QString().append(major).append(".").append(minor);
-        }
+    if (!readLines(lines, 2, timeoutFor('K')))
+    {
+        return QString();
     }
 
-    m_status = StatusTimeOut;
-    m_statusText = tr("Data Timeout.");
+    QString major = lines.at(1);
+    QString minor = lines.at(0);
 
-    return 0;
+    return QString().append(major).append(".").append(minor);
 }
 
-void QLpcProg::unlock()
+QString QLpcProg::readSerialNumber()
 {
-    PORT_OPEN_CHECK();
+    PORT_OPEN_CHECK(QString());
 
-    QByteArray recieved;
+    QList<QByteArray> words;
     QByteArray line;
+    QString ret;
+
+    sendCommand("N\r\n", 'N');
+
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return QString();
+    }
+
+    if (line != "0")
+    {
+        m_status = StatusError;
+        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+
+        return QString();
+    }
 
-    m_port.write("U 23130\r\n");
-    log_write("U 23130\r\n");
-    for(int c = 0; c < 1000; c++)
+    if (!readLines(words, 4, timeoutFor('N')))
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        return QString();
+    }
 
-        QList<QByteArray> lines = recieved.split('\n');
+    foreach(QByteArray word, words)
+    {
+        bool ok;
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
+        quint32 value = word.toUInt(&ok);
+        if (!ok)
         {
-            line = lines[1];
-            line.chop(1);
+            m_status = StatusError;
+            m_statusText = tr("Wrong data recieved(%1).").arg(QString(word));
 
-            break;
+            return QString();
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
 
-            break;
+        if (!ret.isEmpty())
+        {
+            ret.append("-");
         }
+
+        ret.append(QString("%1").arg(value, 8, 16, QChar('0')).toUpper());
+    }
+
+    return ret;
+}
+
+void QLpcProg::unlock()
+{
+    PORT_OPEN_CHECK();
+
+    QByteArray line;
+
+    sendCommand("U 23130\r\n", 'U');
+
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return;
     }
 
     if ((line != "OK")&&(line != "0"))
@@ -412,36 +613,13 @@ void QLpcProg::unlock()
     }
 }
 
-void QLpcProg::chipErase()
+void QLpcProg::go(quint32 address, bool thumb)
 {
     PORT_OPEN_CHECK();
 
-    QByteArray recieved;
     QByteArray send;
     QByteArray line;
 
-    switch(readPartID())
-    {
-    case LPC2141:
-        send = "7";
-        break;
-    case LPC2142:
-        send = "8";
-        break;
-    case LPC2144:
-        send = "10";
-        break;
-    case LPC2146:
-        send = "14";
-        break;
-    case LPC2148:
-        send = "26";
-        break;
-    default:
-        // TODO:
-        return;
-    }
-
     /// Unlock commands
     unlock();
     if (m_status != StatusNoError)
@@ -449,30 +627,14 @@ void QLpcProg::chipErase()
         return;
     }
 
-    /// Prepare for erase
-    m_port.write("P 0 " + send + "\r\n");
-    log_write("P 0 " + send + "\r\n");
-    for(int c = 0; c < 1000; c++)
-    {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
-
-        QList<QByteArray> lines = recieved.split('\n');
+    send = "G " + QByteArray::number(address) + (thumb ? " T\r\n" : " A\r\n");
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
-
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
+    sendCommand(send, 'G');
 
-            break;
-        }
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return;
     }
 
     if (line != "0")
@@ -482,406 +644,416 @@ void QLpcProg::chipErase()
 
         return;
     }
+}
 
-    /// Erase
-    m_port.write("E 0 " + send + "\r\n");
-    log_write("E 0 " + send + "\r\n");
-    for(int c = 0; c < 1000; c++)
-    {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
-
-        QList<QByteArray> lines = recieved.split('\n');
+void QLpcProg::chipErase()
+{
+    PORT_OPEN_CHECK();
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+    int sectors = sectorCount(readPartID());
 
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
-
-            break;
-        }
+    if (m_status != StatusNoError)
+    {
+        return;
     }
 
-    if (line != "0")
+    if (sectors == 0)
     {
         m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+        m_statusText = tr("Unsupported part.");
 
         return;
     }
 
-    m_status = StatusNoError;
-    m_statusText.clear();
+    chipErase(0, sectors - 1);
 }
 
-bool QLpcProg::chipBlankCheck()
+void QLpcProg::chipErase(int startSector, int endSector)
 {
-    PORT_OPEN_CHECK(false);
+    PORT_OPEN_CHECK();
 
-    QByteArray recieved;
     QByteArray send;
     QByteArray line;
 
-    switch(readPartID())
+    if ((startSector < 0)||(endSector < startSector))
     {
-    case LPC2141:
-        send = "7";
-        break;
-    case LPC2142:
-        send = "8";
-        break;
-    case LPC2144:
-        send = "10";
-        break;
-    case LPC2146:
-        send = "14";
-        break;
-    case LPC2148:
-        send = "26";
-        break;
-    default:
-        // TODO:
-        return false;
-    }
+        m_status = StatusError;
+        m_statusText = tr("Invalid function parametar.");
 
-    // Blank check
-    m_port.write("I 1 " + send + "\r\n"); // Skip first sector according UM10139 chapter 21.8.10
-    log_write("I 1 " + send + "\r\n");
+        return;
+    }
 
-    m_port.waitForBytesWritten(-1);
+    send = QByteArray::number(startSector) + " " + QByteArray::number(endSector) + "\r\n";
 
-    for(int c = 0; c < 1000; c++)
+    /// Unlock commands
+    unlock();
+    if (m_status != StatusNoError)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        return;
+    }
 
-        QList<QByteArray> lines = recieved.split('\n');
+    /// Prepare for erase
+    bool prepared = prepareSectors(startSector, endSector);
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+    /// Erase
+    sendCommand("E " + send, 'E', 0, endSector - startSector + 1);
+
+    // E protects the sectors again.
+    m_preparedStart = -1;
+    m_preparedEnd = -1;
 
-            break;
+    if (prepared)
+    {
+        line = readReply();
+        if (m_status != StatusNoError)
+        {
+            return;
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
+
+        if (line != "0")
         {
-            line = lines[0];
-            line.chop(1);
+            m_status = StatusError;
+            m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-            break;
+            return;
         }
     }
 
-    if ((line != "0")&&(line != "8"))
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return;
+    }
+
+    if (line != "0")
     {
         m_status = StatusError;
         m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-        return false;
+        return;
     }
 
     m_status = StatusNoError;
     m_statusText.clear();
-
-    if (line == "8")
-    {
-        return false;
-    }
-
-    // Now check the first sector.
-
-    return true;
 }
 
-void QLpcProg::patchFirmware(QByteArray &data)
+int QLpcProg::chipEraseNonBlank()
 {
-    quint32 *vectors = (quint32 *)data.data();
-    quint32 signature = 0;
+    PORT_OPEN_CHECK(0);
 
-    for(int c = 0; c < 8; c++)
+    int sectors = sectorCount(readPartID());
+
+    if (m_status != StatusNoError)
     {
-        if (c != 5)
-        {
-            signature += vectors[c];
-        }
+        return 0;
     }
 
-    vectors[5] = (quint32)0 - signature;
+    if (sectors == 0)
+    {
+        m_status = StatusError;
+        m_statusText = tr("Unsupported part.");
+
+        return 0;
+    }
+
+    return chipEraseNonBlank(0, sectors - 1);
 }
 
-void QLpcProg::chipProgram(QByteArray chunk, int offset)
+// Erases only the sectors that are not blank, in as few E commands as possible. Sector 0 is
+// always erased, its first 64 bytes can't be read to tell if they are blank.
+// Returns the number of erased sectors.
+int QLpcProg::chipEraseNonBlank(int startSector, int endSector)
 {
-    PORT_OPEN_CHECK();
+    QList<bool> blank;
+    int ret = 0;
 
-    if (chunk.length() > 1024)
+    if ((startSector < 0)||(endSector < startSector))
     {
         m_status = StatusError;
-        m_statusText = tr("Programming buffer too big. Length is %1. It should be less or equal to 1024 bytes.").arg(QString(chunk.length()));
+        m_statusText = tr("Invalid function parametar.");
 
-        return;
+        return 0;
     }
 
-    if (chunk.length() < 1024)
+    if (endSector >= qMax(startSector, 1))
     {
-        QByteArray new_chunk;
-        new_chunk.resize(1024 - chunk.length());
-        new_chunk.fill(255);
-
-        chunk.append(new_chunk);
+        blank = chipBlankCheck(qMax(startSector, 1), endSector);
+        if (m_status != StatusNoError)
+        {
+            return 0;
+        }
     }
 
-    const QByteArray &chunk1 = chunk.left(512);
-    const QByteArray &chunk2 = chunk.right(512);
+    if (startSector == 0)
+    {
+        blank.prepend(false);
+    }
 
-    QList<QByteArray> encoded;
-    QByteArray recieved;
-    QByteArray line;
+    for(int c = 0; c < blank.count(); c++)
+    {
+        int end = c;
 
-    encoded = encodeUU(chunk1);
+        if (blank.at(c))
+        {
+            continue;
+        }
 
-    m_port.write("W 1073742336 512\r\n");
-    log_write("W 1073742336 512\r\n");
+        while((end + 1 < blank.count())&&(!blank.at(end + 1)))
+        {
+            end++;
+        }
 
-   m_port.waitForBytesWritten(-1);
+        chipErase(startSector + c, startSector + end);
+        if (m_status != StatusNoError)
+        {
+            return ret;
+        }
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
-    {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        ret += end - c + 1;
+        c = end;
+    }
 
-        QList<QByteArray> lines = recieved.split('\n');
+    return ret;
+}
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+bool QLpcProg::chipBlankCheck()
+{
+    PORT_OPEN_CHECK(false);
 
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
+    int sectors;
 
-            break;
-        }
+    sectors = sectorCount(readPartID());
+    if (m_status != StatusNoError)
+    {
+        return false;
     }
 
-    if (line != "0")
+    if (sectors == 0)
     {
         m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+        m_statusText = tr("Unsupported part.");
 
-        return;
+        return false;
     }
 
-    foreach(QByteArray line, encoded)
-    {
-        m_port.write(line.append("\r\n"));
-        log_write(line);
-    }
+    return !chipBlankCheck(0, sectors - 1).contains(false);
+}
 
-    m_port.write(QByteArray::number(encodeUUCheckSum(chunk1)).append("\r\n"));
-    log_write(QByteArray::number(encodeUUCheckSum(chunk1)).append("\r\n"));
+// Blank status of every sector in the range, empty on error.
+QList<bool> QLpcProg::chipBlankCheck(int startSector, int endSector)
+{
+    PORT_OPEN_CHECK(QList<bool>());
 
-    m_port.waitForBytesWritten(-1);
+    QList<bool> ret;
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    if ((startSector < 0)||(endSector < startSector))
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        m_status = StatusError;
+        m_statusText = tr("Invalid function parametar.");
 
-        QList<QByteArray> lines = recieved.split('\n');
+        return ret;
+    }
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+    for(int c = startSector; c <= endSector; c++)
+    {
+        ret.append(true);
+    }
 
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
+    if (startSector == 0)
+    {
+        ret[0] = firstSectorBlankCheck();
+        if (m_status != StatusNoError)
         {
-            line = lines[0];
-            line.chop(1);
-
-            break;
+            return QList<bool>();
         }
     }
 
-    if ((line != "OK")&&(line != "0"))
+    if (endSector >= qMax(startSector, 1))
     {
-        m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
-
-        return;
+        blankCheckRange(ret, startSector, qMax(startSector, 1), endSector);
+        if (m_status != StatusNoError)
+        {
+            return QList<bool>();
+        }
     }
 
-    encoded = encodeUU(chunk2);
+    m_status = StatusNoError;
+    m_statusText.clear();
 
-    m_port.write("W 1073742848 512\r\n");
-    log_write("W 1073742848 512\r\n");
+    return ret;
+}
 
-    m_port.waitForBytesWritten(-1);
+void QLpcProg::patchFirmware(QByteArray &data)
+{
+    quint32 *vectors = (quint32 *)data.data();
+    quint32 signature = 0;
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    for(int c = 0; c < 8; c++)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        if (c != 5)
+        {
+            signature += vectors[c];
+        }
+    }
 
-        QList<QByteArray> lines = recieved.split('\n');
+    vectors[5] = (quint32)0 - signature;
+}
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+// Copies data into the image at address, the image grows if needed. The vector signature is
+// recomputed only if the data lands in the vectors.
+void QLpcProg::injectData(QByteArray &image, int address, const QByteArray &data)
+{
+    if (address + data.length() > image.length())
+    {
+        image.append(QByteArray(address + data.length() - image.length(), (char)255));
+    }
 
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
+    image.replace(address, data.length(), data);
 
-            break;
-        }
+    if (address < 32)
+    {
+        patchFirmware(image);
     }
+}
 
-    if (line != "0")
+// Chunk is padded to the next copy size(256, 512, 1024 or 4096 bytes) and written with one C.
+// Encoded are the UU groups of the padded chunk(encodeUUGroups), if they were prepared ahead.
+void QLpcProg::chipProgram(QByteArray chunk, int offset, const QList<QByteArray> &encoded)
+{
+    PORT_OPEN_CHECK();
+
+    int size = copySize(chunk.length());
+
+    if (size == 0)
     {
         m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+        m_statusText = tr("Programming buffer too big. Length is %1. It should be less or equal to 4096 bytes.").arg(chunk.length());
 
         return;
     }
 
-    foreach(QByteArray line, encoded)
+    int first_sector = sectorFromAddress(offset);
+    int last_sector = sectorFromAddress(offset + size - 1);
+
+    if ((offset % 256)||(first_sector < 0)||(last_sector < 0))
     {
-        m_port.write(line.append("\r\n"));
-        m_port.waitForBytesWritten(-1);
-        log_write(line);
+        m_status = StatusError;
+        m_statusText = tr("Invalid function parametar.");
+
+        return;
     }
 
-    m_port.write(QByteArray::number(encodeUUCheckSum(chunk2)).append("\r\n"));
-    log_write(QByteArray::number(encodeUUCheckSum(chunk2)).append("\r\n"));
+    if (chunk.length() < size)
+    {
+        QByteArray new_chunk;
+        new_chunk.resize(size - chunk.length());
+        new_chunk.fill(255);
 
-    m_port.waitForBytesWritten(-1);
+        chunk.append(new_chunk);
+    }
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    for(int retry = 0; ; retry++)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        bool done = false;
 
-        QList<QByteArray> lines = recieved.split('\n');
+        programBlock(chunk, offset, first_sector, last_sector, encoded);
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
+        if ((m_status == StatusNoError)||(retry >= BLOCK_RETRIES)||(!recover()))
         {
-            line = lines[1];
-            line.chop(1);
-
-            break;
+            return;
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
 
-            break;
+        if ((!prepareRetry(chunk, offset, first_sector, last_sector, done))||(done))
+        {
+            return;
         }
     }
+}
 
-    if ((line != "OK")&&(line != "0"))
-    {
-        m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
-
-        return;
-    }
-
-    m_port.write("P 0 26\r\n"); // TODO: Hardcoded 26(will only work with LPC2148)
-    log_write("P 0 26\r\n"); // TODO: Hardcoded 26(will only work with LPC2148)
+// A C lost on the link could have finished on the chip, and flash can't be programmed twice
+// without an erase. Returns true if the block can be sent again, done is set if the chip holds
+// it already.
+bool QLpcProg::prepareRetry(const QByteArray &chunk, int offset, int firstSector, int lastSector, bool &done)
+{
+    int start = (offset == 0) ? 64 : offset; // Vectors are not readable in ISP.
+    QByteArray expected = chunk.mid(start - offset);
 
-    m_port.waitForBytesWritten(-1);
+    done = false;
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    QByteArray flash = readMemory(start, expected.length());
+    if (m_status != StatusNoError)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
-
-        QList<QByteArray> lines = recieved.split('\n');
+        return false;
+    }
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+    if (flash == expected)
+    {
+        done = true;
 
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
+        return true;
+    }
 
-            break;
-        }
+    if (flash.count((char)255) == flash.length())
+    {
+        return true;
     }
 
-    if ((line != "OK")&&(line != "0"))
+    // Erasing a sector the block shares would take the blocks programmed before it along.
+    if ((firstSector != lastSector)||(sectorAddress(firstSector) != offset)||(sectorSize(firstSector) != chunk.length()))
     {
         m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+        m_statusText = tr("Block at %1 is partly programmed, sector %2 has to be erased.").arg(offset).arg(firstSector);
 
-        return;
+        return false;
     }
 
-    m_port.write("C " + QByteArray::number(offset) + " 1073742336 1024\r\n");
-    log_write("C " + QByteArray::number(offset) + " 1073742336 1024\r\n");
+    chipErase(firstSector, lastSector);
+
+    return m_status == StatusNoError;
+}
 
-    m_port.waitForBytesWritten(-1);
+void QLpcProg::programBlock(const QByteArray &chunk, int offset, int firstSector, int lastSector, const QList<QByteArray> &encoded)
+{
+    int size = chunk.length();
+    QByteArray line;
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    writeRam(chunk, 1073742336, encoded);
+    if (m_status != StatusNoError)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        return;
+    }
 
-        QList<QByteArray> lines = recieved.split('\n');
+    bool prepared = prepareSectors(firstSector, lastSector);
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+    sendCommand("C " + QByteArray::number(offset) + " 1073742336 " + QByteArray::number(size) + "\r\n", 'C', size);
 
-            break;
+    // C protects the sectors again.
+    m_preparedStart = -1;
+    m_preparedEnd = -1;
+
+    if (prepared)
+    {
+        line = readReply();
+        if (m_status != StatusNoError)
+        {
+            return;
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
+
+        if ((line != "OK")&&(line != "0"))
         {
-            line = lines[0];
-            line.chop(1);
+            m_status = StatusError;
+            m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-            break;
+            return;
         }
     }
 
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return;
+    }
+
     if (line != "0")
     {
         m_status = StatusError;
@@ -902,7 +1074,7 @@ void QLpcProg::chipVerify(QByteArray chunk, int offset)
     if (chunk.length() > 1024)
     {
         m_status = StatusError;
-        m_statusText = tr("Programming buffer too big. Length is %1. It should be less or equal to 1024 bytes.").arg(QString(chunk.length()));
+        m_statusText = tr("Programming buffer too big. Length is %1. It should be less or equal to 1024 bytes.").arg(chunk.length());
 
         return;
     }
@@ -916,43 +1088,54 @@ void QLpcProg::chipVerify(QByteArray chunk, int offset)
         chunk.append(new_chunk);
     }
 
-    const QByteArray &chunk1 = chunk.left(512);
-    const QByteArray &chunk2 = chunk.right(512);
+    for(int retry = 0; ; retry++)
+    {
+        // A compare error is an answer, only a failed link is retried.
+        if ((verifyBlock(chunk, offset, orig_size))||(retry >= BLOCK_RETRIES)||(!recover()))
+        {
+            return;
+        }
+    }
+}
 
-    QList<QByteArray> encoded;
-    QByteArray recieved;
+// Returns false if the exchange failed, a compare error is reported with true.
+bool QLpcProg::verifyBlock(const QByteArray &chunk, int offset, int length)
+{
+    QList<QByteArray> lines;
     QByteArray line;
 
-    encoded = encodeUU(chunk1);
+    writeRam(chunk.left(512), 1073742336);
+    if (m_status != StatusNoError)
+    {
+        return false;
+    }
 
-    m_port.write("W 1073742336 512\r\n");
-    log_write("W 1073742336 512\r\n");
+    writeRam(chunk.right(512), 1073742848);
+    if (m_status != StatusNoError)
+    {
+        return false;
+    }
 
-    m_port.waitForBytesWritten(-1);
+    sendCommand(QString("M " + QByteArray::number(offset) + " 1073742336 " + QString::number(length) + "\r\n").toLatin1(), 'M', length);
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    line = readReply();
+    if (m_status != StatusNoError)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
-
-        QList<QByteArray> lines = recieved.split('\n');
+        return false;
+    }
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
+    if (line == "10")
+    {
+        // COMPARE_ERROR is followed by the offset of the first mismatch.
+        if (!readLines(lines, 1, timeoutFor('M')))
         {
-            line = lines[1];
-            line.chop(1);
-
-            break;
+            return false;
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
 
-            break;
-        }
+        m_status = StatusError;
+        m_statusText = tr("Compare error at offset %1.").arg(QString(lines.at(0)));
+
+        return true;
     }
 
     if (line != "0")
@@ -960,40 +1143,226 @@ void QLpcProg::chipVerify(QByteArray chunk, int offset)
         m_status = StatusError;
         m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-        return;
-    }
-
-    foreach(QByteArray line, encoded)
-    {
-        m_port.write(line.append("\r\n"));
-        log_write(line);
+        return false;
     }
 
-    m_port.waitForBytesWritten(-1);
+    return true;
+}
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
-    {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+QLpcProg::Status QLpcProg::getStatus()
+{
+    return m_status;
+}
+
+QString QLpcProg::getStatusText()
+{
+    return m_statusText;
+}
 
-        QList<QByteArray> lines = recieved.split('\n');
+int QLpcProg::averageLatency() const
+{
+    int ret = 0;
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+    if (m_latency.isEmpty())
+    {
+        return 0;
+    }
 
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
+    foreach(int latency, m_latency.values())
+    {
+        ret += latency;
+    }
+
+    return ret / m_latency.count();
+}
+
+// Number of times the session had to recover from a failed exchange.
+int QLpcProg::recoveries() const
+{
+    return m_recoveries;
+}
+
+QLpcTransport *QLpcProg::transport()
+{
+    return m_transport;
+}
+
+// Bytes already read from the transport but not consumed by the ISP parser.
+QByteArray QLpcProg::takeBuffered()
+{
+    QByteArray ret = m_rxBuffer;
+
+    m_rxBuffer.clear();
+
+    return ret;
+}
+
+quint32 QLpcProg::crc32(const QByteArray &data, quint32 crc)
+{
+    static quint32 table[256];
+    static bool tableReady = false;
+
+    if (!tableReady)
+    {
+        for(quint32 c = 0; c < 256; c++)
         {
-            line = lines[0];
-            line.chop(1);
+            quint32 value = c;
+
+            for(int bit = 0; bit < 8; bit++)
+            {
+                value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+            }
 
-            break;
+            table[c] = value;
         }
+
+        tableReady = true;
+    }
+
+    crc = ~crc;
+
+    for(int c = 0; c < data.length(); c++)
+    {
+        crc = table[(crc ^ (quint8)data.at(c)) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+// Size C copies for a chunk of the given length, 0 if it is too big.
+int QLpcProg::copySize(int length)
+{
+    int ret = 256;
+
+    if (length > 4096)
+    {
+        return 0;
+    }
+
+    while(ret < length)
+    {
+        ret = (ret == 1024) ? 4096 : ret * 2;
+    }
+
+    return ret;
+}
+
+int QLpcProg::sectorCount(int partID)
+{
+    switch(partID)
+    {
+    case LPC2141:
+        return 8;
+    case LPC2142:
+        return 9;
+    case LPC2144:
+        return 11;
+    case LPC2146:
+        return 15;
+    case LPC2148:
+        return 27;
+    default:
+        return 0;
+    }
+}
+
+// On-chip static RAM at 0x40000000, the USB DMA RAM of the LPC2146/48 is not counted.
+int QLpcProg::ramSize(int partID)
+{
+    switch(partID)
+    {
+    case LPC2141:
+        return 8192;
+    case LPC2142:
+        return 16384;
+    case LPC2144:
+    case LPC2146:
+    case LPC2148:
+        return 32768;
+    default:
+        return 0;
+    }
+}
+
+int QLpcProg::sectorFromAddress(int address)
+{
+    // LPC214x: 8 x 4KB, 14 x 32KB and 5 x 4KB sectors (UM10139 table 21.273).
+    if (address < 0)
+    {
+        return -1;
+    }
+
+    if (address < 0x8000)
+    {
+        return address / 0x1000;
+    }
+
+    if (address < 0x78000)
+    {
+        return 8 + ((address - 0x8000) / 0x8000);
+    }
+
+    if (address < 0x7D000)
+    {
+        return 22 + ((address - 0x78000) / 0x1000);
+    }
+
+    return -1;
+}
+
+int QLpcProg::sectorAddress(int sector)
+{
+    if (sector < 8)
+    {
+        return sector * 0x1000;
+    }
+
+    if (sector < 22)
+    {
+        return 0x8000 + ((sector - 8) * 0x8000);
+    }
+
+    return 0x78000 + ((sector - 22) * 0x1000);
+}
+
+int QLpcProg::sectorSize(int sector)
+{
+    if ((sector >= 8)&&(sector < 22))
+    {
+        return 0x8000;
+    }
+
+    return 0x1000;
+}
+
+void QLpcProg::writeRam(const QByteArray &data, quint32 address)
+{
+    writeRam(data, address, QList<QByteArray>());
+}
+
+void QLpcProg::writeRam(const QByteArray &data, quint32 address, const QList<QByteArray> &encoded)
+{
+    PORT_OPEN_CHECK();
+
+    QByteArray send;
+    QByteArray line;
+
+    if ((!encoded.isEmpty())&&(encoded.count() != (data.length() + UU_GROUP_SIZE - 1) / UU_GROUP_SIZE))
+    {
+        m_status = StatusError;
+        m_statusText = tr("Encoded data does not match the block(%1 groups for %2 bytes).").arg(encoded.count()).arg(data.length());
+
+        return;
+    }
+
+    send = "W " + QByteArray::number(address) + " " + QByteArray::number(data.length()) + "\r\n";
+
+    sendCommand(send, 'W');
+
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return;
     }
 
     if (line != "0")
@@ -1004,37 +1373,100 @@ void QLpcProg::chipVerify(QByteArray chunk, int offset)
         return;
     }
 
-    m_port.write(QByteArray::number(encodeUUCheckSum(chunk1)).append("\r\n"));
-    log_write(QByteArray::number(encodeUUCheckSum(chunk1)).append("\r\n"));
-
-    m_port.waitForBytesWritten(-1);
+    // The bootloader expects a checksum after every 20 UU lines(900 bytes). Each group with its
+    // checksum goes to the port as one buffer.
+    int depth = (m_pipelineDepth > 0) ? m_pipelineDepth : m_transport->pipelineDepth();
+    int sent = 0;
+    int acked = 0;
+    int resends = 0;
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    while(acked < data.length())
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        if ((sent < data.length())&&(m_pending.count() < depth))
+        {
+            const QByteArray &group = data.mid(sent, UU_GROUP_SIZE);
+            const QByteArray &block = encoded.isEmpty() ? encodeUUBlock(group) : encoded.at(sent / UU_GROUP_SIZE);
+
+            sendCommand(block, 'W', group.length(), 0, ((group.length() + 44) / 45) + 1); // Data lines are echoed back too.
+            sent += group.length();
 
-        QList<QByteArray> lines = recieved.split('\n');
+            continue;
+        }
+
+        line = readReply();
+        if (m_status != StatusNoError)
+        {
+            return;
+        }
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
+        if (line == "RESEND")
         {
-            line = lines[1];
-            line.chop(1);
+            // The bootloader takes the next group it gets as the resent one, so only a group with
+            // nothing sent after it can be sent again.
+            if ((sent > acked + UU_GROUP_SIZE)||(resends >= RESEND_RETRIES))
+            {
+                m_status = StatusError;
+                m_statusText = tr("Checksum error at RAM offset %1.").arg(acked);
+
+                return;
+            }
+
+            log_write("RESEND - " + QByteArray::number(acked));
 
-            break;
+            resends++;
+            sent = acked;
+
+            continue;
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
+
+        if ((line != "OK")&&(line != "0"))
         {
-            line = lines[0];
-            line.chop(1);
+            m_status = StatusError;
+            m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-            break;
+            return;
         }
+
+        acked = qMin(acked + UU_GROUP_SIZE, data.length());
     }
+}
 
-    if ((line != "OK")&&(line != "0"))
+// Sends P unless the sectors are still prepared. The reply is left pending, returns true if P was sent.
+bool QLpcProg::prepareSectors(int startSector, int endSector)
+{
+    if ((m_preparedStart >= 0)&&(startSector >= m_preparedStart)&&(endSector <= m_preparedEnd))
+    {
+        return false;
+    }
+
+    sendCommand("P " + QByteArray::number(startSector) + " " + QByteArray::number(endSector) + "\r\n", 'P');
+
+    m_preparedStart = startSector;
+    m_preparedEnd = endSector;
+
+    return true;
+}
+
+// One I for the whole range. Only ranges with a non blank sector get split further.
+void QLpcProg::blankCheckRange(QList<bool> &blank, int firstSector, int startSector, int endSector)
+{
+    QList<QByteArray> lines;
+    QByteArray line;
+
+    sendCommand("I " + QByteArray::number(startSector) + " " + QByteArray::number(endSector) + "\r\n", 'I', 0, endSector - startSector + 1);
+
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return;
+    }
+
+    if (line == "0")
+    {
+        return;
+    }
+
+    if (line != "8")
     {
         m_status = StatusError;
         m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
@@ -1042,77 +1474,185 @@ void QLpcProg::chipVerify(QByteArray chunk, int offset)
         return;
     }
 
-    encoded = encodeUU(chunk2);
+    // SECTOR_NOT_BLANK is followed by the offset and the content of the first non blank word.
+    if (!readLines(lines, 2, timeoutFor('I')))
+    {
+        return;
+    }
+
+    if (startSector == endSector)
+    {
+        blank[startSector - firstSector] = false;
 
-    m_port.write("W 1073742848 512\r\n");
-    log_write("W 1073742848 512\r\n");
+        return;
+    }
 
-    m_port.waitForBytesWritten(-1);
+    int middle = (startSector + endSector) / 2;
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    blankCheckRange(blank, firstSector, startSector, middle);
+    if (m_status != StatusNoError)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        return;
+    }
 
-        QList<QByteArray> lines = recieved.split('\n');
+    blankCheckRange(blank, firstSector, middle + 1, endSector);
+}
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
+// I always fails on sector 0, the bootloader maps its vectors over the first 64 bytes(UM10139 chapter 21.8.10).
+// Read the rest of the sector instead, a programmed sector usually fails on the first block.
+bool QLpcProg::firstSectorBlankCheck()
+{
+    for(int pos = 64; pos < sectorSize(0); pos = (pos + 1024) & ~1023)
+    {
+        int size = ((pos + 1024) & ~1023) - pos;
+
+        QByteArray data = readMemory(pos, size);
+        if (m_status != StatusNoError)
         {
-            line = lines[1];
-            line.chop(1);
+            return false;
+        }
 
-            break;
+        if (data.count((char)0xFF) != data.length())
+        {
+            return false;
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
+    }
+
+    return true;
+}
+
+// A bootloader left synchronized by an earlier session answers J right away. Without reset
+// it is probed before syncing, with reset only when syncing failed. Echo state is taken from
+// the reply.
+bool QLpcProg::probeSynchronized()
+{
+    QElapsedTimer timer;
+
+    m_transport->readAll();
+    m_rxBuffer.clear();
+    m_timedOut = false;
+
+    m_transport->write("J\r\n");
+    log_write("SEND - J");
+
+    timer.start();
+
+    while(timer.elapsed() < PROBE_TIMEOUT)
+    {
+        m_transport->waitForReadyRead(PROBE_TIMEOUT - (int)timer.elapsed());
+        m_rxBuffer.append(m_transport->readAll());
+
+        QList<QByteArray> lines = m_rxBuffer.split('\n');
+        bool echo = false;
+
+        lines.removeLast(); // Not terminated yet.
+
+        if ((!lines.isEmpty())&&(lines.first().trimmed() == "J"))
         {
-            line = lines[0];
-            line.chop(1);
+            lines.removeFirst();
+            echo = true;
+        }
 
-            break;
+        if ((lines.count() >= 2)&&(lines.at(0).trimmed() == "0"))
+        {
+            m_EchoOn = echo;
+            m_rxBuffer.clear();
+
+            return true;
         }
     }
 
-    if (line != "0")
+    m_rxBuffer.clear();
+
+    return false;
+}
+
+// Called after a failed exchange. Whatever is left of it on the line is dropped. If the
+// bootloader answers a probe it is back at the command prompt and the session goes on,
+// otherwise the target is reset into ISP.
+bool QLpcProg::recover()
+{
+    QString error = m_statusText;
+
+    m_recoveries++;
+    log_write("RECOVER - " + error.toLatin1());
+
+    m_pending.clear();
+    m_replies.clear();
+    m_preparedStart = -1;
+    m_preparedEnd = -1;
+
+    while(m_transport->waitForReadyRead(DRAIN_TIME))
     {
-        m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+        m_transport->readAll();
+    }
 
-        return;
+    if (!probeSynchronized())
+    {
+        resync();
+        if (m_status != StatusNoError)
+        {
+            m_statusText = tr("%1 Recovery failed(%2).").arg(error, m_statusText);
+
+            return false;
+        }
     }
 
-    foreach(QByteArray line, encoded)
+    m_status = StatusNoError;
+    m_statusText.clear();
+
+    return true;
+}
+
+void QLpcProg::setResetPin(bool active)
+{
+    m_transport->setDataTerminalReady(active != m_syncOptions.m_ResetInverted);
+}
+
+void QLpcProg::setIspPin(bool active)
+{
+    m_transport->setRequestToSend(active != m_syncOptions.m_IspInverted);
+}
+
+void QLpcProg::delay(int msecs)
+{
+    if (msecs <= 0)
     {
-        m_port.write(line.append("\r\n"));
-        log_write(line);
+        return;
     }
 
-    m_port.waitForBytesWritten(-1);
+#ifdef Q_OS_WIN
+    Sleep(msecs);
+#else
+    usleep(msecs * 1000);
+#endif
+}
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+QByteArray QLpcProg::readMemory(quint32 address, int length)
+{
+    PORT_OPEN_CHECK(QByteArray());
+
+    QByteArray send;
+    QByteArray line;
+    QByteArray ret;
+    int retries = 0;
+
+    if ((address % 4)||(length <= 0)||(length % 4))
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        m_status = StatusError;
+        m_statusText = tr("Invalid function parametar.");
 
-        QList<QByteArray> lines = recieved.split('\n');
+        return QByteArray();
+    }
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
-        {
-            line = lines[1];
-            line.chop(1);
+    send = "R " + QByteArray::number(address) + " " + QByteArray::number(length) + "\r\n";
 
-            break;
-        }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
+    sendCommand(send, 'R');
 
-            break;
-        }
+    line = readReply();
+    if (m_status != StatusNoError)
+    {
+        return QByteArray();
     }
 
     if (line != "0")
@@ -1120,150 +1660,512 @@ void QLpcProg::chipVerify(QByteArray chunk, int offset)
         m_status = StatusError;
         m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
 
-        return;
+        return QByteArray();
     }
 
-    m_port.write(QByteArray::number(encodeUUCheckSum(chunk2)).append("\r\n"));
-    log_write(QByteArray::number(encodeUUCheckSum(chunk2)).append("\r\n"));
+    ret.reserve(length);
 
-    m_port.waitForBytesWritten(-1);
-
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+    // Data comes in groups of 20 UU lines, each followed by its checksum. The host answers OK or RESEND.
+    while(ret.length() < length)
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        QList<QByteArray> lines;
+        QByteArray group;
+        int group_length = qMin(UU_GROUP_SIZE, length - ret.length());
+        int count = ((group_length + 44) / 45) + 1;
+        bool ok;
+
+        if (!readLines(lines, count, timeoutFor('R', group_length)))
+        {
+            return QByteArray();
+        }
 
-        QList<QByteArray> lines = recieved.split('\n');
+        for(int c = 0; c < count - 1; c++)
+        {
+            group.append(decodeUULine(lines.at(c)));
+        }
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
+        int checksum = lines.last().toInt(&ok);
+
+        if ((ok)&&(group.length() == group_length)&&(checksum == encodeUUCheckSum(group)))
+        {
+            m_transport->write("OK\r\n");
+            ret.append(group);
+            retries = 0;
+        }
+        else
         {
-            line = lines[1];
-            line.chop(1);
+            if (++retries > READ_RETRIES)
+            {
+                m_status = StatusError;
+                m_statusText = tr("Read checksum error at address %1.").arg(address + ret.length());
 
-            break;
+                return QByteArray();
+            }
+
+            m_transport->write("RESEND\r\n");
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
+
+        if (m_EchoOn)
         {
-            line = lines[0];
-            line.chop(1);
+            lines.clear();
 
-            break;
+            if (!readLines(lines, 1, timeoutFor('R')))
+            {
+                return QByteArray();
+            }
         }
     }
 
-    if ((line != "OK")&&(line != "0"))
+    m_status = StatusNoError;
+    m_statusText.clear();
+
+    return ret;
+}
+
+// CRC32 of the flash contents, streamed with R. Offset and length don't need to be word aligned.
+quint32 QLpcProg::readCrc32(int offset, int length)
+{
+    quint32 ret = 0;
+    int start = offset & ~3;
+    int skip = offset - start;
+
+    for(int pos = start; pos < offset + length; pos += READ_CHUNK_SIZE)
+    {
+        int size = qMin(READ_CHUNK_SIZE, offset + length - pos);
+
+        QByteArray data = readMemory(pos, (size + 3) & ~3);
+        if (m_status != StatusNoError)
+        {
+            return 0;
+        }
+
+        ret = crc32(data.mid(skip, size - skip), ret);
+        skip = 0;
+    }
+
+    return ret;
+}
+
+// "LPCF", image length, SHA-1 of the image and CRC32 of the above, integers are little endian.
+QByteArray QLpcProg::imageFingerprint(const QByteArray &image)
+{
+    QByteArray ret = "LPCF";
+    quint32 length = image.length();
+    quint32 crc;
+
+    ret.append((const char *)&length, 4);
+    ret.append(QCryptographicHash::hash(image, QCryptographicHash::Sha1));
+
+    crc = crc32(ret);
+    ret.append((const char *)&crc, 4);
+
+    return ret;
+}
+
+// Last page of the last sector of the part.
+int QLpcProg::defaultFingerprintAddress()
+{
+    int sectors = sectorCount(readPartID());
+
+    if (m_status != StatusNoError)
+    {
+        return -1;
+    }
+
+    if (sectors == 0)
     {
         m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+        m_statusText = tr("Unsupported part.");
+
+        return -1;
+    }
 
+    return sectorAddress(sectors - 1) + sectorSize(sectors - 1) - FINGERPRINT_PAGE;
+}
+
+// One R of 32 bytes, true if the fingerprint of the image is stored at address.
+bool QLpcProg::checkFingerprint(const QByteArray &image, int address)
+{
+    PORT_OPEN_CHECK(false);
+
+    QByteArray stored = readMemory(address, FINGERPRINT_SIZE);
+    if (m_status != StatusNoError)
+    {
+        return false;
+    }
+
+    return stored == imageFingerprint(image);
+}
+
+// Erases the sector of a fingerprint that isn't the one of image, so a run stopped before
+// writeFingerprint() can't leave the fingerprint of the previous image behind. A page in a
+// sector the image uses goes with the erase of the image.
+void QLpcProg::clearFingerprint(const QByteArray &image, int address)
+{
+    PORT_OPEN_CHECK();
+
+    int sector = sectorFromAddress(address);
+
+    if ((sector < 0)||(sector <= sectorFromAddress(image.length() - 1)))
+    {
         return;
     }
 
-    m_port.write(QString("M " + QByteArray::number(offset) + " 1073742336 " + QString::number(orig_size) + "\r\n").toLatin1());
-    log_write(QString("M " + QByteArray::number(offset) + " 1073742336 " + QString::number(orig_size) + "\r\n").toLatin1());
+    QByteArray stored = readMemory(address, FINGERPRINT_SIZE);
+    if ((m_status != StatusNoError)||(stored.count((char)255) == FINGERPRINT_SIZE)||(stored == imageFingerprint(image)))
+    {
+        return;
+    }
 
-    m_port.waitForBytesWritten(-1);
+    chipErase(sector, sector);
+}
 
-    recieved.clear();
-    line.clear();
-    for(int c = 0; c < 1000; c++)
+// Programs the fingerprint page after the image. The page has to be past the programmed
+// blocks, its sector is erased if the page isn't blank and the image doesn't use the sector.
+void QLpcProg::writeFingerprint(const QByteArray &image, int address)
+{
+    PORT_OPEN_CHECK();
+
+    int last_block = ((image.length() - 1) / 4096) * 4096;
+    int image_end = last_block + copySize(image.length() - last_block);
+    int sector = sectorFromAddress(address);
+
+    if ((address % FINGERPRINT_PAGE)||(sector < 0)||(sectorFromAddress(address + FINGERPRINT_PAGE - 1) != sector))
     {
-        m_port.waitForReadyRead(1);
-        recieved.append(m_port.readAll());
+        m_status = StatusError;
+        m_statusText = tr("Invalid function parametar.");
 
-        QList<QByteArray> lines = recieved.split('\n');
+        return;
+    }
+
+    if (address < image_end)
+    {
+        m_status = StatusError;
+        m_statusText = tr("Fingerprint location overlaps the image.");
+
+        return;
+    }
+
+    QByteArray page = readMemory(address, FINGERPRINT_PAGE);
+    if (m_status != StatusNoError)
+    {
+        return;
+    }
 
-        if ((lines.count() >= 3)&&(m_EchoOn == true))
+    if (page.count((char)255) != FINGERPRINT_PAGE)
+    {
+        if (sector <= sectorFromAddress(image_end - 1))
         {
-            line = lines[1];
-            line.chop(1);
+            m_status = StatusError;
+            m_statusText = tr("Fingerprint location is not blank.");
 
-            break;
+            return;
         }
-        if ((lines.count() >= 2)&&(m_EchoOn == false))
-        {
-            line = lines[0];
-            line.chop(1);
 
-            break;
+        chipErase(sector, sector);
+        if (m_status != StatusNoError)
+        {
+            return;
         }
     }
 
-    if (line != "0")
-    {
-        m_status = StatusError;
-        m_statusText = tr("Wrong data recieved(%1).").arg(QString(line));
+    page = imageFingerprint(image);
+    page.append(QByteArray(FINGERPRINT_PAGE - page.length(), (char)255));
+
+    chipProgram(page, address);
+}
 
+// Replies of a failed or timed out operation can still be on the way, a late one would be taken
+// as the answer to the next command.
+void QLpcProg::dropStale(char command)
+{
+    if ((!m_timedOut)&&((m_status == StatusNoError)||((m_pending.isEmpty())&&(m_replies.isEmpty()))))
+    {
         return;
     }
 
-    return;
+    m_pending.clear();
+    m_replies.clear();
+
+    m_transport->waitForReadyRead(timeoutFor(command));
+
+    do
+    {
+        m_transport->readAll();
+    }
+    while(m_transport->waitForReadyRead(DRAIN_TIME));
+
+    m_rxBuffer.clear();
+    m_timedOut = false;
 }
 
-QLpcProg::Status QLpcProg::getStatus()
+bool QLpcProg::sendCommand(const QByteArray &send, char command, int bytes, int sectors, int echoLines)
 {
-    return m_status;
+    dropStale(command);
+
+    int depth = (m_pipelineDepth > 0) ? m_pipelineDepth : m_transport->pipelineDepth();
+
+    while(m_pending.count() >= depth)
+    {
+        QByteArray line = readPending();
+
+        if (m_status != StatusNoError)
+        {
+            return false;
+        }
+
+        if ((line != "0")&&(line != "OK"))
+        {
+            // Commands after a failed one would be misinterpreted, don't send them.
+            return false;
+        }
+    }
+
+    PendingCommand pending;
+
+    pending.m_Command = command;
+    pending.m_Bytes = bytes;
+    pending.m_Sectors = sectors;
+    pending.m_EchoLines = echoLines;
+    pending.m_Alone = m_pending.isEmpty();
+    pending.m_Timer.start();
+
+    m_transport->write(send);
+    log_write(send);
+
+    m_pending.append(pending);
+
+    return true;
 }
 
-QString QLpcProg::getStatusText()
+QByteArray QLpcProg::readPending()
 {
-    return m_statusText;
+    PendingCommand pending = m_pending.takeFirst();
+    QList<QByteArray> lines;
+    int timeout = timeoutFor(pending.m_Command, pending.m_Bytes, pending.m_Sectors);
+
+    if (!readLines(lines, m_EchoOn ? pending.m_EchoLines + 1 : 1, timeout))
+    {
+        return QByteArray();
+    }
+
+    if (pending.m_Alone)
+    {
+        recordLatency(pending.m_Command, pending.m_Timer.elapsed() - expectedTime(pending.m_Command, pending.m_Bytes, pending.m_Sectors));
+    }
+
+    m_replies.append(lines.last());
+
+    return lines.last();
 }
 
-QList<QByteArray> QLpcProg::encodeUU(const QByteArray &data)
+QByteArray QLpcProg::readReply()
 {
-    QList<QByteArray> ret;
-    int chunks;
+    if (m_replies.isEmpty())
+    {
+        if (m_pending.isEmpty())
+        {
+            if (m_status == StatusNoError)
+            {
+                m_status = StatusError;
+                m_statusText = tr("No command pending.");
+            }
 
-    const int CHUNK_SIZE = 45;
+            return QByteArray();
+        }
 
+        readPending();
+        if (m_status != StatusNoError)
+        {
+            return QByteArray();
+        }
+    }
 
-    chunks = data.length() / CHUNK_SIZE;
-    if (data.length() % CHUNK_SIZE) chunks++;
+    m_status = StatusNoError;
+    m_statusText.clear();
 
-    for(int c = 0; c < chunks; c++)
-    {
-        QByteArray chunk = data.mid(c * CHUNK_SIZE, CHUNK_SIZE);
-        QByteArray line;
+    return m_replies.takeFirst();
+}
+
+bool QLpcProg::readLines(QList<QByteArray> &lines, int count, int timeout)
+{
+    QElapsedTimer timer;
+
+    timer.start();
 
-        line.append((char)(32 + chunk.length()));
+    while(lines.count() < count)
+    {
+        int pos = m_rxBuffer.indexOf('\n');
 
-        while(chunk.length() % 3 != 0)
+        if (pos >= 0)
         {
-            if (chunk.length() == CHUNK_SIZE)
-            {
-                chunk.append('\0');
-            }
-            else
+            QByteArray line = m_rxBuffer.left(pos);
+
+            if (line.endsWith('\r'))
             {
-                chunk.append(255);
+                line.chop(1); // chop \r
             }
+
+            lines.append(line);
+            m_rxBuffer.remove(0, pos + 1);
+
+            continue;
         }
 
-        for(int group = 0; group < chunk.length() / 3; group++)
+        qint64 remaining = timeout - timer.elapsed();
+
+        if (remaining <= 0)
         {
+            m_status = StatusTimeOut;
+            m_statusText = tr("Data Timeout.");
+            m_timedOut = true;
+
+            log_write("RECIEVE - " + m_rxBuffer);
+
+            return false;
+        }
+
+        m_transport->waitForReadyRead((int)remaining);
+        m_rxBuffer.append(m_transport->readAll());
+    }
+
+    foreach(QByteArray line, lines)
+    {
+        log_write("RECIEVE - " + line);
+    }
+
+    return true;
+}
+
+int QLpcProg::expectedTime(char command, int bytes, int sectors)
+{
+    return commandTime(command, bytes, sectors, m_baudRate);
+}
+
+int QLpcProg::timeoutFor(char command, int bytes, int sectors)
+{
+    return commandTimeout(command, bytes, sectors, m_baudRate, m_latency);
+}
+
+void QLpcProg::recordLatency(char command, qint64 latency)
+{
+    recordLatency(m_latency, command, latency);
+}
+
+// RAM the W, C and M commands work through, past the bootloader's own area.
+quint32 QLpcProg::ramBuffer()
+{
+    return RAM_BUFFER;
+}
+
+// Time the command takes on the wire and in the device, without any latency.
+int QLpcProg::commandTime(char command, int bytes, int sectors, int baudRate)
+{
+    qint64 chars = 16; // Command line and the return code.
+    qint64 device = 0;
+
+    switch(command)
+    {
+    case 'W':
+    case 'R':
+        // UU encoded data: 4 chars per 3 bytes, length char and CR LF per 45 bytes line, checksum line.
+        chars += ((bytes + 2) / 3) * 4 + ((bytes + 44) / 45) * 3 + 12;
+        break;
+    case 'C':
+        device = ((bytes + 255) / 256) * FLASH_PROGRAM_TIME;
+        break;
+    case 'E':
+        device = sectors * SECTOR_ERASE_TIME;
+        break;
+    case 'I':
+        device = sectors * SECTOR_BLANK_CHECK_TIME;
+        break;
+    default:
+        break;
+    }
+
+    // Start bit, 8 data bits and 2 stop bits per char.
+    return (int)(device + ((chars * 11 * 1000) / baudRate) + 1);
+}
+
+// Latency is what recordLatency() learned of the link so far, per command.
+int QLpcProg::commandTimeout(char command, int bytes, int sectors, int baudRate, const QMap<char, int> &latency)
+{
+    return (commandTime(command, bytes, sectors, baudRate) * 2) + (latency.value(command, INITIAL_LATENCY) * 4) + MIN_TIMEOUT;
+}
+
+void QLpcProg::recordLatency(QMap<char, int> &latency, char command, qint64 value)
+{
+    if (value < 0)
+    {
+        value = 0;
+    }
+
+    if (latency.contains(command))
+    {
+        latency[command] = (int)((latency.value(command) * 3 + value) / 4);
+    }
+    else
+    {
+        latency[command] = (int)value;
+    }
+}
+
+QByteArray QLpcProg::encodeUUBlock(const QByteArray &data)
+{
+    QByteArray ret;
+
+    const int CHUNK_SIZE = 45;
+
+    ret.reserve(((data.length() + 2) / 3) * 4 + ((data.length() + CHUNK_SIZE - 1) / CHUNK_SIZE) * 3 + 12);
+
+    for(int pos = 0; pos < data.length(); pos += CHUNK_SIZE)
+    {
+        int length = qMin(CHUNK_SIZE, data.length() - pos);
+
+        ret.append((char)(32 + length));
+
+        for(int group = 0; group < length; group += 3)
+        {
+            unsigned char b0 = data.at(pos + group);
+            unsigned char b1 = (group + 1 < length) ? data.at(pos + group + 1) : 255;
+            unsigned char b2 = (group + 2 < length) ? data.at(pos + group + 2) : 255;
             char tmp;
 
-            tmp = (chunk.at((group * 3) + 0) >> 2) & 0x3F;
+            tmp = (b0 >> 2) & 0x3F;
             if (tmp == 0x00) tmp = 0x60; else tmp += 0x20;
-            line.append(tmp);
+            ret.append(tmp);
 
-            tmp = ((chunk.at((group * 3) + 0) << 4) & 0x30)|((chunk.at((group * 3) + 1) >> 4) & 0x0F);
+            tmp = ((b0 << 4) & 0x30)|((b1 >> 4) & 0x0F);
             if (tmp == 0x00) tmp = 0x60; else tmp += 0x20;
-            line.append(tmp);
+            ret.append(tmp);
 
-            tmp = ((chunk.at((group * 3) + 1) << 2) & 0x3C)|((chunk.at((group * 3) + 2) >> 6) & 0x03);
+            tmp = ((b1 << 2) & 0x3C)|((b2 >> 6) & 0x03);
             if (tmp == 0x00) tmp = 0x60; else tmp += 0x20;
-            line.append(tmp);
+            ret.append(tmp);
 
-            tmp = chunk.at((group * 3) + 2) & 0x3F;
+            tmp = b2 & 0x3F;
             if (tmp == 0x00) tmp = 0x60; else tmp += 0x20;
-            line.append(tmp);
+            ret.append(tmp);
         }
 
-        ret.append(line);
+        ret.append("\r\n");
+    }
+
+    ret.append(QByteArray::number(encodeUUCheckSum(data)));
+    ret.append("\r\n");
+
+    return ret;
+}
+
+// The groups writeRam() sends, one per checksum.
+QList<QByteArray> QLpcProg::encodeUUGroups(const QByteArray &data)
+{
+    QList<QByteArray> ret;
+
+    for(int pos = 0; pos < data.length(); pos += UU_GROUP_SIZE)
+    {
+        ret.append(encodeUUBlock(data.mid(pos, UU_GROUP_SIZE)));
     }
 
     return ret;
@@ -1281,6 +2183,32 @@ int QLpcProg::encodeUUCheckSum(const QByteArray &data)
     return ret;
 }
 
+QByteArray QLpcProg::decodeUULine(const QByteArray &line)
+{
+    QByteArray ret;
+
+    if (line.isEmpty())
+    {
+        return ret;
+    }
+
+    int length = (line.at(0) - 32) & 0x3F;
+
+    for(int pos = 1; pos + 3 < line.length(); pos += 4)
+    {
+        unsigned char c0 = (line.at(pos) - 32) & 0x3F;
+        unsigned char c1 = (line.at(pos + 1) - 32) & 0x3F;
+        unsigned char c2 = (line.at(pos + 2) - 32) & 0x3F;
+        unsigned char c3 = (line.at(pos + 3) - 32) & 0x3F;
+
+        ret.append((char)((c0 << 2)|(c1 >> 4)));
+        ret.append((char)((c1 << 4)|(c2 >> 2)));
+        ret.append((char)((c2 << 6)|c3));
+    }
+
+    return ret.left(length);
+}
+
 void QLpcProg::log_write(const QByteArray &data)
 {
 #ifdef QT_NO_DEBUG
@@ -1,9 +1,12 @@
 #ifndef QLPCPROG_H
 #define QLPCPROG_H
 
-#include <qserialport.h>
+#include <QElapsedTimer>
 #include <QStringList>
 #include <QObject>
+#include <QMap>
+
+class QLpcTransport;
 
 class QLpcProg : public QObject
 {
@@ -12,27 +15,83 @@ public:
     enum PartID {LPC2141 = 196353, LPC2142 = 196369, LPC2144 = 196370, LPC2146 = 196387, LPC2148 = 196389};
     enum Status {StatusNoError, StatusTimeOut, StatusError};
 
+    // RESET is driven by DTR and the ISP entry pin(P0.14) by RTS, both active when set unless inverted.
+    struct SyncOptions {
+        SyncOptions() : m_Reset(true), m_ResetInverted(false), m_IspInverted(false), m_ResetTime(10), m_BootTime(10), m_RetryInterval(100), m_SyncTimeout(3000), m_DetectSynced(true) {}
+
+        bool m_Reset;
+        bool m_ResetInverted;
+        bool m_IspInverted;
+        int m_ResetTime;
+        int m_BootTime;
+        int m_RetryInterval;
+        int m_SyncTimeout;
+        bool m_DetectSynced;
+    };
+
     explicit QLpcProg(QObject *parent = 0);
     virtual ~QLpcProg();
-    void init(const QString &port = "");
+    void init(const QString &port = "", bool lowLatency = false);
     void deinit();
+    void resync();
+    void setSyncOptions(const SyncOptions &options);
+    SyncOptions syncOptions() const;
+    int syncTime() const;
+    bool resetSkipped() const;
+    QString port() const;
     void setCrystalValue(int value);
+    int crystalValue() const;
     void setBaudRate(int baudRate);
+    int baudRate() const;
     void setEcho(bool echo = true);
+    void setPipelineDepth(int depth);
     int readPartID();
     QString readBootCodeVersion();
+    QString readSerialNumber();
     void unlock();
+    void go(quint32 address, bool thumb = false);
+    void writeRam(const QByteArray &data, quint32 address);
+    QByteArray readMemory(quint32 address, int length);
+    quint32 readCrc32(int offset, int length);
+    int defaultFingerprintAddress();
+    bool checkFingerprint(const QByteArray &image, int address);
+    void clearFingerprint(const QByteArray &image, int address);
+    void writeFingerprint(const QByteArray &image, int address);
 
     void chipErase();
+    void chipErase(int startSector, int endSector);
+    int chipEraseNonBlank();
+    int chipEraseNonBlank(int startSector, int endSector);
     bool chipBlankCheck();
-    void patchFirmware(QByteArray &data);
-    void chipProgram(QByteArray chunk, int offset);
+    QList<bool> chipBlankCheck(int startSector, int endSector);
+    static void patchFirmware(QByteArray &data);
+    static void injectData(QByteArray &image, int address, const QByteArray &data);
+    void chipProgram(QByteArray chunk, int offset, const QList<QByteArray> &encoded = QList<QByteArray>());
     void chipVerify(QByteArray chunk, int offset);
 
     Status getStatus();
     QString getStatusText();
+    int averageLatency() const;
+    int recoveries() const;
 
+    QLpcTransport *transport();
+    QByteArray takeBuffered();
 
+    static quint32 crc32(const QByteArray &data, quint32 crc = 0);
+    static QByteArray imageFingerprint(const QByteArray &image);
+    static QByteArray encodeUUBlock(const QByteArray &data);
+    static QList<QByteArray> encodeUUGroups(const QByteArray &data);
+    static int encodeUUCheckSum(const QByteArray &data);
+    static int copySize(int length);
+    static int sectorCount(int partID);
+    static int ramSize(int partID);
+    static int sectorFromAddress(int address);
+    static int sectorAddress(int sector);
+    static int sectorSize(int sector);
+    static quint32 ramBuffer();
+    static int commandTime(char command, int bytes, int sectors, int baudRate);
+    static int commandTimeout(char command, int bytes, int sectors, int baudRate, const QMap<char, int> &latency);
+    static void recordLatency(QMap<char, int> &latency, char command, qint64 value);
 
     static QStringList detectSerialPorts();
     
@@ -41,15 +100,59 @@ signals:
 public slots:
 
 private:
+    struct PendingCommand {
+        char m_Command;
+        int m_Bytes;
+        int m_Sectors;
+        int m_EchoLines;
+        bool m_Alone;
+        QElapsedTimer m_Timer;
+    };
+
     void sendRecieve(const QByteArray &send, int lines, const QByteArray shouldRecieve);
-    QList<QByteArray> encodeUU(const QByteArray &data);
-    int encodeUUCheckSum(const QByteArray &data);
+    bool probeSynchronized();
+    bool recover();
+    void programBlock(const QByteArray &chunk, int offset, int firstSector, int lastSector, const QList<QByteArray> &encoded);
+    bool prepareRetry(const QByteArray &chunk, int offset, int firstSector, int lastSector, bool &done);
+    bool verifyBlock(const QByteArray &chunk, int offset, int length);
+    void setResetPin(bool active);
+    void setIspPin(bool active);
+    void delay(int msecs);
+    void writeRam(const QByteArray &data, quint32 address, const QList<QByteArray> &encoded);
+    bool prepareSectors(int startSector, int endSector);
+    void blankCheckRange(QList<bool> &blank, int firstSector, int startSector, int endSector);
+    bool firstSectorBlankCheck();
+    bool readLines(QList<QByteArray> &lines, int count, int timeout);
+    void dropStale(char command);
+    bool sendCommand(const QByteArray &send, char command, int bytes = 0, int sectors = 0, int echoLines = 1);
+    QByteArray readPending();
+    QByteArray readReply();
+    int expectedTime(char command, int bytes = 0, int sectors = 0);
+    int timeoutFor(char command, int bytes = 0, int sectors = 0);
+    void recordLatency(char command, qint64 latency);
+    QByteArray decodeUULine(const QByteArray &line);
     void log_write(const QByteArray &data);
 
-    QSerialPort m_port;
+    QLpcTransport *m_transport;
+    QString m_port;
+    bool m_lowLatency;
+    int m_crystalValue;
+    int m_preparedStart;
+    int m_preparedEnd;
+    SyncOptions m_syncOptions;
+    int m_syncTime;
+    bool m_resetSkipped;
+    int m_recoveries;
+    bool m_timedOut;
+    QList<PendingCommand> m_pending;
+    QList<QByteArray> m_replies;
+    QByteArray m_rxBuffer;
     Status m_status;
     QString m_statusText;
     bool m_EchoOn;
+    int m_baudRate;
+    QMap<char, int> m_latency;
+    int m_pipelineDepth;
 
     
 };
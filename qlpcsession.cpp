@@ -0,0 +1,599 @@
+#include "qlpcsession.h"
+#include "qlpctransport.h"
+
+#define UU_GROUP_SIZE 900 // 20 lines of 45 bytes
+#define RESEND_RETRIES 3
+
+
+QLpcSession::QLpcSession(QObject *parent) :
+    QObject(parent),
+    m_transport(0),
+    m_state(StateClosed),
+    m_nextId(1),
+    m_baudRate(9600)
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(timeout()));
+}
+
+QLpcSession::~QLpcSession()
+{
+    close();
+}
+
+bool QLpcSession::open(const QString &port)
+{
+    close();
+
+    m_transport = QLpcTransport::create(port, this);
+
+    if (m_transport->open(port) == false)
+    {
+        delete m_transport;
+        m_transport = 0;
+
+        return false;
+    }
+
+    connect(m_transport->device(), SIGNAL(readyRead()), this, SLOT(readyRead()));
+
+    m_port = port;
+    m_baudRate = 9600;
+    m_latency.clear();
+    m_rxBuffer.clear();
+    m_state = StateIdle;
+
+    return true;
+}
+
+void QLpcSession::close()
+{
+    QList<Operation> canceled = m_queue;
+
+    m_timer.stop();
+    m_queue.clear();
+    m_state = StateClosed;
+
+    // Sessions are closed from finished(), which can come from the device's own readyRead(),
+    // so the transport is deleted from the event loop.
+    if (m_transport)
+    {
+        disconnect(m_transport->device(), 0, this, 0);
+
+        m_transport->close();
+        m_transport->deleteLater();
+        m_transport = 0;
+    }
+
+    foreach(Operation operation, canceled)
+    {
+        emit finished(operation.m_Id, QLpcProg::StatusError, tr("Session closed."), QVariant());
+    }
+}
+
+void QLpcSession::setSyncOptions(const QLpcProg::SyncOptions &options)
+{
+    m_syncOptions = options;
+}
+
+// Resets the target into ISP(if enabled in the sync options), synchronizes, sets the crystal
+// value and disables echo.
+int QLpcSession::sync(int crystalValue)
+{
+    QList<Exchange> exchanges;
+    Exchange exchange;
+
+    exchange.m_Send = "Synchronized\r\n";
+    exchange.m_EchoLines = 1;
+    exchange.m_Ok = "OK";
+    exchanges.append(exchange);
+
+    exchange.m_Send = QByteArray::number(crystalValue) + "\r\n";
+    exchanges.append(exchange);
+
+    exchanges.append(command("A 0\r\n"));
+
+    return enqueue(OperationSync, exchanges);
+}
+
+// Returns -1 if the port can't follow the target to the new rate.
+int QLpcSession::setBaudRate(int baudRate)
+{
+    if ((!m_transport)||(!m_transport->canSetBaudRate()))
+    {
+        return -1;
+    }
+
+    return enqueue(OperationBaudRate, QList<Exchange>() << command("B " + QByteArray::number(baudRate) + " 2\r\n"), baudRate);
+}
+
+int QLpcSession::readPartID()
+{
+    return enqueue(OperationPartID, QList<Exchange>() << command("J\r\n", 2));
+}
+
+int QLpcSession::readBootCodeVersion()
+{
+    return enqueue(OperationBootCodeVersion, QList<Exchange>() << command("K\r\n", 3));
+}
+
+int QLpcSession::readSerialNumber()
+{
+    return enqueue(OperationSerialNumber, QList<Exchange>() << command("N\r\n", 5));
+}
+
+// Returns -1 if the sectors are invalid.
+int QLpcSession::erase(int startSector, int endSector)
+{
+    QByteArray sectors = QByteArray::number(startSector) + " " + QByteArray::number(endSector) + "\r\n";
+    QList<Exchange> exchanges;
+
+    if ((startSector < 0)||(endSector < startSector))
+    {
+        return -1;
+    }
+
+    exchanges.append(command("U 23130\r\n"));
+    exchanges.append(command("P " + sectors));
+    exchanges.append(command("E " + sectors, 1, 'E', 0, endSector - startSector + 1));
+
+    return enqueue(OperationErase, exchanges);
+}
+
+// Returns -1 if the sectors are invalid.
+int QLpcSession::blankCheck(int startSector, int endSector)
+{
+    Exchange exchange = command("I " + QByteArray::number(startSector) + " " + QByteArray::number(endSector) + "\r\n", 1, 'I', 0, endSector - startSector + 1);
+
+    if ((startSector < 0)||(endSector < startSector))
+    {
+        return -1;
+    }
+
+    // SECTOR_NOT_BLANK is followed by the offset and contents of the first non blank word.
+    exchange.m_Other = "8";
+    exchange.m_OtherLines = 2;
+
+    return enqueue(OperationBlankCheck, QList<Exchange>() << exchange);
+}
+
+// Same rules as QLpcProg::chipProgram(), the chunk is padded to a copy size. Returns -1 if the
+// chunk doesn't fit.
+int QLpcSession::program(const QByteArray &chunk, int offset, const QList<QByteArray> &encoded)
+{
+    QByteArray data = chunk;
+    QList<Exchange> exchanges;
+    int size = QLpcProg::copySize(data.length());
+
+    int first_sector = QLpcProg::sectorFromAddress(offset);
+    int last_sector = QLpcProg::sectorFromAddress(offset + size - 1);
+
+    if ((size == 0)||(offset % 256)||(first_sector < 0)||(last_sector < 0))
+    {
+        return -1;
+    }
+
+    if ((!encoded.isEmpty())&&(encoded.count() != (size + UU_GROUP_SIZE - 1) / UU_GROUP_SIZE))
+    {
+        return -1;
+    }
+
+    data.append(QByteArray(size - data.length(), (char)255));
+
+    exchanges.append(command("U 23130\r\n"));
+    exchanges.append(writeRam(data, QLpcProg::ramBuffer(), encoded));
+    exchanges.append(command("P " + QByteArray::number(first_sector) + " " + QByteArray::number(last_sector) + "\r\n"));
+    exchanges.append(command("C " + QByteArray::number(offset) + " " + QByteArray::number(QLpcProg::ramBuffer()) + " " + QByteArray::number(size) + "\r\n", 1, 'C', size));
+
+    return enqueue(OperationProgram, exchanges);
+}
+
+// Compares flash at offset with the chunk. Returns -1 unless both are word aligned.
+int QLpcSession::verify(const QByteArray &chunk, int offset)
+{
+    QList<Exchange> exchanges;
+
+    if ((chunk.isEmpty())||(chunk.length() > 4096)||(chunk.length() % 4)||(offset % 4))
+    {
+        return -1;
+    }
+
+    Exchange compare = command("M " + QByteArray::number(offset) + " " + QByteArray::number(QLpcProg::ramBuffer()) + " " + QByteArray::number(chunk.length()) + "\r\n", 1, 'M', chunk.length());
+
+    // COMPARE_ERROR is followed by the offset of the first mismatch.
+    compare.m_Other = "10";
+    compare.m_OtherLines = 1;
+
+    exchanges.append(writeRam(chunk, QLpcProg::ramBuffer()));
+    exchanges.append(compare);
+
+    return enqueue(OperationVerify, exchanges);
+}
+
+int QLpcSession::go(quint32 address, bool thumb)
+{
+    QList<Exchange> exchanges;
+
+    exchanges.append(command("U 23130\r\n"));
+    exchanges.append(command("G " + QByteArray::number(address) + (thumb ? " T\r\n" : " A\r\n")));
+
+    return enqueue(OperationGo, exchanges);
+}
+
+QLpcSession::State QLpcSession::state() const
+{
+    return m_state;
+}
+
+QString QLpcSession::port() const
+{
+    return m_port;
+}
+
+int QLpcSession::queued() const
+{
+    return m_queue.count();
+}
+
+void QLpcSession::readyRead()
+{
+    QByteArray line;
+
+    m_rxBuffer.append(m_transport->readAll());
+
+    if (m_state == StateSync)
+    {
+        if (!takeLine(line))
+        {
+            return;
+        }
+
+        if (line != "Synchronized")
+        {
+            // Autobaud noise, the next '?' starts over.
+            m_rxBuffer.clear();
+
+            return;
+        }
+
+        m_timer.stop();
+        m_state = StateBusy;
+        startExchange();
+
+        return;
+    }
+
+    while((m_state == StateBusy)&&(takeLine(line)))
+    {
+        const Exchange &exchange = m_queue.first().m_Exchanges.first();
+
+        m_lines.append(line);
+
+        if (m_lines.count() <= exchange.m_EchoLines)
+        {
+            continue;
+        }
+
+        int lines = ((!exchange.m_Other.isEmpty())&&(m_lines.at(exchange.m_EchoLines) == exchange.m_Other)) ? exchange.m_OtherLines + 1 : exchange.m_Lines;
+
+        if (m_lines.count() >= exchange.m_EchoLines + lines)
+        {
+            QList<QByteArray> reply = m_lines.mid(exchange.m_EchoLines);
+
+            m_timer.stop();
+            m_lines.clear();
+
+            exchangeDone(reply);
+        }
+    }
+
+    if (m_state != StateBusy)
+    {
+        // Nothing is expected.
+        m_rxBuffer.clear();
+    }
+}
+
+void QLpcSession::timeout()
+{
+    switch(m_state)
+    {
+    case StateReset:
+        m_transport->setDataTerminalReady(m_syncOptions.m_ResetInverted);
+        m_state = StateBoot;
+        m_timer.start(m_syncOptions.m_BootTime);
+        break;
+
+    case StateBoot:
+        m_transport->readAll();
+        m_rxBuffer.clear();
+        m_state = StateSync;
+        sendQuestion();
+        break;
+
+    case StateSync:
+        if (m_syncTimer.elapsed() >= m_syncOptions.m_SyncTimeout)
+        {
+            finish(QLpcProg::StatusTimeOut, tr("Synchronization timeout(%1 ms).").arg(m_syncOptions.m_SyncTimeout));
+            break;
+        }
+
+        if (!QByteArray("Synchronized").startsWith(m_rxBuffer))
+        {
+            m_rxBuffer.clear();
+        }
+
+        sendQuestion();
+        break;
+
+    case StateBusy:
+        finish(QLpcProg::StatusTimeOut, tr("Data Timeout."));
+        break;
+
+    default:
+        break;
+    }
+}
+
+int QLpcSession::enqueue(OperationType type, const QList<Exchange> &exchanges, int value)
+{
+    Operation operation;
+
+    operation.m_Id = m_nextId++;
+    operation.m_Type = type;
+    operation.m_Value = value;
+    operation.m_Exchanges = exchanges;
+
+    m_queue.append(operation);
+
+    if (m_state == StateIdle)
+    {
+        next();
+    }
+
+    return operation.m_Id;
+}
+
+void QLpcSession::next()
+{
+    if ((m_state == StateClosed)||(m_queue.isEmpty()))
+    {
+        return;
+    }
+
+    if (m_queue.first().m_Type == OperationSync)
+    {
+        startSync();
+
+        return;
+    }
+
+    m_state = StateBusy;
+    startExchange();
+}
+
+void QLpcSession::startSync()
+{
+    m_syncTimer.start();
+    m_transport->readAll();
+    m_rxBuffer.clear();
+
+    if (m_syncOptions.m_Reset)
+    {
+        m_transport->setDataTerminalReady(!m_syncOptions.m_ResetInverted);
+        m_transport->setRequestToSend(!m_syncOptions.m_IspInverted);
+
+        m_state = StateReset;
+        m_timer.start(m_syncOptions.m_ResetTime);
+
+        return;
+    }
+
+    m_state = StateSync;
+    sendQuestion();
+}
+
+void QLpcSession::sendQuestion()
+{
+    // Don't disturb an answer that is already coming in.
+    if (m_rxBuffer.isEmpty())
+    {
+        m_transport->write("?");
+    }
+
+    m_timer.start(m_syncOptions.m_RetryInterval);
+}
+
+void QLpcSession::startExchange()
+{
+    const Exchange &exchange = m_queue.first().m_Exchanges.first();
+
+    m_lines.clear();
+    m_transport->write(exchange.m_Send);
+    m_exchangeTimer.start();
+
+    // Same model as QLpcProg, with the latency this port has shown so far.
+    m_timer.start(QLpcProg::commandTimeout(exchange.m_Command, exchange.m_Bytes, exchange.m_Sectors, m_baudRate, m_latency));
+}
+
+void QLpcSession::exchangeDone(const QList<QByteArray> &reply)
+{
+    Operation &operation = m_queue.first();
+    Exchange &exchange = operation.m_Exchanges.first();
+    const QByteArray &code = reply.first();
+
+    QLpcProg::recordLatency(m_latency, exchange.m_Command, m_exchangeTimer.elapsed() - QLpcProg::commandTime(exchange.m_Command, exchange.m_Bytes, exchange.m_Sectors, m_baudRate));
+
+    if ((code == "RESEND")&&(exchange.m_Ok == "OK")&&(exchange.m_Resends < RESEND_RETRIES))
+    {
+        // Checksum group of W, nothing else is in flight so it can be sent again.
+        exchange.m_Resends++;
+        startExchange();
+
+        return;
+    }
+
+    if ((code != exchange.m_Ok)&&((exchange.m_Other.isEmpty())||(code != exchange.m_Other)))
+    {
+        finish(QLpcProg::StatusError, tr("Wrong data recieved(%1).").arg(QString(code)));
+
+        return;
+    }
+
+    operation.m_Exchanges.removeFirst();
+
+    if (!operation.m_Exchanges.isEmpty())
+    {
+        startExchange();
+
+        return;
+    }
+
+    // The last exchange carries the result.
+    switch(operation.m_Type)
+    {
+    case OperationBaudRate:
+        if (m_transport->setBaudRate(operation.m_Value) == false)
+        {
+            finish(QLpcProg::StatusError, tr("Can\'t change baudrate. Internal error(%1).").arg(m_transport->errorString()));
+
+            return;
+        }
+
+        m_baudRate = operation.m_Value;
+        break;
+
+    case OperationPartID:
+        operation.m_Result = reply.at(1).toInt() & 0x000FFFFF;
+        break;
+
+    case OperationBootCodeVersion:
+        operation.m_Result = QString(reply.at(2)) + "." + QString(reply.at(1));
+        break;
+
+    case OperationSerialNumber:
+        {
+            QStringList words;
+
+            for(int c = 1; c < reply.count(); c++)
+            {
+                words.append(QString("%1").arg(reply.at(c).toUInt(), 8, 16, QChar('0')).toUpper());
+            }
+
+            operation.m_Result = words.join("-");
+        }
+        break;
+
+    case OperationBlankCheck:
+        operation.m_Result = (code == "0");
+        break;
+
+    case OperationVerify:
+        if (code != "0")
+        {
+            operation.m_Result = reply.at(1).toInt();
+            finish(QLpcProg::StatusError, tr("Compare error at offset %1.").arg(QString(reply.at(1))));
+
+            return;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    finish(QLpcProg::StatusNoError, QString());
+}
+
+// Ends the current operation. After a failure the operations queued behind it are canceled,
+// they were queued expecting this one to succeed.
+void QLpcSession::finish(QLpcProg::Status status, const QString &statusText)
+{
+    Operation operation = m_queue.takeFirst();
+    QList<Operation> canceled;
+
+    m_timer.stop();
+    m_lines.clear();
+
+    if (status != QLpcProg::StatusNoError)
+    {
+        canceled = m_queue;
+        m_queue.clear();
+        m_rxBuffer.clear();
+    }
+
+    // Operations queued from the slots wait until the signals are out.
+    m_state = StateBusy;
+
+    emit finished(operation.m_Id, status, statusText, operation.m_Result);
+
+    foreach(Operation canceledOperation, canceled)
+    {
+        emit finished(canceledOperation.m_Id, QLpcProg::StatusError, tr("Canceled."), QVariant());
+    }
+
+    if (m_state == StateClosed)
+    {
+        return;
+    }
+
+    m_state = StateIdle;
+    next();
+}
+
+QLpcSession::Exchange QLpcSession::command(const QByteArray &send, int lines, char command, int bytes, int sectors)
+{
+    Exchange exchange;
+
+    exchange.m_Send = send;
+    exchange.m_Lines = lines;
+    exchange.m_Ok = "0";
+    exchange.m_Command = command;
+    exchange.m_Bytes = bytes;
+    exchange.m_Sectors = sectors;
+
+    return exchange;
+}
+
+// The bootloader answers every 20 UU lines(900 bytes) with OK or RESEND, each group is one exchange.
+QList<QLpcSession::Exchange> QLpcSession::writeRam(const QByteArray &data, quint32 address, const QList<QByteArray> &encoded)
+{
+    QList<QByteArray> groups = encoded.isEmpty() ? QLpcProg::encodeUUGroups(data) : encoded;
+    QList<Exchange> ret;
+
+    ret.append(command("W " + QByteArray::number(address) + " " + QByteArray::number(data.length()) + "\r\n"));
+
+    for(int c = 0; c < groups.count(); c++)
+    {
+        Exchange exchange;
+
+        exchange.m_Send = groups.at(c);
+        exchange.m_Ok = "OK";
+        exchange.m_Command = 'W';
+        exchange.m_Bytes = qMin(UU_GROUP_SIZE, data.length() - c * UU_GROUP_SIZE);
+
+        ret.append(exchange);
+    }
+
+    return ret;
+}
+
+bool QLpcSession::takeLine(QByteArray &line)
+{
+    int pos = m_rxBuffer.indexOf('\n');
+
+    if (pos < 0)
+    {
+        return false;
+    }
+
+    line = m_rxBuffer.left(pos);
+    m_rxBuffer.remove(0, pos + 1);
+
+    if (line.endsWith('\r'))
+    {
+        line.chop(1); // chop \r
+    }
+
+    return true;
+}
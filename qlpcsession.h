@@ -0,0 +1,110 @@
+#ifndef QLPCSESSION_H
+#define QLPCSESSION_H
+
+#include "qlpcprog.h"
+
+#include <QElapsedTimer>
+#include <QByteArray>
+#include <QVariant>
+#include <QObject>
+#include <QTimer>
+#include <QList>
+#include <QMap>
+
+class QLpcTransport;
+
+// Non blocking ISP session. Every operation is queued and returns an id right away, the
+// result comes with finished(). Replies are handled from the event loop as they arrive, so
+// one thread can run sessions on many ports. Operations run in the order they were queued,
+// the ones queued after a failed operation are canceled.
+class QLpcSession : public QObject
+{
+    Q_OBJECT
+public:
+    enum State {StateClosed, StateReset, StateBoot, StateSync, StateIdle, StateBusy};
+
+    explicit QLpcSession(QObject *parent = 0);
+    virtual ~QLpcSession();
+
+    bool open(const QString &port);
+    void close();
+
+    void setSyncOptions(const QLpcProg::SyncOptions &options);
+
+    int sync(int crystalValue);
+    int setBaudRate(int baudRate);
+    int readPartID();
+    int readBootCodeVersion();
+    int readSerialNumber();
+    int erase(int startSector, int endSector);
+    int blankCheck(int startSector, int endSector);
+    int program(const QByteArray &chunk, int offset, const QList<QByteArray> &encoded = QList<QByteArray>());
+    int verify(const QByteArray &chunk, int offset);
+    int go(quint32 address, bool thumb = false);
+
+    State state() const;
+    QString port() const;
+    int queued() const;
+
+signals:
+    // Result is the part ID, version or serial number string, blank check bool.
+    void finished(int id, QLpcProg::Status status, const QString &statusText, const QVariant &result);
+
+private slots:
+    void readyRead();
+    void timeout();
+
+private:
+    enum OperationType {OperationSync, OperationBaudRate, OperationPartID, OperationBootCodeVersion, OperationSerialNumber, OperationErase, OperationBlankCheck, OperationProgram, OperationVerify, OperationGo};
+
+    struct Exchange {
+        Exchange() : m_EchoLines(0), m_Lines(1), m_OtherLines(0), m_Command(0), m_Bytes(0), m_Sectors(0), m_Resends(0) {}
+
+        QByteArray m_Send;
+        int m_EchoLines;
+        int m_Lines;         // Reply lines, the first one is the return code.
+        QByteArray m_Ok;
+        QByteArray m_Other;  // Return code that is a result too, followed by m_OtherLines lines.
+        int m_OtherLines;
+        char m_Command;      // Command, data and sectors the timeout is worked out from.
+        int m_Bytes;
+        int m_Sectors;
+        int m_Resends;
+    };
+
+    struct Operation {
+        int m_Id;
+        OperationType m_Type;
+        int m_Value;
+        QList<Exchange> m_Exchanges;
+        QList<QByteArray> m_Lines;
+        QVariant m_Result;
+    };
+
+    int enqueue(OperationType type, const QList<Exchange> &exchanges, int value = 0);
+    void next();
+    void startSync();
+    void sendQuestion();
+    void startExchange();
+    void exchangeDone(const QList<QByteArray> &lines);
+    void finish(QLpcProg::Status status, const QString &statusText);
+    Exchange command(const QByteArray &send, int lines = 1, char command = 0, int bytes = 0, int sectors = 0);
+    QList<Exchange> writeRam(const QByteArray &data, quint32 address, const QList<QByteArray> &encoded = QList<QByteArray>());
+    bool takeLine(QByteArray &line);
+
+    QLpcTransport *m_transport;
+    QString m_port;
+    QLpcProg::SyncOptions m_syncOptions;
+    State m_state;
+    QTimer m_timer;
+    QElapsedTimer m_syncTimer;
+    QElapsedTimer m_exchangeTimer;
+    QMap<char, int> m_latency;
+    QList<Operation> m_queue;
+    QList<QByteArray> m_lines;
+    QByteArray m_rxBuffer;
+    int m_nextId;
+    int m_baudRate;
+};
+
+#endif // QLPCSESSION_H
@@ -0,0 +1,505 @@
+#include "qlpcstubprog.h"
+#include "qlpctransport.h"
+#include "qhexloader.h"
+
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QFile>
+
+// Stub protocol, all words are little endian:
+//
+//   host -> stub: command(1) sequence(1) arg0(4) arg1(4) length(4) payload(length) crc32(4)
+//   stub -> host: status(1) sequence(1) value(4) crc32(4)
+//
+// crc32 covers every byte of the frame before it. The stub announces itself with STUB_BANNER
+// when started. Status is 0 on success, STUB_CRC_ERROR when the frame was damaged(the host
+// sends it again) or the IAP status code.
+//
+// Every new command gets the next sequence number, a resent frame keeps it. A frame with the
+// sequence of the last executed one is not run again, the stub sends the stored reply, so a
+// W or E whose reply got lost is never repeated.
+//
+//   'S' sync, crystal KHz(arg0)      - value = stub version(STUB_VERSION), arg0 0 keeps it
+//   'B' baud rate(arg0)              - the reply is sent with the old baud rate, status is
+//                                      STUB_BAUD_ERROR when the rate can't be made within 3%
+//   'E' erase sectors arg0..arg1
+//   'W' program payload at arg0      - payload is 256, 512, 1024 or 4096 bytes
+//   'V' crc32 of arg1 bytes at arg0  - value = crc32
+//   'G' go to arg0(ARM mode)
+//
+// The stub itself is in stub/.
+
+static const char STUB_BANNER[] = "LPCSTUB\r\n";
+
+#define STUB_LOAD_ADDRESS 1073742336 // Same RAM the ISP W command uses for programming.
+#define STUB_RAM_START 0x40000000
+#define STUB_IAP_AREA 32 // Top of RAM is used by IAP calls.
+#define STUB_STACK_SIZE 256
+#define STUB_VERSION 2
+#define STUB_CRC_ERROR 0xFF
+#define STUB_BAUD_ERROR 0xFE
+#define STUB_RETRIES 3
+#define STUB_BLOCK_SIZE 4096
+#define STUB_BANNER_TIMEOUT 500
+#define STUB_TIMEOUT 100
+
+
+QLpcStubProg::QLpcStubProg(QLpcProg *prog, QObject *parent) :
+    QObject(parent),
+    m_prog(prog),
+    m_loadAddress(STUB_LOAD_ADDRESS),
+    m_running(false),
+    m_baudRate(9600),
+    m_sequence(0),
+    m_status(QLpcProg::StatusNoError)
+{
+}
+
+bool QLpcStubProg::load(const QString &filename)
+{
+    if (QFileInfo(filename).suffix().toLower() == "hex")
+    {
+        QHexLoader loader;
+
+        if (loader.load(filename) == false)
+        {
+            setError(tr("Error loading stub file(%1).").arg(filename));
+
+            return false;
+        }
+
+        m_stub = loader.data();
+    }
+    else
+    {
+        QFile file(filename);
+
+        if (file.open(QIODevice::ReadOnly) == false)
+        {
+            setError(tr("Error loading stub file(%1).").arg(filename));
+
+            return false;
+        }
+
+        m_stub = file.readAll();
+    }
+
+    if ((m_stub.isEmpty())||(m_stub.length() > maxSize(QLpcProg::LPC2148)))
+    {
+        m_stub.clear();
+        setError(tr("Invalid stub file(%1).").arg(filename));
+
+        return false;
+    }
+
+    // W only accepts whole words.
+    while(m_stub.length() % 4)
+    {
+        m_stub.append((char)0xFF);
+    }
+
+    m_status = QLpcProg::StatusNoError;
+    m_statusText.clear();
+
+    return true;
+}
+
+void QLpcStubProg::setLoadAddress(quint32 address)
+{
+    m_loadAddress = address;
+}
+
+// Downloads and starts the stub. On any failure the target is reset back into ISP
+// and the engine keeps working through QLpcProg.
+bool QLpcStubProg::start(int baudRate)
+{
+    QByteArray banner;
+    quint32 version = 0;
+
+    m_running = false;
+    m_sequence = 0;
+
+    if (m_stub.isEmpty())
+    {
+        setError(tr("Stub is not loaded."));
+
+        return false;
+    }
+
+    int partID = m_prog->readPartID();
+    if (m_prog->getStatus() != QLpcProg::StatusNoError)
+    {
+        setError(m_prog->getStatusText(), m_prog->getStatus());
+
+        return false;
+    }
+
+    // Bigger than the part allows, the stub would overwrite its own buffer or stack.
+    if (m_stub.length() > maxSize(partID))
+    {
+        m_status = QLpcProg::StatusNoError;
+        m_statusText = tr("Stub doesn\'t fit in RAM of this part, using ISP.");
+
+        return false;
+    }
+
+    m_prog->writeRam(m_stub, m_loadAddress);
+    if (m_prog->getStatus() != QLpcProg::StatusNoError)
+    {
+        setError(m_prog->getStatusText(), m_prog->getStatus());
+
+        return false;
+    }
+
+    m_prog->go(m_loadAddress);
+    if (m_prog->getStatus() != QLpcProg::StatusNoError)
+    {
+        setError(m_prog->getStatusText(), m_prog->getStatus());
+
+        return false;
+    }
+
+    // The stub keeps the baud rate set through ISP.
+    m_rxBuffer = m_prog->takeBuffered();
+    m_baudRate = m_prog->baudRate();
+    m_running = true;
+
+    if ((!readRaw(banner, sizeof(STUB_BANNER) - 1, STUB_BANNER_TIMEOUT))||(banner != STUB_BANNER))
+    {
+        return fallback(tr("Stub handshake failed, using ISP."));
+    }
+
+    if (!transfer('S', m_prog->crystalValue(), 0, QByteArray(), &version))
+    {
+        return fallback(tr("Stub handshake failed, using ISP."));
+    }
+
+    if (version != STUB_VERSION)
+    {
+        return fallback(tr("Stub version %1 is not supported, using ISP.").arg(version));
+    }
+
+    if ((baudRate > 0)&&(baudRate != m_baudRate)&&(m_prog->transport()->canSetBaudRate()))
+    {
+        if ((!transfer('B', baudRate, 0, QByteArray()))||(!m_prog->transport()->setBaudRate(baudRate)))
+        {
+            return fallback(tr("Stub can\'t change baudrate to %1, using ISP.").arg(baudRate));
+        }
+
+        m_baudRate = baudRate;
+
+        // Confirm the new rate is stable before using it.
+        if (!transfer('S', 0, 0, QByteArray()))
+        {
+            return fallback(tr("Stub link unstable at %1 baud, using ISP.").arg(baudRate));
+        }
+    }
+
+    m_status = QLpcProg::StatusNoError;
+    m_statusText.clear();
+
+    return true;
+}
+
+void QLpcStubProg::stop()
+{
+    if (!m_running)
+    {
+        return;
+    }
+
+    m_running = false;
+    m_rxBuffer.clear();
+
+    m_prog->resync();
+
+    m_status = m_prog->getStatus();
+    m_statusText = m_prog->getStatusText();
+}
+
+bool QLpcStubProg::isRunning() const
+{
+    return m_running;
+}
+
+void QLpcStubProg::chipErase(int startSector, int endSector)
+{
+    if (!m_running)
+    {
+        m_prog->chipErase(startSector, endSector);
+        setError(m_prog->getStatusText(), m_prog->getStatus());
+
+        return;
+    }
+
+    if ((startSector < 0)||(endSector < startSector))
+    {
+        setError(tr("Invalid function parametar."));
+
+        return;
+    }
+
+    // Erasing again through ISP is harmless.
+    if ((!transfer('E', startSector, endSector, QByteArray(), 0, QLpcProg::commandTime('E', 0, endSector - startSector + 1, m_baudRate)))&&(!m_running)&&(m_prog->getStatus() == QLpcProg::StatusNoError))
+    {
+        chipErase(startSector, endSector);
+    }
+}
+
+// Blocks go from the last to the first, so an interrupted run never leaves valid vectors behind.
+void QLpcStubProg::chipProgram(const QByteArray &data, int offset)
+{
+    QList<int> blocks;
+    QList<int> sizes;
+    int pos = 0;
+
+    while(pos < data.length())
+    {
+        int size = 1024;
+
+        if (((offset + pos) % STUB_BLOCK_SIZE == 0)&&(data.length() - pos > 1024))
+        {
+            size = STUB_BLOCK_SIZE;
+        }
+
+        blocks.prepend(pos);
+        sizes.prepend(size);
+
+        pos += size;
+    }
+
+    for(int c = 0; c < blocks.count(); c++)
+    {
+        int block = blocks.at(c);
+        int size = sizes.at(c);
+
+        if (!m_running)
+        {
+            m_prog->chipProgram(data.mid(block, size), offset + block);
+            setError(m_prog->getStatusText(), m_prog->getStatus());
+
+            if (m_status != QLpcProg::StatusNoError)
+            {
+                return;
+            }
+
+            continue;
+        }
+
+        QByteArray chunk = data.mid(block, size);
+
+        if (chunk.length() < size)
+        {
+            chunk.append(QByteArray(size - chunk.length(), (char)0xFF));
+        }
+
+        if (!transfer('W', offset + block, 0, chunk, 0, QLpcProg::commandTime('C', size, 0, m_baudRate)))
+        {
+            return;
+        }
+    }
+}
+
+quint32 QLpcStubProg::readCrc32(int offset, int length)
+{
+    quint32 ret = 0;
+
+    if (!m_running)
+    {
+        ret = m_prog->readCrc32(offset, length);
+        setError(m_prog->getStatusText(), m_prog->getStatus());
+
+        return ret;
+    }
+
+    // The stub needs about 2us per byte at 12MHz.
+    if ((!transfer('V', offset, length, QByteArray(), &ret, (length / 400) + 1))&&(!m_running)&&(m_prog->getStatus() == QLpcProg::StatusNoError))
+    {
+        return readCrc32(offset, length);
+    }
+
+    return ret;
+}
+
+void QLpcStubProg::go(quint32 address)
+{
+    if (!m_running)
+    {
+        m_prog->go(address);
+        setError(m_prog->getStatusText(), m_prog->getStatus());
+
+        return;
+    }
+
+    if (transfer('G', address, 0, QByteArray()))
+    {
+        m_running = false;
+    }
+}
+
+QLpcProg::Status QLpcStubProg::getStatus()
+{
+    return m_status;
+}
+
+QString QLpcStubProg::getStatusText()
+{
+    return m_statusText;
+}
+
+static void appendWord(QByteArray &data, quint32 value)
+{
+    data.append((char)(value & 0xFF));
+    data.append((char)((value >> 8) & 0xFF));
+    data.append((char)((value >> 16) & 0xFF));
+    data.append((char)((value >> 24) & 0xFF));
+}
+
+static quint32 wordAt(const QByteArray &data, int pos)
+{
+    return (quint8)data.at(pos) | ((quint8)data.at(pos + 1) << 8) | ((quint8)data.at(pos + 2) << 16) | ((quint32)(quint8)data.at(pos + 3) << 24);
+}
+
+bool QLpcStubProg::transfer(char command, quint32 arg0, quint32 arg1, const QByteArray &payload, quint32 *value, int deviceTime)
+{
+    QByteArray frame;
+
+    m_sequence++;
+
+    frame.reserve(18 + payload.length());
+    frame.append(command);
+    frame.append((char)m_sequence);
+    appendWord(frame, arg0);
+    appendWord(frame, arg1);
+    appendWord(frame, payload.length());
+    frame.append(payload);
+    appendWord(frame, QLpcProg::crc32(frame));
+
+    for(int retry = 0; retry < STUB_RETRIES; retry++)
+    {
+        QByteArray reply;
+
+        m_prog->transport()->write(frame);
+
+        if (!readRaw(reply, 10, frameTime(frame.length() + 10) + deviceTime + STUB_TIMEOUT))
+        {
+            // The stub is gone, the target is reset back into ISP for whatever comes next.
+            stop();
+
+            setError(tr("Stub command %1 timeout.").arg(QChar(command)), QLpcProg::StatusTimeOut);
+
+            return false;
+        }
+
+        if ((wordAt(reply, 6) != QLpcProg::crc32(reply.left(6)))||((quint8)reply.at(1) != m_sequence))
+        {
+            // Lost sync with the stub, drop whatever is left and send again.
+            m_prog->transport()->waitForReadyRead(STUB_TIMEOUT);
+            m_prog->transport()->readAll();
+            m_rxBuffer.clear();
+
+            continue;
+        }
+
+        quint8 status = (quint8)reply.at(0);
+
+        if (status == STUB_CRC_ERROR)
+        {
+            continue;
+        }
+
+        if (status == STUB_BAUD_ERROR)
+        {
+            setError(tr("Stub can\'t make baudrate %1.").arg(arg0));
+
+            return false;
+        }
+
+        if (status != 0)
+        {
+            setError(tr("Stub command %1 failed(IAP status %2).").arg(QChar(command)).arg(status));
+
+            return false;
+        }
+
+        if (value)
+        {
+            *value = wordAt(reply, 2);
+        }
+
+        m_status = QLpcProg::StatusNoError;
+        m_statusText.clear();
+
+        return true;
+    }
+
+    setError(tr("Stub command %1 failed after %2 retries.").arg(QChar(command)).arg(STUB_RETRIES));
+
+    return false;
+}
+
+bool QLpcStubProg::readRaw(QByteArray &data, int count, int timeout)
+{
+    QElapsedTimer timer;
+
+    timer.start();
+
+    while(m_rxBuffer.length() < count)
+    {
+        qint64 remaining = timeout - timer.elapsed();
+
+        if (remaining <= 0)
+        {
+            setError(tr("Data Timeout."), QLpcProg::StatusTimeOut);
+
+            return false;
+        }
+
+        m_prog->transport()->waitForReadyRead((int)remaining);
+        m_rxBuffer.append(m_prog->transport()->readAll());
+    }
+
+    data = m_rxBuffer.left(count);
+    m_rxBuffer.remove(0, count);
+
+    return true;
+}
+
+// Back to ISP. The status stays clean when the target resynchronized, the text says why.
+bool QLpcStubProg::fallback(const QString &reason)
+{
+    stop();
+
+    if (m_prog->getStatus() == QLpcProg::StatusNoError)
+    {
+        m_status = QLpcProg::StatusNoError;
+        m_statusText = reason;
+    }
+    else
+    {
+        setError(m_prog->getStatusText(), m_prog->getStatus());
+    }
+
+    return false;
+}
+
+// The stub image is followed in RAM by its STUB_BLOCK_SIZE buffer and stack, the IAP area at
+// the top stays free. RAM below the load address belongs to the bootloader.
+int QLpcStubProg::maxSize(int partID)
+{
+    int ret = QLpcProg::ramSize(partID) - (int)(m_loadAddress - STUB_RAM_START) - STUB_BLOCK_SIZE - STUB_STACK_SIZE - STUB_IAP_AREA;
+
+    return qMax(ret, 0);
+}
+
+// The link is 8N2 like ISP, 11 bits per byte.
+int QLpcStubProg::frameTime(int bytes)
+{
+    return (bytes * 11 * 1000) / m_baudRate;
+}
+
+void QLpcStubProg::setError(const QString &text, QLpcProg::Status status)
+{
+    m_status = status;
+    m_statusText = text;
+}
@@ -0,0 +1,51 @@
+#ifndef QLPCSTUBPROG_H
+#define QLPCSTUBPROG_H
+
+#include "qlpcprog.h"
+
+#include <QByteArray>
+#include <QObject>
+
+// Programs through a flash loader stub running from RAM instead of the ISP command set.
+// Falls back to plain ISP whenever the stub is not running.
+class QLpcStubProg : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcStubProg(QLpcProg *prog, QObject *parent = 0);
+
+    bool load(const QString &filename);
+    void setLoadAddress(quint32 address);
+
+    bool start(int baudRate = 0);
+    void stop();
+    bool isRunning() const;
+
+    void chipErase(int startSector, int endSector);
+    void chipProgram(const QByteArray &data, int offset);
+    quint32 readCrc32(int offset, int length);
+    void go(quint32 address);
+
+    QLpcProg::Status getStatus();
+    QString getStatusText();
+
+private:
+    bool transfer(char command, quint32 arg0, quint32 arg1, const QByteArray &payload, quint32 *value = 0, int deviceTime = 0);
+    bool readRaw(QByteArray &data, int count, int timeout);
+    bool fallback(const QString &reason);
+    int maxSize(int partID);
+    int frameTime(int bytes);
+    void setError(const QString &text, QLpcProg::Status status = QLpcProg::StatusError);
+
+    QLpcProg *m_prog;
+    QByteArray m_stub;
+    quint32 m_loadAddress;
+    bool m_running;
+    int m_baudRate;
+    quint8 m_sequence;
+    QByteArray m_rxBuffer;
+    QLpcProg::Status m_status;
+    QString m_statusText;
+};
+
+#endif // QLPCSTUBPROG_H
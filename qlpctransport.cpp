@@ -0,0 +1,492 @@
+#include "qlpctransport.h"
+
+#include <QMetaObject>
+#include <QFileInfo>
+#include <QThread>
+#include <QFile>
+#include <QMap>
+#include <QUrl>
+
+#include <climits>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#endif
+
+static QMap<QString, QLpcLoopbackDevice *> loopbackListeners;
+static QMutex loopbackListenersMutex;
+
+// Guards the peer links. A target answering from readyRead() writes back while the link is
+// still held, so it has to be recursive.
+static QMutex loopbackLinkMutex(QMutex::Recursive);
+
+
+QLpcTransport::QLpcTransport(QObject *parent) :
+    QObject(parent)
+{
+}
+
+QLpcTransport::~QLpcTransport()
+{
+}
+
+QLpcTransport *QLpcTransport::create(const QString &name, QObject *parent)
+{
+    if (name.startsWith("tcp://"))
+    {
+        return new QLpcTcpTransport(parent);
+    }
+
+    if (name.startsWith("loop://"))
+    {
+        return new QLpcLoopbackTransport(parent);
+    }
+
+    return new QLpcSerialTransport(parent);
+}
+
+void QLpcTransport::close()
+{
+    device()->close();
+}
+
+// False if the baud rate is fixed on the other side of the link.
+bool QLpcTransport::canSetBaudRate() const
+{
+    return true;
+}
+
+bool QLpcTransport::setBaudRate(int baudRate)
+{
+    Q_UNUSED(baudRate);
+
+    return true;
+}
+
+bool QLpcTransport::setDataTerminalReady(bool set)
+{
+    Q_UNUSED(set);
+
+    return true;
+}
+
+bool QLpcTransport::setRequestToSend(bool set)
+{
+    Q_UNUSED(set);
+
+    return true;
+}
+
+bool QLpcTransport::setLowLatency(bool enable)
+{
+    return !enable;
+}
+
+int QLpcTransport::pipelineDepth() const
+{
+    return 1;
+}
+
+bool QLpcTransport::isOpen()
+{
+    return device()->isOpen();
+}
+
+qint64 QLpcTransport::write(const QByteArray &data)
+{
+    return device()->write(data);
+}
+
+QByteArray QLpcTransport::readAll()
+{
+    return device()->readAll();
+}
+
+bool QLpcTransport::waitForReadyRead(int msecs)
+{
+    return device()->waitForReadyRead(msecs);
+}
+
+bool QLpcTransport::waitForBytesWritten(int msecs)
+{
+    return device()->waitForBytesWritten(msecs);
+}
+
+QString QLpcTransport::errorString()
+{
+    return device()->errorString();
+}
+
+
+QLpcSerialTransport::QLpcSerialTransport(QObject *parent) :
+    QLpcTransport(parent),
+    m_lowLatency(false),
+    m_savedSerialFlags(0)
+{
+}
+
+bool QLpcSerialTransport::open(const QString &name)
+{
+    m_name = name;
+    m_port.setPortName(name);
+
+    if (m_port.open(QIODevice::ReadWrite) == false)
+    {
+        return false;
+    }
+
+    m_port.setBaudRate(QSerialPort::Baud9600);
+    m_port.setDataBits(QSerialPort::Data8);
+    m_port.setStopBits(QSerialPort::TwoStop);
+    m_port.setParity(QSerialPort::NoParity);
+    m_port.setFlowControl(QSerialPort::SoftwareControl);
+
+    // Unlimited, so the port never stops reading while a reply is being parsed.
+    m_port.setReadBufferSize(0);
+
+    return true;
+}
+
+void QLpcSerialTransport::close()
+{
+    if (m_lowLatency)
+    {
+        setLowLatency(false);
+    }
+
+    m_port.close();
+}
+
+QIODevice *QLpcSerialTransport::device()
+{
+    return &m_port;
+}
+
+bool QLpcSerialTransport::setBaudRate(int baudRate)
+{
+    return m_port.setBaudRate(baudRate);
+}
+
+bool QLpcSerialTransport::setDataTerminalReady(bool set)
+{
+    return m_port.setDataTerminalReady(set);
+}
+
+bool QLpcSerialTransport::setRequestToSend(bool set)
+{
+    return m_port.setRequestToSend(set);
+}
+
+bool QLpcSerialTransport::setLowLatency(bool enable)
+{
+#ifdef Q_OS_LINUX
+    if (enable == m_lowLatency)
+    {
+        return true;
+    }
+
+    // QSerialPort::handle() is there since Qt 5.2, older versions only get the latency timer.
+#if QT_VERSION >= 0x050200
+    struct serial_struct serial;
+    int fd = m_port.handle();
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) < 0)
+    {
+        return false;
+    }
+
+    if (enable)
+    {
+        m_savedSerialFlags = serial.flags;
+        serial.flags |= ASYNC_LOW_LATENCY;
+    }
+    else
+    {
+        serial.flags = m_savedSerialFlags;
+    }
+
+    if (ioctl(fd, TIOCSSERIAL, &serial) < 0)
+    {
+        return false;
+    }
+#endif
+
+    // FTDI adapters batch received bytes for latency_timer ms(16 by default) on top of the tty flag.
+    QFile timer(latencyTimerFile());
+
+    if (enable)
+    {
+        if (timer.open(QIODevice::ReadOnly))
+        {
+            m_savedLatencyTimer = timer.readAll().trimmed();
+            timer.close();
+        }
+
+        if ((!m_savedLatencyTimer.isEmpty())&&(timer.open(QIODevice::WriteOnly)))
+        {
+            timer.write("1");
+            timer.close();
+        }
+    }
+    else if (!m_savedLatencyTimer.isEmpty())
+    {
+        if (timer.open(QIODevice::WriteOnly))
+        {
+            timer.write(m_savedLatencyTimer);
+            timer.close();
+        }
+
+        m_savedLatencyTimer.clear();
+    }
+
+#if QT_VERSION < 0x050200
+    if ((enable)&&(m_savedLatencyTimer.isEmpty()))
+    {
+        return false;
+    }
+#endif
+
+    m_lowLatency = enable;
+
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+// Links like /dev/serial/by-id/... are followed to the ttyUSBn node the sysfs entry is named after.
+QString QLpcSerialTransport::latencyTimerFile()
+{
+    QString path = m_name.startsWith("/") ? m_name : "/dev/" + m_name;
+    QString device = QFileInfo(path).canonicalFilePath();
+
+    if (device.isEmpty())
+    {
+        device = path;
+    }
+
+    return "/sys/bus/usb-serial/devices/" + QFileInfo(device).fileName() + "/latency_timer";
+}
+
+
+QLpcTcpTransport::QLpcTcpTransport(QObject *parent) :
+    QLpcTransport(parent)
+{
+}
+
+bool QLpcTcpTransport::open(const QString &name)
+{
+    QUrl url(name);
+
+    if ((url.host().isEmpty())||(url.port() <= 0))
+    {
+        return false;
+    }
+
+    m_socket.connectToHost(url.host(), url.port());
+
+    if (m_socket.waitForConnected(3000) == false)
+    {
+        return false;
+    }
+
+    // Every ISP command is a small request/response, don't let Nagle hold them back.
+    m_socket.setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+    return true;
+}
+
+QIODevice *QLpcTcpTransport::device()
+{
+    return &m_socket;
+}
+
+bool QLpcTcpTransport::canSetBaudRate() const
+{
+    return false;
+}
+
+bool QLpcTcpTransport::setBaudRate(int baudRate)
+{
+    Q_UNUSED(baudRate);
+
+    // Raw TCP has no way to reconfigure the terminal server port.
+    return false;
+}
+
+int QLpcTcpTransport::pipelineDepth() const
+{
+    return 4;
+}
+
+
+QLpcLoopbackDevice::QLpcLoopbackDevice(QObject *parent) :
+    QIODevice(parent),
+    m_peer(0)
+{
+}
+
+QLpcLoopbackDevice::~QLpcLoopbackDevice()
+{
+    disconnectPeer();
+
+    QMutexLocker locker(&loopbackListenersMutex);
+
+    foreach(QString name, loopbackListeners.keys())
+    {
+        if (loopbackListeners.value(name) == this)
+        {
+            loopbackListeners.remove(name);
+        }
+    }
+}
+
+void QLpcLoopbackDevice::connectTo(QLpcLoopbackDevice *peer)
+{
+    QMutexLocker locker(&loopbackLinkMutex);
+
+    disconnectPeer();
+
+    if (peer->m_peer)
+    {
+        peer->m_peer->m_peer = 0;
+    }
+
+    m_peer = peer;
+    peer->m_peer = this;
+}
+
+void QLpcLoopbackDevice::disconnectPeer()
+{
+    QMutexLocker locker(&loopbackLinkMutex);
+
+    if (m_peer)
+    {
+        m_peer->m_peer = 0;
+        m_peer = 0;
+    }
+}
+
+bool QLpcLoopbackDevice::isSequential() const
+{
+    return true;
+}
+
+qint64 QLpcLoopbackDevice::bytesAvailable() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_buffer.size() + QIODevice::bytesAvailable();
+}
+
+bool QLpcLoopbackDevice::waitForReadyRead(int msecs)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_buffer.isEmpty())
+    {
+        m_dataReady.wait(&m_mutex, (msecs < 0) ? ULONG_MAX : (unsigned long)msecs);
+    }
+
+    return !m_buffer.isEmpty();
+}
+
+bool QLpcLoopbackDevice::waitForBytesWritten(int msecs)
+{
+    Q_UNUSED(msecs);
+
+    return true;
+}
+
+qint64 QLpcLoopbackDevice::readData(char *data, qint64 maxSize)
+{
+    QMutexLocker locker(&m_mutex);
+
+    int size = (int)qMin(maxSize, (qint64)m_buffer.size());
+
+    memcpy(data, m_buffer.constData(), size);
+    m_buffer.remove(0, size);
+
+    return size;
+}
+
+qint64 QLpcLoopbackDevice::writeData(const char *data, qint64 size)
+{
+    QMutexLocker locker(&loopbackLinkMutex);
+
+    if (!m_peer)
+    {
+        setErrorString(tr("Loopback peer is not connected."));
+
+        return -1;
+    }
+
+    m_peer->push(data, size);
+
+    return size;
+}
+
+void QLpcLoopbackDevice::push(const char *data, qint64 size)
+{
+    m_mutex.lock();
+    m_buffer.append(data, (int)size);
+    m_dataReady.wakeAll();
+    m_mutex.unlock();
+
+    // A target living in this thread gets the chance to answer before the writer starts waiting.
+    QMetaObject::invokeMethod(this, "readyRead", (thread() == QThread::currentThread()) ? Qt::DirectConnection : Qt::QueuedConnection);
+}
+
+
+QLpcLoopbackTransport::QLpcLoopbackTransport(QObject *parent) :
+    QLpcTransport(parent)
+{
+}
+
+bool QLpcLoopbackTransport::open(const QString &name)
+{
+    QMutexLocker locker(&loopbackListenersMutex);
+
+    QLpcLoopbackDevice *target = loopbackListeners.value(name.mid(7)); // skip loop://
+
+    if (!target)
+    {
+        return false;
+    }
+
+    m_device.connectTo(target);
+
+    return m_device.open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+}
+
+void QLpcLoopbackTransport::close()
+{
+    m_device.disconnectPeer();
+    m_device.close();
+}
+
+QIODevice *QLpcLoopbackTransport::device()
+{
+    return &m_device;
+}
+
+// The returned device is the target end, whatever it reads was written by the host.
+QLpcLoopbackDevice *QLpcLoopbackTransport::listen(const QString &name, QObject *parent)
+{
+    QLpcLoopbackDevice *ret = new QLpcLoopbackDevice(parent);
+
+    ret->open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+
+    QMutexLocker locker(&loopbackListenersMutex);
+
+    loopbackListeners.insert(name, ret);
+
+    return ret;
+}
@@ -0,0 +1,133 @@
+#ifndef QLPCTRANSPORT_H
+#define QLPCTRANSPORT_H
+
+#include <qserialport.h>
+#include <QWaitCondition>
+#include <QTcpSocket>
+#include <QByteArray>
+#include <QIODevice>
+#include <QObject>
+#include <QMutex>
+
+// Byte stream to the bootloader. QLpcProg talks to the target only through this interface.
+class QLpcTransport : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcTransport(QObject *parent = 0);
+    virtual ~QLpcTransport();
+
+    virtual bool open(const QString &name) = 0;
+    virtual void close();
+    virtual QIODevice *device() = 0;
+
+    virtual bool canSetBaudRate() const;
+    virtual bool setBaudRate(int baudRate);
+    virtual bool setDataTerminalReady(bool set);
+    virtual bool setRequestToSend(bool set);
+    virtual bool setLowLatency(bool enable);
+    virtual int pipelineDepth() const;
+
+    bool isOpen();
+    qint64 write(const QByteArray &data);
+    QByteArray readAll();
+    bool waitForReadyRead(int msecs);
+    bool waitForBytesWritten(int msecs);
+    QString errorString();
+
+    static QLpcTransport *create(const QString &name, QObject *parent = 0);
+};
+
+// Local serial port. Name is the port name or system location.
+class QLpcSerialTransport : public QLpcTransport
+{
+    Q_OBJECT
+public:
+    explicit QLpcSerialTransport(QObject *parent = 0);
+
+    bool open(const QString &name);
+    void close();
+    QIODevice *device();
+
+    bool setBaudRate(int baudRate);
+    bool setDataTerminalReady(bool set);
+    bool setRequestToSend(bool set);
+    bool setLowLatency(bool enable);
+
+private:
+    QString latencyTimerFile();
+
+    QSerialPort m_port;
+    QString m_name;
+    bool m_lowLatency;
+    int m_savedSerialFlags;
+    QByteArray m_savedLatencyTimer;
+};
+
+// Raw TCP bridge to a terminal server(ser2net style). Name is tcp://host:port.
+// Baud rate and modem lines are configured on the terminal server side.
+class QLpcTcpTransport : public QLpcTransport
+{
+    Q_OBJECT
+public:
+    explicit QLpcTcpTransport(QObject *parent = 0);
+
+    bool open(const QString &name);
+    QIODevice *device();
+
+    bool canSetBaudRate() const;
+    bool setBaudRate(int baudRate);
+    int pipelineDepth() const;
+
+private:
+    QTcpSocket m_socket;
+};
+
+// One end of an in-process byte pipe. Safe to use from two threads.
+class QLpcLoopbackDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    explicit QLpcLoopbackDevice(QObject *parent = 0);
+    virtual ~QLpcLoopbackDevice();
+
+    void connectTo(QLpcLoopbackDevice *peer);
+    void disconnectPeer();
+
+    bool isSequential() const;
+    qint64 bytesAvailable() const;
+    bool waitForReadyRead(int msecs);
+    bool waitForBytesWritten(int msecs);
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 size);
+
+private:
+    void push(const char *data, qint64 size);
+
+    QLpcLoopbackDevice *m_peer;
+    QByteArray m_buffer;
+    mutable QMutex m_mutex;
+    QWaitCondition m_dataReady;
+};
+
+// In-process target for tests and simulators. Name is loop://name, the target side is
+// created with listen(name) before the transport is opened.
+class QLpcLoopbackTransport : public QLpcTransport
+{
+    Q_OBJECT
+public:
+    explicit QLpcLoopbackTransport(QObject *parent = 0);
+
+    bool open(const QString &name);
+    void close();
+    QIODevice *device();
+
+    static QLpcLoopbackDevice *listen(const QString &name, QObject *parent = 0);
+
+private:
+    QLpcLoopbackDevice m_device;
+};
+
+#endif // QLPCTRANSPORT_H
@@ -0,0 +1,207 @@
+#include "qlpcverify.h"
+#include "qlpcstubprog.h"
+
+// The first 64 bytes of sector 0 read as the boot block vectors while the bootloader runs,
+// so they are never compared.
+#define VECTORS_SIZE 64
+#define READ_CHUNK_SIZE 4096
+
+
+QLpcVerify::QLpcVerify(QLpcProg *prog, QLpcStubProg *stub, QObject *parent) :
+    QObject(parent),
+    m_prog(prog),
+    m_stub(stub),
+    m_status(QLpcProg::StatusNoError)
+{
+}
+
+// Compares every sector covered by the image, by CRC32 when the stub is running or by reading it
+// over ISP. Mismatching sectors are narrowed down to the first differing address. With fastFail
+// the run stops at the first bad sector.
+// Returns true when every checked sector matches.
+bool QLpcVerify::verify(const QByteArray &image, bool fastFail)
+{
+    int sectors = QLpcProg::sectorFromAddress(image.length() - 1) + 1;
+    bool ret = true;
+
+    m_results.clear();
+
+    if ((image.length() <= VECTORS_SIZE)||(sectors <= 0))
+    {
+        m_status = QLpcProg::StatusError;
+        m_statusText = tr("Image does not fit in flash.");
+
+        return false;
+    }
+
+    for(int sector = 0; sector < sectors; sector++)
+    {
+        SectorResult result;
+
+        emit progress((sector * 100) / sectors);
+
+        result.m_Sector = sector;
+        result.m_Start = (sector == 0) ? VECTORS_SIZE : QLpcProg::sectorAddress(sector);
+        result.m_Length = qMin(QLpcProg::sectorAddress(sector) + QLpcProg::sectorSize(sector), image.length()) - result.m_Start;
+        result.m_Offset = -1;
+
+        if ((m_stub)&&(m_stub->isRunning()))
+        {
+            quint32 crc = readCrc32(result.m_Start, result.m_Length);
+            if (m_status != QLpcProg::StatusNoError)
+            {
+                return false;
+            }
+
+            result.m_Match = (crc == QLpcProg::crc32(image.mid(result.m_Start, result.m_Length)));
+
+            if (!result.m_Match)
+            {
+                result.m_Offset = findMismatch(image, result.m_Start, result.m_Length);
+            }
+        }
+        else
+        {
+            // Over ISP a CRC would be worked out from the data read anyway, the data is compared
+            // as it comes in and the first difference is known without reading anything again.
+            result.m_Offset = readMismatch(image, result.m_Start, result.m_Length);
+            result.m_Match = (result.m_Offset < 0);
+        }
+
+        if (m_status != QLpcProg::StatusNoError)
+        {
+            return false;
+        }
+
+        if (!result.m_Match)
+        {
+            ret = false;
+        }
+
+        m_results.append(result);
+
+        if ((!ret)&&(fastFail))
+        {
+            break;
+        }
+    }
+
+    emit progress(100);
+
+    return ret;
+}
+
+QList<QLpcVerify::SectorResult> QLpcVerify::results() const
+{
+    return m_results;
+}
+
+QStringList QLpcVerify::resultText() const
+{
+    QStringList ret;
+
+    foreach(SectorResult result, m_results)
+    {
+        QString range = QString("%1-%2").arg(result.m_Start, 5, 16, QChar('0')).arg(result.m_Start + result.m_Length - 1, 5, 16, QChar('0')).toUpper();
+
+        if (result.m_Match)
+        {
+            ret.append(tr("Sector %1 (%2): OK").arg(result.m_Sector, 2).arg(range));
+        }
+        else
+        {
+            ret.append(tr("Sector %1 (%2): MISMATCH at %3").arg(result.m_Sector, 2).arg(range).arg(QString::number(result.m_Offset, 16).toUpper()));
+        }
+    }
+
+    return ret;
+}
+
+int QLpcVerify::firstMismatch() const
+{
+    foreach(SectorResult result, m_results)
+    {
+        if (!result.m_Match)
+        {
+            return result.m_Offset;
+        }
+    }
+
+    return -1;
+}
+
+QLpcProg::Status QLpcVerify::getStatus()
+{
+    return m_status;
+}
+
+QString QLpcVerify::getStatusText()
+{
+    return m_statusText;
+}
+
+quint32 QLpcVerify::readCrc32(int offset, int length)
+{
+    quint32 ret = m_stub->readCrc32(offset, length);
+
+    m_status = m_stub->getStatus();
+    m_statusText = m_stub->getStatusText();
+
+    return ret;
+}
+
+// Reads the range over ISP, returns the first differing address or -1. Reading stops there.
+int QLpcVerify::readMismatch(const QByteArray &image, int start, int length)
+{
+    for(int pos = start; pos < start + length; pos += READ_CHUNK_SIZE)
+    {
+        int size = qMin(READ_CHUNK_SIZE, start + length - pos);
+
+        QByteArray data = m_prog->readMemory(pos, (size + 3) & ~3);
+
+        m_status = m_prog->getStatus();
+        m_statusText = m_prog->getStatusText();
+
+        if (m_status != QLpcProg::StatusNoError)
+        {
+            return -1;
+        }
+
+        for(int c = 0; c < size; c++)
+        {
+            if (data.at(c) != image.at(pos + c))
+            {
+                return pos + c;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// The stub only returns CRCs, halve the range until one byte is left.
+int QLpcVerify::findMismatch(const QByteArray &image, int start, int length)
+{
+    while(length > 1)
+    {
+        int half = length / 2;
+
+        quint32 crc = readCrc32(start, half);
+        if (m_status != QLpcProg::StatusNoError)
+        {
+            return -1;
+        }
+
+        if (crc == QLpcProg::crc32(image.mid(start, half)))
+        {
+            start += half;
+            length -= half;
+        }
+        else
+        {
+            length = half;
+        }
+    }
+
+    return start;
+}
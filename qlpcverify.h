@@ -0,0 +1,51 @@
+#ifndef QLPCVERIFY_H
+#define QLPCVERIFY_H
+
+#include "qlpcprog.h"
+
+#include <QByteArray>
+#include <QObject>
+#include <QList>
+
+class QLpcStubProg;
+
+// Verifies a whole image sector by sector and keeps a pass/fail map.
+class QLpcVerify : public QObject
+{
+    Q_OBJECT
+public:
+    struct SectorResult {
+        int m_Sector;
+        int m_Start;
+        int m_Length;
+        bool m_Match;
+        int m_Offset; // First differing address, -1 if the sector matches.
+    };
+
+    explicit QLpcVerify(QLpcProg *prog, QLpcStubProg *stub = 0, QObject *parent = 0);
+
+    bool verify(const QByteArray &image, bool fastFail = true);
+
+    QList<SectorResult> results() const;
+    QStringList resultText() const;
+    int firstMismatch() const;
+
+    QLpcProg::Status getStatus();
+    QString getStatusText();
+
+signals:
+    void progress(int percent);
+
+private:
+    quint32 readCrc32(int offset, int length);
+    int readMismatch(const QByteArray &image, int start, int length);
+    int findMismatch(const QByteArray &image, int start, int length);
+
+    QLpcProg *m_prog;
+    QLpcStubProg *m_stub;
+    QList<SectorResult> m_results;
+    QLpcProg::Status m_status;
+    QString m_statusText;
+};
+
+#endif // QLPCVERIFY_H
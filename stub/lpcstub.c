@@ -0,0 +1,388 @@
+// Flash loader stub for LPC214x, the target side of the protocol described in qlpcstubprog.cpp.
+//
+// It talks over UART0 with the line settings and baud rate the ISP session left behind and
+// programs the flash through IAP. All state lives on the stack(see lpcstub.ld).
+
+#include <stdint.h>
+
+#define REG(address) (*(volatile uint32_t *)(address))
+
+#define U0RBR REG(0xE000C000)
+#define U0THR REG(0xE000C000)
+#define U0DLL REG(0xE000C000)
+#define U0DLM REG(0xE000C004)
+#define U0LCR REG(0xE000C00C)
+#define U0LSR REG(0xE000C014)
+#define U0FDR REG(0xE000C028)
+#define MEMMAP REG(0xE01FC040)
+#define PLLSTAT REG(0xE01FC088)
+#define VPBDIV REG(0xE01FC100)
+
+#define LSR_RDR 0x01
+#define LSR_THRE 0x20
+#define LSR_TEMT 0x40
+#define LCR_DLAB 0x80
+
+#define IAP_ENTRY 0x7FFFFFF1
+#define IAP_PREPARE 50
+#define IAP_COPY 51
+#define IAP_ERASE 52
+#define IAP_INVALID_COMMAND 1
+#define IAP_COUNT_ERROR 6
+
+#define STUB_VERSION 2
+#define STUB_CRC_ERROR 0xFF
+#define STUB_BAUD_ERROR 0xFE
+#define STUB_BLOCK_SIZE 4096
+#define STUB_BYTE_TIMEOUT 20 // ms between the bytes of a frame.
+
+typedef void (*IapEntry)(uint32_t *command, uint32_t *result);
+
+struct Stub {
+    uint32_t m_Crystal; // KHz
+    uint32_t m_Cclk; // KHz
+    uint32_t m_Pclk; // KHz
+    int m_HasReply;
+    uint8_t m_Reply[10];
+};
+
+extern uint8_t _buffer[];
+
+static const uint32_t crcTable[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static const char banner[] = "LPCSTUB\r\n";
+
+// Same CRC32 as QLpcProg::crc32, a nibble at a time to keep the table small.
+static uint32_t crc32(const uint8_t *data, uint32_t length, uint32_t crc)
+{
+    crc = ~crc;
+
+    while(length--)
+    {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ crcTable[crc & 15];
+        crc = (crc >> 4) ^ crcTable[crc & 15];
+    }
+
+    return ~crc;
+}
+
+static uint32_t wordAt(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void setWord(uint8_t *data, uint32_t value)
+{
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = (value >> 16) & 0xFF;
+    data[3] = (value >> 24) & 0xFF;
+}
+
+// The ISP session runs from the crystal unless the bootloader connected the PLL.
+static void updateClocks(struct Stub *stub)
+{
+    stub->m_Cclk = stub->m_Crystal;
+
+    if ((PLLSTAT & 0x300) == 0x300)
+    {
+        stub->m_Cclk *= (PLLSTAT & 0x1F) + 1;
+    }
+
+    switch(VPBDIV & 3)
+    {
+    case 1:
+        stub->m_Pclk = stub->m_Cclk;
+        break;
+    case 2:
+        stub->m_Pclk = stub->m_Cclk / 2;
+        break;
+    default:
+        stub->m_Pclk = stub->m_Cclk / 4;
+        break;
+    }
+}
+
+static void putChar(uint8_t value)
+{
+    while(!(U0LSR & LSR_THRE));
+
+    U0THR = value;
+}
+
+static void write(const uint8_t *data, int length)
+{
+    while(length--)
+    {
+        putChar(*data++);
+    }
+}
+
+// Returns -1 after timeout ms without a byte, 0 waits forever. The loop takes roughly 8 cycles.
+static int getChar(const struct Stub *stub, uint32_t timeout)
+{
+    uint32_t count = timeout * stub->m_Cclk * (1000 / 8);
+
+    while(!(U0LSR & LSR_RDR))
+    {
+        if ((timeout)&&(count-- == 0))
+        {
+            return -1;
+        }
+    }
+
+    return U0RBR & 0xFF;
+}
+
+static int read(const struct Stub *stub, uint8_t *data, uint32_t length)
+{
+    while(length--)
+    {
+        int value = getChar(stub, STUB_BYTE_TIMEOUT);
+
+        if (value < 0)
+        {
+            return 0;
+        }
+
+        *data++ = value;
+    }
+
+    return 1;
+}
+
+// Whatever is left of a damaged frame is dropped, the host sends it again.
+static void drain(const struct Stub *stub)
+{
+    while(getChar(stub, STUB_BYTE_TIMEOUT) >= 0);
+}
+
+static void sendReply(uint8_t *reply, uint8_t status, uint8_t sequence, uint32_t value)
+{
+    reply[0] = status;
+    reply[1] = sequence;
+    setWord(reply + 2, value);
+    setWord(reply + 6, crc32(reply, 6, 0));
+
+    write(reply, 10);
+}
+
+static uint32_t iap(uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+    uint32_t parameters[5] = {command, arg0, arg1, arg2, arg3};
+    uint32_t result[3];
+
+    ((IapEntry)IAP_ENTRY)(parameters, result);
+
+    return result[0];
+}
+
+// LPC214x: 8 x 4KB, 14 x 32KB and 5 x 4KB sectors.
+static uint32_t sectorFromAddress(uint32_t address)
+{
+    if (address < 0x8000)
+    {
+        return address / 0x1000;
+    }
+
+    if (address < 0x78000)
+    {
+        return 8 + ((address - 0x8000) / 0x8000);
+    }
+
+    return 22 + ((address - 0x78000) / 0x1000);
+}
+
+static uint32_t erase(const struct Stub *stub, uint32_t start, uint32_t end)
+{
+    uint32_t status = iap(IAP_PREPARE, start, end, 0, 0);
+
+    if (status)
+    {
+        return status;
+    }
+
+    return iap(IAP_ERASE, start, end, stub->m_Cclk, 0);
+}
+
+static uint32_t program(const struct Stub *stub, uint32_t address, uint32_t length)
+{
+    uint32_t status;
+
+    if ((length != 256)&&(length != 512)&&(length != 1024)&&(length != 4096))
+    {
+        return IAP_COUNT_ERROR;
+    }
+
+    status = iap(IAP_PREPARE, sectorFromAddress(address), sectorFromAddress(address + length - 1), 0, 0);
+    if (status)
+    {
+        return status;
+    }
+
+    return iap(IAP_COPY, address, (uint32_t)_buffer, length, stub->m_Cclk);
+}
+
+// Divisor for the new rate, 0 when the error would be over 3%.
+static uint32_t baudDivisor(const struct Stub *stub, uint32_t baudRate)
+{
+    uint32_t pclk = stub->m_Pclk * 1000;
+    uint32_t divisor;
+    uint32_t actual;
+
+    if (baudRate == 0)
+    {
+        return 0;
+    }
+
+    divisor = (pclk + baudRate * 8) / (baudRate * 16);
+    if ((divisor == 0)||(divisor > 0xFFFF))
+    {
+        return 0;
+    }
+
+    actual = pclk / (divisor * 16);
+    if (((actual > baudRate) ? actual - baudRate : baudRate - actual) * 100 > baudRate * 3)
+    {
+        return 0;
+    }
+
+    return divisor;
+}
+
+static void setBaudDivisor(uint32_t divisor)
+{
+    uint32_t lcr = U0LCR;
+
+    // The reply has to leave with the old rate.
+    while(!(U0LSR & LSR_TEMT));
+
+    U0LCR = lcr | LCR_DLAB;
+    U0DLL = divisor & 0xFF;
+    U0DLM = (divisor >> 8) & 0xFF;
+    U0FDR = 0x10;
+    U0LCR = lcr & ~LCR_DLAB;
+}
+
+int main(void)
+{
+    struct Stub stub;
+    uint8_t header[14];
+    uint8_t crc[4];
+    uint8_t reply[10];
+
+    stub.m_Crystal = 12000;
+    stub.m_HasReply = 0;
+    updateClocks(&stub);
+
+    // Flash vectors at 0, V reads them like the rest of the image.
+    MEMMAP = 1;
+
+    write((const uint8_t *)banner, sizeof(banner) - 1);
+
+    for(;;)
+    {
+        uint8_t command;
+        uint8_t sequence;
+        uint32_t arg0;
+        uint32_t arg1;
+        uint32_t length;
+        uint32_t status = 0;
+        uint32_t value = 0;
+        uint32_t divisor = 0;
+
+        header[0] = getChar(&stub, 0);
+        header[1] = 0;
+
+        if ((!read(&stub, header + 1, 13))||(wordAt(header + 10) > STUB_BLOCK_SIZE))
+        {
+            drain(&stub);
+            sendReply(reply, STUB_CRC_ERROR, header[1], 0);
+
+            continue;
+        }
+
+        command = header[0];
+        sequence = header[1];
+        arg0 = wordAt(header + 2);
+        arg1 = wordAt(header + 6);
+        length = wordAt(header + 10);
+
+        if ((!read(&stub, _buffer, length))||(!read(&stub, crc, 4))||(wordAt(crc) != crc32(_buffer, length, crc32(header, 14, 0))))
+        {
+            drain(&stub);
+            sendReply(reply, STUB_CRC_ERROR, sequence, 0);
+
+            continue;
+        }
+
+        // Resent because the reply got lost, the command already ran.
+        if ((stub.m_HasReply)&&(stub.m_Reply[1] == sequence))
+        {
+            write(stub.m_Reply, 10);
+
+            continue;
+        }
+
+        switch(command)
+        {
+        case 'S':
+            if (arg0)
+            {
+                stub.m_Crystal = arg0;
+                updateClocks(&stub);
+            }
+
+            value = STUB_VERSION;
+            break;
+
+        case 'B':
+            divisor = baudDivisor(&stub, arg0);
+            if (divisor == 0)
+            {
+                status = STUB_BAUD_ERROR;
+            }
+            break;
+
+        case 'E':
+            status = erase(&stub, arg0, arg1);
+            break;
+
+        case 'W':
+            status = program(&stub, arg0, length);
+            break;
+
+        case 'V':
+            value = crc32((const uint8_t *)arg0, arg1, 0);
+            break;
+
+        case 'G':
+            break;
+
+        default:
+            status = IAP_INVALID_COMMAND;
+            break;
+        }
+
+        sendReply(stub.m_Reply, status, sequence, value);
+        stub.m_HasReply = 1;
+
+        if (divisor)
+        {
+            setBaudDivisor(divisor);
+        }
+
+        if ((command == 'G')&&(status == 0))
+        {
+            while(!(U0LSR & LSR_TEMT));
+
+            ((void (*)(void))arg0)();
+        }
+    }
+
+    return 0;
+}
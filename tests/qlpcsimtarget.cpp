@@ -0,0 +1,774 @@
+#include "qlpcsimtarget.h"
+#include "qlpctransport.h"
+
+#include <QMetaObject>
+
+#define RAM_START 0x40000000
+#define FLASH_SIZE 0x80000
+#define UU_GROUP_SIZE 900
+#define STUB_LOAD_ADDRESS 1073742336
+#define STUB_VERSION 2
+#define STUB_CRC_ERROR 0xFF
+#define STUB_BLOCK_SIZE 4096
+
+
+QLpcSimTarget::QLpcSimTarget(const QString &name, int partID) :
+    QObject(0),
+    m_owner(QThread::currentThread()),
+    m_device(0),
+    m_mode(ModeAutobaud),
+    m_partID(partID),
+    m_echo(true),
+    m_dropReply(false),
+    m_flash(FLASH_SIZE, (char)0xFF),
+    m_ram(QLpcProg::ramSize(partID), 0),
+    m_preparedStart(-1),
+    m_preparedEnd(-1),
+    m_transferAddress(0),
+    m_transferLength(0),
+    m_transferDone(0),
+    m_writeResends(0),
+    m_readChecksumErrors(0),
+    m_writeResendCount(0),
+    m_readResendCount(0),
+    m_stubEnabled(false),
+    m_stubFrameErrors(0),
+    m_stubReplyErrors(0)
+{
+    m_device = QLpcLoopbackTransport::listen(name, this);
+
+    connect(m_device, SIGNAL(readyRead()), this, SLOT(readyRead()));
+
+    moveToThread(&m_thread);
+    m_thread.start();
+}
+
+QLpcSimTarget::~QLpcSimTarget()
+{
+    // Back to the owner's thread, so the device isn't deleted from under a running thread.
+    QMetaObject::invokeMethod(this, "detach", Qt::BlockingQueuedConnection);
+
+    m_thread.quit();
+    m_thread.wait();
+}
+
+void QLpcSimTarget::setFlash(int address, const QByteArray &data)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_flash.replace(address, data.length(), data);
+}
+
+QByteArray QLpcSimTarget::flash(int address, int length)
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_flash.mid(address, length);
+}
+
+QByteArray QLpcSimTarget::ram(quint32 address, int length)
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_ram.mid(address - RAM_START, length);
+}
+
+// The next count checksums of W are answered with RESEND.
+void QLpcSimTarget::setWriteResends(int count)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_writeResends = count;
+}
+
+// The next count groups of R are sent with a wrong checksum.
+void QLpcSimTarget::setReadChecksumErrors(int count)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_readChecksumErrors = count;
+}
+
+// The command runs, its reply is lost.
+void QLpcSimTarget::setDropReplies(char command, int count)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_dropReplies.insert(command, count);
+}
+
+// The command is lost on the way, nothing runs and nothing is sent back.
+void QLpcSimTarget::setIgnoreCommands(char command, int count)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_ignoreCommands.insert(command, count);
+}
+
+// Every following command is answered with code without running, 0 clears it.
+void QLpcSimTarget::setReturnCode(char command, int code)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_returnCodes.insert(command, code);
+}
+
+void QLpcSimTarget::setStubEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_stubEnabled = enabled;
+}
+
+// The next count stub frames arrive damaged and are answered with STUB_CRC_ERROR.
+void QLpcSimTarget::setStubFrameErrors(int count)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_stubFrameErrors = count;
+}
+
+// The command runs, the next count stub replies arrive with a wrong CRC.
+void QLpcSimTarget::setStubReplyErrors(int count)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_stubReplyErrors = count;
+}
+
+int QLpcSimTarget::commandCount(char command)
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_commandCounts.value(command);
+}
+
+// Number of C commands that wrote to flash at address.
+int QLpcSimTarget::programCount(int address)
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_programCounts.value(address);
+}
+
+int QLpcSimTarget::writeResends()
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_writeResendCount;
+}
+
+int QLpcSimTarget::readResends()
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_readResendCount;
+}
+
+// Number of stub commands that ran, replayed replies don't count.
+int QLpcSimTarget::stubCommandCount(char command)
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_stubCommandCounts.value(command);
+}
+
+void QLpcSimTarget::detach()
+{
+    moveToThread(m_owner);
+}
+
+void QLpcSimTarget::readyRead()
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_rxBuffer.append(m_device->readAll());
+
+    if (m_mode == ModeStub)
+    {
+        processStubFrames();
+
+        return;
+    }
+
+    if (m_mode == ModeAutobaud)
+    {
+        int pos = m_rxBuffer.indexOf('?');
+
+        // Anything before the first ? is lost in autobaud.
+        if (pos < 0)
+        {
+            m_rxBuffer.clear();
+
+            return;
+        }
+
+        m_rxBuffer.remove(0, pos + 1);
+        m_mode = ModeSynchronized;
+
+        send("Synchronized\r\n");
+    }
+
+    for(int pos = m_rxBuffer.indexOf('\n'); pos >= 0; pos = m_rxBuffer.indexOf('\n'))
+    {
+        QByteArray line = m_rxBuffer.left(pos);
+
+        m_rxBuffer.remove(0, pos + 1);
+
+        if (line.endsWith('\r'))
+        {
+            line.chop(1);
+        }
+
+        processLine(line);
+
+        // G started the stub, the rest is frames.
+        if (m_mode == ModeStub)
+        {
+            processStubFrames();
+
+            return;
+        }
+    }
+}
+
+void QLpcSimTarget::processLine(const QByteArray &line)
+{
+    switch(m_mode)
+    {
+    case ModeSynchronized:
+        {
+            QByteArray text = line;
+
+            // Questions sent while the answer was on the way.
+            while(text.startsWith('?'))
+            {
+                text.remove(0, 1);
+            }
+
+            if (text != "Synchronized")
+            {
+                m_mode = ModeAutobaud;
+                m_rxBuffer.clear();
+
+                return;
+            }
+
+            send(text + "\r\nOK\r\n");
+            m_mode = ModeCrystal;
+        }
+        break;
+
+    case ModeCrystal:
+        send(line + "\r\nOK\r\n");
+        m_mode = ModeCommand;
+        break;
+
+    case ModeCommand:
+        processCommand(line);
+        break;
+
+    case ModeWrite:
+        processWriteLine(line);
+        break;
+
+    case ModeRead:
+        processReadAnswer(line);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void QLpcSimTarget::processCommand(const QByteArray &line)
+{
+    QList<QByteArray> args = line.split(' ');
+    QByteArray name = args.takeFirst();
+
+    if (name.isEmpty())
+    {
+        return;
+    }
+
+    char command = name.at(0);
+    quint32 arg0 = args.value(0).toUInt();
+    quint32 arg1 = args.value(1).toUInt();
+    quint32 arg2 = args.value(2).toUInt();
+
+    m_commandCounts[command]++;
+    m_dropReply = false;
+
+    if (m_ignoreCommands.value(command) > 0)
+    {
+        m_ignoreCommands[command]--;
+
+        return;
+    }
+
+    // A is answered without echo.
+    if ((m_echo)&&(command != 'A'))
+    {
+        send(line + "\r\n");
+    }
+
+    if (m_dropReplies.value(command) > 0)
+    {
+        m_dropReplies[command]--;
+        m_dropReply = true;
+    }
+
+    if (m_returnCodes.value(command) != 0)
+    {
+        reply(QList<QByteArray>() << QByteArray::number(m_returnCodes.value(command)));
+
+        return;
+    }
+
+    switch(command)
+    {
+    case 'A':
+        m_echo = (arg0 == 1);
+        reply(QList<QByteArray>() << "0");
+        break;
+
+    case 'J':
+        reply(QList<QByteArray>() << "0" << QByteArray::number(m_partID));
+        break;
+
+    case 'K':
+        reply(QList<QByteArray>() << "0" << "12" << "2");
+        break;
+
+    case 'N':
+        reply(QList<QByteArray>() << "0" << "305419896" << "2596069104" << "19088743" << "4275878552");
+        break;
+
+    case 'U':
+    case 'B':
+        reply(QList<QByteArray>() << "0");
+        break;
+
+    case 'G':
+        reply(QList<QByteArray>() << "0");
+
+        if ((m_stubEnabled)&&(arg0 == STUB_LOAD_ADDRESS))
+        {
+            m_mode = ModeStub;
+            m_stubReply.clear();
+            send("LPCSTUB\r\n");
+        }
+        break;
+
+    case 'P':
+        if ((arg1 < arg0)||((int)arg1 >= QLpcProg::sectorCount(m_partID)))
+        {
+            reply(QList<QByteArray>() << "7"); // INVALID_SECTOR
+            break;
+        }
+
+        m_preparedStart = arg0;
+        m_preparedEnd = arg1;
+        reply(QList<QByteArray>() << "0");
+        break;
+
+    case 'E':
+        if (!isPrepared(arg0, arg1))
+        {
+            reply(QList<QByteArray>() << "9"); // SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION
+            break;
+        }
+
+        for(int sector = arg0; sector <= (int)arg1; sector++)
+        {
+            m_flash.replace(QLpcProg::sectorAddress(sector), QLpcProg::sectorSize(sector), QByteArray(QLpcProg::sectorSize(sector), (char)0xFF));
+        }
+
+        m_preparedStart = -1;
+        m_preparedEnd = -1;
+        reply(QList<QByteArray>() << "0");
+        break;
+
+    case 'I':
+        for(int sector = arg0; sector <= (int)arg1; sector++)
+        {
+            QByteArray data = m_flash.mid(QLpcProg::sectorAddress(sector), QLpcProg::sectorSize(sector));
+
+            for(int c = 0; c < data.length(); c += 4)
+            {
+                if (data.mid(c, 4) != QByteArray(4, (char)0xFF))
+                {
+                    reply(QList<QByteArray>() << "8" << QByteArray::number(QLpcProg::sectorAddress(sector) + c) << QByteArray::number((quint32)(quint8)data.at(c)));
+
+                    return;
+                }
+            }
+        }
+
+        reply(QList<QByteArray>() << "0");
+        break;
+
+    case 'W':
+        if ((arg0 < RAM_START)||(arg0 + arg1 > RAM_START + (quint32)m_ram.length())||(arg1 % 4))
+        {
+            reply(QList<QByteArray>() << "4"); // DST_ADDR_NOT_MAPPED
+            break;
+        }
+
+        m_transferAddress = arg0;
+        m_transferLength = arg1;
+        m_transferDone = 0;
+        m_group.clear();
+        m_mode = ModeWrite;
+        reply(QList<QByteArray>() << "0");
+        break;
+
+    case 'R':
+        m_transferAddress = arg0;
+        m_transferLength = arg1;
+        m_transferDone = 0;
+        m_mode = ModeRead;
+        reply(QList<QByteArray>() << "0");
+        sendReadGroup();
+        break;
+
+    case 'C':
+        if (!isPrepared(QLpcProg::sectorFromAddress(arg0), QLpcProg::sectorFromAddress(arg0 + arg2 - 1)))
+        {
+            reply(QList<QByteArray>() << "9");
+            break;
+        }
+
+        program(arg0, memory(arg1, arg2));
+
+        m_preparedStart = -1;
+        m_preparedEnd = -1;
+        reply(QList<QByteArray>() << "0");
+        break;
+
+    case 'M':
+        {
+            QByteArray a = memory(arg0, arg2);
+            QByteArray b = memory(arg1, arg2);
+
+            for(int c = 0; c < a.length(); c++)
+            {
+                if (a.at(c) != b.at(c))
+                {
+                    reply(QList<QByteArray>() << "10" << QByteArray::number(c & ~3)); // COMPARE_ERROR
+
+                    return;
+                }
+            }
+
+            reply(QList<QByteArray>() << "0");
+        }
+        break;
+
+    default:
+        reply(QList<QByteArray>() << "1"); // INVALID_COMMAND
+        break;
+    }
+}
+
+// Every 20 lines(900 bytes), and after the last line, comes a checksum answered with OK or RESEND.
+void QLpcSimTarget::processWriteLine(const QByteArray &line)
+{
+    int length = qMin(UU_GROUP_SIZE, m_transferLength - m_transferDone);
+    bool ok;
+
+    m_dropReply = false;
+
+    if (m_echo)
+    {
+        send(line + "\r\n");
+    }
+
+    if (m_group.length() < length)
+    {
+        m_group.append(decodeUULine(line));
+
+        return;
+    }
+
+    int checksum = line.toInt(&ok);
+
+    if ((m_writeResends > 0)||(!ok)||(checksum != QLpcProg::encodeUUCheckSum(m_group.left(length))))
+    {
+        if (m_writeResends > 0)
+        {
+            m_writeResends--;
+        }
+
+        m_writeResendCount++;
+        m_group.clear();
+        reply(QList<QByteArray>() << "RESEND");
+
+        return;
+    }
+
+    m_ram.replace(m_transferAddress - RAM_START + m_transferDone, length, m_group.left(length));
+    m_transferDone += length;
+    m_group.clear();
+
+    if (m_transferDone >= m_transferLength)
+    {
+        m_mode = ModeCommand;
+    }
+
+    reply(QList<QByteArray>() << "OK");
+}
+
+void QLpcSimTarget::processReadAnswer(const QByteArray &line)
+{
+    if (m_echo)
+    {
+        send(line + "\r\n");
+    }
+
+    if (line == "RESEND")
+    {
+        m_readResendCount++;
+        sendReadGroup();
+
+        return;
+    }
+
+    m_transferDone += qMin(UU_GROUP_SIZE, m_transferLength - m_transferDone);
+
+    if (m_transferDone >= m_transferLength)
+    {
+        m_mode = ModeCommand;
+
+        return;
+    }
+
+    sendReadGroup();
+}
+
+void QLpcSimTarget::sendReadGroup()
+{
+    QByteArray group = memory(m_transferAddress + m_transferDone, qMin(UU_GROUP_SIZE, m_transferLength - m_transferDone));
+    QByteArray block = QLpcProg::encodeUUBlock(group);
+
+    if (m_readChecksumErrors > 0)
+    {
+        m_readChecksumErrors--;
+
+        block = block.left(block.lastIndexOf('\n', block.length() - 2) + 1);
+        block.append(QByteArray::number(QLpcProg::encodeUUCheckSum(group) + 1) + "\r\n");
+    }
+
+    send(block);
+}
+
+static void appendWord(QByteArray &data, quint32 value)
+{
+    data.append((char)(value & 0xFF));
+    data.append((char)((value >> 8) & 0xFF));
+    data.append((char)((value >> 16) & 0xFF));
+    data.append((char)((value >> 24) & 0xFF));
+}
+
+static quint32 wordAt(const QByteArray &data, int pos)
+{
+    return (quint8)data.at(pos) | ((quint8)data.at(pos + 1) << 8) | ((quint8)data.at(pos + 2) << 16) | ((quint32)(quint8)data.at(pos + 3) << 24);
+}
+
+// Like the stub, a damaged frame is dropped with whatever came after it.
+void QLpcSimTarget::processStubFrames()
+{
+    while(m_rxBuffer.length() >= 14)
+    {
+        quint8 sequence = (quint8)m_rxBuffer.at(1);
+        int length = (int)wordAt(m_rxBuffer, 10);
+
+        if (length > STUB_BLOCK_SIZE)
+        {
+            m_rxBuffer.clear();
+            send(stubReply(STUB_CRC_ERROR, sequence, 0));
+
+            return;
+        }
+
+        if (m_rxBuffer.length() < 14 + length + 4)
+        {
+            return;
+        }
+
+        QByteArray frame = m_rxBuffer.left(14 + length);
+        quint32 crc = wordAt(m_rxBuffer, 14 + length);
+
+        m_rxBuffer.remove(0, 14 + length + 4);
+
+        if ((m_stubFrameErrors > 0)||(crc != QLpcProg::crc32(frame)))
+        {
+            if (m_stubFrameErrors > 0)
+            {
+                m_stubFrameErrors--;
+            }
+
+            m_rxBuffer.clear();
+            send(stubReply(STUB_CRC_ERROR, sequence, 0));
+
+            return;
+        }
+
+        // Resent because the reply got lost, the command already ran.
+        if ((!m_stubReply.isEmpty())&&((quint8)m_stubReply.at(1) == sequence))
+        {
+            send(m_stubReply);
+
+            continue;
+        }
+
+        processStubCommand(frame.at(0), sequence, wordAt(frame, 2), wordAt(frame, 6), frame.mid(14));
+    }
+}
+
+void QLpcSimTarget::processStubCommand(char command, quint8 sequence, quint32 arg0, quint32 arg1, const QByteArray &payload)
+{
+    quint8 status = 0;
+    quint32 value = 0;
+
+    m_stubCommandCounts[command]++;
+
+    switch(command)
+    {
+    case 'S':
+        value = STUB_VERSION;
+        break;
+
+    case 'B':
+        break;
+
+    case 'E':
+        if ((arg1 < arg0)||((int)arg1 >= QLpcProg::sectorCount(m_partID)))
+        {
+            status = 7; // INVALID_SECTOR
+            break;
+        }
+
+        for(int sector = arg0; sector <= (int)arg1; sector++)
+        {
+            m_flash.replace(QLpcProg::sectorAddress(sector), QLpcProg::sectorSize(sector), QByteArray(QLpcProg::sectorSize(sector), (char)0xFF));
+        }
+        break;
+
+    case 'W':
+        if ((payload.length() != 256)&&(payload.length() != 512)&&(payload.length() != 1024)&&(payload.length() != 4096))
+        {
+            status = 6; // COUNT_ERROR
+            break;
+        }
+
+        program(arg0, payload);
+        break;
+
+    case 'V':
+        value = QLpcProg::crc32(memory(arg0, arg1));
+        break;
+
+    case 'G':
+        m_mode = ModeAutobaud;
+        break;
+
+    default:
+        status = 1; // INVALID_COMMAND
+        break;
+    }
+
+    QByteArray reply = stubReply(status, sequence, value);
+
+    m_stubReply = reply;
+
+    if (m_stubReplyErrors > 0)
+    {
+        m_stubReplyErrors--;
+        reply[9] = reply.at(9) ^ 0xFF;
+    }
+
+    send(reply);
+}
+
+QByteArray QLpcSimTarget::stubReply(quint8 status, quint8 sequence, quint32 value)
+{
+    QByteArray ret;
+
+    ret.append((char)status);
+    ret.append((char)sequence);
+    appendWord(ret, value);
+    appendWord(ret, QLpcProg::crc32(ret));
+
+    return ret;
+}
+
+void QLpcSimTarget::reply(const QList<QByteArray> &lines)
+{
+    if (m_dropReply)
+    {
+        return;
+    }
+
+    foreach(QByteArray line, lines)
+    {
+        send(line + "\r\n");
+    }
+}
+
+void QLpcSimTarget::send(const QByteArray &data)
+{
+    m_device->write(data);
+}
+
+QByteArray QLpcSimTarget::memory(quint32 address, int length)
+{
+    if (address >= RAM_START)
+    {
+        return m_ram.mid(address - RAM_START, length);
+    }
+
+    return m_flash.mid(address, length);
+}
+
+bool QLpcSimTarget::isPrepared(int startSector, int endSector)
+{
+    return (m_preparedStart >= 0)&&(startSector >= m_preparedStart)&&(endSector <= m_preparedEnd);
+}
+
+// Flash bits only go from 1 to 0 without an erase.
+void QLpcSimTarget::program(int address, const QByteArray &data)
+{
+    for(int c = 0; c < data.length(); c++)
+    {
+        m_flash[address + c] = m_flash.at(address + c) & data.at(c);
+    }
+
+    m_programCounts[address]++;
+}
+
+QByteArray QLpcSimTarget::decodeUULine(const QByteArray &line)
+{
+    QByteArray ret;
+
+    if (line.isEmpty())
+    {
+        return ret;
+    }
+
+    int length = (line.at(0) - 32) & 0x3F;
+
+    for(int pos = 1; pos + 3 < line.length(); pos += 4)
+    {
+        unsigned char c0 = (line.at(pos) - 32) & 0x3F;
+        unsigned char c1 = (line.at(pos + 1) - 32) & 0x3F;
+        unsigned char c2 = (line.at(pos + 2) - 32) & 0x3F;
+        unsigned char c3 = (line.at(pos + 3) - 32) & 0x3F;
+
+        ret.append((char)((c0 << 2)|(c1 >> 4)));
+        ret.append((char)((c1 << 4)|(c2 >> 2)));
+        ret.append((char)((c2 << 6)|c3));
+    }
+
+    return ret.left(length);
+}
@@ -0,0 +1,106 @@
+#ifndef QLPCSIMTARGET_H
+#define QLPCSIMTARGET_H
+
+#include "qlpcprog.h"
+
+#include <QByteArray>
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QList>
+#include <QMap>
+
+class QLpcLoopbackDevice;
+
+// LPC214x ISP bootloader behind loop://name, with echo on after synchronization like the real
+// one. It runs on its own thread so the blocking QLpcProg can wait for it. Faults are armed per
+// command and used up one at a time. With the stub enabled, G to the stub load address starts
+// the flash loader stub protocol(stub/lpcstub.c) instead of running the code.
+class QLpcSimTarget : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QLpcSimTarget(const QString &name, int partID = QLpcProg::LPC2148);
+    virtual ~QLpcSimTarget();
+
+    void setFlash(int address, const QByteArray &data);
+    QByteArray flash(int address, int length);
+    QByteArray ram(quint32 address, int length);
+
+    void setWriteResends(int count);
+    void setReadChecksumErrors(int count);
+    void setDropReplies(char command, int count);
+    void setIgnoreCommands(char command, int count);
+    void setReturnCode(char command, int code);
+
+    void setStubEnabled(bool enabled);
+    void setStubFrameErrors(int count);
+    void setStubReplyErrors(int count);
+
+    int commandCount(char command);
+    int programCount(int address);
+    int writeResends();
+    int readResends();
+    int stubCommandCount(char command);
+
+private slots:
+    void detach();
+    void readyRead();
+
+private:
+    enum Mode {ModeAutobaud, ModeSynchronized, ModeCrystal, ModeCommand, ModeWrite, ModeRead, ModeStub};
+
+    void processLine(const QByteArray &line);
+    void processCommand(const QByteArray &line);
+    void processWriteLine(const QByteArray &line);
+    void processReadAnswer(const QByteArray &line);
+    void sendReadGroup();
+    void processStubFrames();
+    void processStubCommand(char command, quint8 sequence, quint32 arg0, quint32 arg1, const QByteArray &payload);
+    void reply(const QList<QByteArray> &lines);
+    void send(const QByteArray &data);
+    QByteArray memory(quint32 address, int length);
+    bool isPrepared(int startSector, int endSector);
+    void program(int address, const QByteArray &data);
+
+    static QByteArray decodeUULine(const QByteArray &line);
+    static QByteArray stubReply(quint8 status, quint8 sequence, quint32 value);
+
+    QThread m_thread;
+    QThread *m_owner;
+    QLpcLoopbackDevice *m_device;
+    QMutex m_mutex;
+    Mode m_mode;
+    int m_partID;
+    bool m_echo;
+    bool m_dropReply;
+    QByteArray m_rxBuffer;
+    QByteArray m_flash;
+    QByteArray m_ram;
+    int m_preparedStart;
+    int m_preparedEnd;
+
+    quint32 m_transferAddress;
+    int m_transferLength;
+    int m_transferDone;
+    QByteArray m_group;
+
+    int m_writeResends;
+    int m_readChecksumErrors;
+    QMap<char, int> m_dropReplies;
+    QMap<char, int> m_ignoreCommands;
+    QMap<char, int> m_returnCodes;
+
+    QMap<char, int> m_commandCounts;
+    QMap<int, int> m_programCounts;
+    int m_writeResendCount;
+    int m_readResendCount;
+
+    bool m_stubEnabled;
+    int m_stubFrameErrors;
+    int m_stubReplyErrors;
+    QByteArray m_stubReply;
+    QMap<char, int> m_stubCommandCounts;
+};
+
+#endif // QLPCSIMTARGET_H
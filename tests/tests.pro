@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Protocol tests against a simulated bootloader, run with
+#
+#   qmake && make check
+#
+#-------------------------------------------------
+
+lessThan(QT_MAJOR_VERSION, 5): error("The tests need Qt 5.")
+
+QT       += core network serialport testlib
+QT       -= gui
+
+TARGET = tst_lpcprog
+CONFIG += console testcase
+CONFIG -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += tst_lpcprog.cpp qlpcsimtarget.cpp ../qlpcprog.cpp ../qlpctransport.cpp ../qlpcjournal.cpp ../qlpcsession.cpp ../qlpcgang.cpp ../qlpcencoder.cpp ../qlpcstubprog.cpp ../qhexloader.cpp
+HEADERS +=                 qlpcsimtarget.h   ../qlpcprog.h   ../qlpctransport.h   ../qlpcjournal.h   ../qlpcsession.h   ../qlpcgang.h   ../qlpcencoder.h   ../qlpcstubprog.h   ../qhexloader.h
@@ -0,0 +1,565 @@
+#include "qlpcsimtarget.h"
+#include "qlpcjournal.h"
+#include "qlpcsession.h"
+#include "qlpcstubprog.h"
+#include "qlpcencoder.h"
+#include "qlpcgang.h"
+#include "qlpcprog.h"
+
+#include <QTemporaryFile>
+#include <QElapsedTimer>
+#include <QSettings>
+#include <QtTest>
+#include <QDir>
+
+#define STUB_LOAD_ADDRESS 1073742336
+
+
+// ISP protocol tests against QLpcSimTarget over loop://. Every test has its own target, the
+// name keeps the loopback listeners apart.
+class TestLpcProg : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void sync();
+    void program();
+    void writeRamResend();
+    void writeRamResendLimit();
+    void readMemoryResend();
+    void programRetryLostReply();
+    void programRetryLostCommand();
+    void programRetryLimit();
+    void journalResume();
+    void sessionResend();
+    void gangCompletion();
+    void encoder();
+    void stubResend();
+    void stubTooBig();
+
+protected slots:
+    void sessionFinished(int id, QLpcProg::Status status, const QString &statusText, const QVariant &result);
+
+private:
+    bool connectProg(QLpcProg &prog, const QString &port);
+    bool loadStub(QLpcStubProg &stub, QTemporaryFile &file, const QByteArray &image);
+    bool waitForSession(int count);
+    QByteArray pattern(int length, int seed);
+
+    QList<QLpcProg::Status> m_sessionStatus;
+    QList<QVariant> m_sessionResults;
+};
+
+// The journal goes to a settings file of its own.
+void TestLpcProg::initTestCase()
+{
+    QSettings::setPath(QSettings::IniFormat, QSettings::UserScope, QDir::temp().filePath("lpcprog_tests"));
+
+    QSettings settings(QSettings::IniFormat, QSettings::UserScope, "BokiCSoft", "LPCProg");
+
+    settings.remove("Journal");
+}
+
+bool TestLpcProg::connectProg(QLpcProg &prog, const QString &port)
+{
+    QLpcProg::SyncOptions options;
+
+    // The loopback has no modem lines.
+    options.m_Reset = false;
+    options.m_DetectSynced = false;
+
+    prog.setSyncOptions(options);
+    prog.init(port);
+    if (prog.getStatus() != QLpcProg::StatusNoError)
+    {
+        qWarning("%s", qPrintable(prog.getStatusText()));
+
+        return false;
+    }
+
+    prog.setCrystalValue(12000);
+
+    return prog.getStatus() == QLpcProg::StatusNoError;
+}
+
+bool TestLpcProg::loadStub(QLpcStubProg &stub, QTemporaryFile &file, const QByteArray &image)
+{
+    if (!file.open())
+    {
+        return false;
+    }
+
+    file.write(image);
+    file.close();
+
+    return stub.load(file.fileName());
+}
+
+void TestLpcProg::sessionFinished(int id, QLpcProg::Status status, const QString &statusText, const QVariant &result)
+{
+    Q_UNUSED(id);
+
+    if (status != QLpcProg::StatusNoError)
+    {
+        qWarning("%s", qPrintable(statusText));
+    }
+
+    m_sessionStatus.append(status);
+    m_sessionResults.append(result);
+}
+
+bool TestLpcProg::waitForSession(int count)
+{
+    QElapsedTimer timer;
+
+    timer.start();
+
+    while((m_sessionStatus.count() < count)&&(timer.elapsed() < 10000))
+    {
+        QTest::qWait(10);
+    }
+
+    return m_sessionStatus.count() == count;
+}
+
+QByteArray TestLpcProg::pattern(int length, int seed)
+{
+    QByteArray ret;
+
+    for(int c = 0; c < length; c++)
+    {
+        ret.append((char)((c * 7 + seed) & 0xFF));
+    }
+
+    return ret;
+}
+
+void TestLpcProg::sync()
+{
+    QLpcSimTarget target("sync");
+    QLpcProg prog;
+
+    QVERIFY(connectProg(prog, "loop://sync"));
+
+    QCOMPARE(prog.readPartID(), (int)QLpcProg::LPC2148);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+
+    QCOMPARE(prog.readBootCodeVersion(), QString("2.12"));
+    QCOMPARE(prog.readSerialNumber(), QString("12345678-9ABCDEF0-01234567-FEDCBA98"));
+
+    // Without echo every reply is one line shorter.
+    prog.setEcho(false);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(prog.readPartID(), (int)QLpcProg::LPC2148);
+}
+
+void TestLpcProg::program()
+{
+    QLpcSimTarget target("program");
+    QLpcProg prog;
+    QByteArray block = pattern(4096, 1);
+
+    target.setFlash(4096, QByteArray(4096, (char)0x00));
+
+    QVERIFY(connectProg(prog, "loop://program"));
+
+    prog.chipErase(1, 1);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.flash(4096, 4096), QByteArray(4096, (char)0xFF));
+
+    prog.chipProgram(block, 4096);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.flash(4096, 4096), block);
+    QCOMPARE(target.programCount(4096), 1);
+
+    // A short chunk goes out padded to the copy size.
+    prog.chipErase(2, 2);
+    prog.chipProgram(block.left(300), 8192);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.flash(8192, 512), block.left(300) + QByteArray(212, (char)0xFF));
+
+    prog.chipVerify(block.left(1024), 4096);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+
+    prog.chipVerify(pattern(1024, 2), 4096);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusError);
+}
+
+void TestLpcProg::writeRamResend()
+{
+    QLpcSimTarget target("writeresend");
+    QLpcProg prog;
+    QByteArray data = pattern(4096, 3);
+
+    QVERIFY(connectProg(prog, "loop://writeresend"));
+
+    target.setWriteResends(1);
+
+    prog.writeRam(data, QLpcProg::ramBuffer());
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.writeResends(), 1);
+    QCOMPARE(target.ram(QLpcProg::ramBuffer(), data.length()), data);
+
+    // Same again without echo.
+    prog.setEcho(false);
+    target.setWriteResends(2);
+
+    prog.writeRam(data.left(1800), QLpcProg::ramBuffer());
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.writeResends(), 3);
+}
+
+void TestLpcProg::writeRamResendLimit()
+{
+    QLpcSimTarget target("resendlimit");
+    QLpcProg prog;
+
+    QVERIFY(connectProg(prog, "loop://resendlimit"));
+
+    target.setWriteResends(100);
+
+    prog.writeRam(pattern(900, 4), QLpcProg::ramBuffer());
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusError);
+    QCOMPARE(target.writeResends(), 4); // The group and 3 resends.
+}
+
+void TestLpcProg::readMemoryResend()
+{
+    QLpcSimTarget target("readresend");
+    QLpcProg prog;
+    QByteArray data = pattern(4096, 5);
+
+    target.setFlash(8192, data);
+
+    QVERIFY(connectProg(prog, "loop://readresend"));
+
+    target.setReadChecksumErrors(1);
+
+    QCOMPARE(prog.readMemory(8192, data.length()), data);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.readResends(), 1);
+
+    // A group that never arrives intact fails the read.
+    target.setReadChecksumErrors(100);
+
+    QVERIFY(prog.readMemory(8192, 900).isEmpty());
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusError);
+}
+
+// C ran but its reply was lost, the read back finds the block and it isn't written again.
+void TestLpcProg::programRetryLostReply()
+{
+    QLpcSimTarget target("lostreply");
+    QLpcProg prog;
+    QByteArray block = pattern(4096, 6);
+
+    QVERIFY(connectProg(prog, "loop://lostreply"));
+
+    target.setDropReplies('C', 1);
+
+    prog.chipProgram(block, 12288);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(prog.recoveries(), 1);
+    QCOMPARE(target.commandCount('C'), 1);
+    QCOMPARE(target.programCount(12288), 1);
+    QCOMPARE(target.flash(12288, 4096), block);
+}
+
+// C never arrived, the read back finds the block blank and it is sent again.
+void TestLpcProg::programRetryLostCommand()
+{
+    QLpcSimTarget target("lostcommand");
+    QLpcProg prog;
+    QByteArray block = pattern(4096, 7);
+
+    QVERIFY(connectProg(prog, "loop://lostcommand"));
+
+    target.setIgnoreCommands('C', 1);
+
+    prog.chipProgram(block, 12288);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(prog.recoveries(), 1);
+    QCOMPARE(target.commandCount('C'), 2);
+    QCOMPARE(target.programCount(12288), 1);
+    QCOMPARE(target.flash(12288, 4096), block);
+}
+
+void TestLpcProg::programRetryLimit()
+{
+    QLpcSimTarget target("retrylimit");
+    QLpcProg prog;
+
+    QVERIFY(connectProg(prog, "loop://retrylimit"));
+
+    target.setIgnoreCommands('C', 100);
+
+    prog.chipProgram(pattern(4096, 8), 12288);
+    QCOMPARE(prog.getStatus(), QLpcProg::StatusError);
+    QCOMPARE(prog.recoveries(), 2);
+    QCOMPARE(target.commandCount('C'), 3);
+    QCOMPARE(target.flash(12288, 4096), QByteArray(4096, (char)0xFF));
+}
+
+// Blocks go from the last to the first. The run stops in the block at 8192, the next one erases
+// that sector and continues below 12288.
+void TestLpcProg::journalResume()
+{
+    QLpcSimTarget target("journal");
+    QLpcProg prog;
+    QByteArray image = pattern(16384, 9);
+
+    QVERIFY(connectProg(prog, "loop://journal"));
+
+    {
+        QLpcJournal journal(&prog);
+
+        QVERIFY(journal.open(image));
+        QVERIFY(!journal.isResumable());
+
+        journal.startBlock(12288);
+        prog.chipProgram(image.mid(12288, 4096), 12288);
+        QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+        journal.finishBlock(12288);
+
+        journal.startBlock(8192);
+        target.setFlash(8192, image.mid(8192, 1024));
+    }
+
+    {
+        QLpcJournal journal(&prog);
+
+        QVERIFY(journal.open(image));
+        QVERIFY(journal.isResumable());
+        QCOMPARE(journal.resume(), 12288);
+        QCOMPARE(target.flash(8192, 4096), QByteArray(4096, (char)0xFF));
+        QCOMPARE(target.flash(12288, 4096), image.mid(12288, 4096));
+
+        // This time the block makes it, but the run stops before it is recorded.
+        journal.startBlock(8192);
+        prog.chipProgram(image.mid(8192, 4096), 8192);
+        QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    }
+
+    {
+        QLpcJournal journal(&prog);
+
+        QVERIFY(journal.open(image));
+        QCOMPARE(journal.resume(), 8192);
+        QCOMPARE(target.programCount(8192), 1);
+
+        journal.finish();
+    }
+
+    QLpcJournal journal(&prog);
+
+    QVERIFY(journal.open(image));
+    QVERIFY(!journal.isResumable());
+    QCOMPARE(journal.resume(), image.length());
+}
+
+// The session sends a W group again on RESEND, up to its limit, without echo.
+void TestLpcProg::sessionResend()
+{
+    QLpcSimTarget target("session");
+    QLpcSession session;
+    QLpcProg::SyncOptions options;
+    QByteArray block = pattern(4096, 10);
+
+    options.m_Reset = false;
+    options.m_DetectSynced = false;
+    session.setSyncOptions(options);
+
+    QVERIFY(session.open("loop://session"));
+    connect(&session, SIGNAL(finished(int,QLpcProg::Status,QString,QVariant)), this, SLOT(sessionFinished(int,QLpcProg::Status,QString,QVariant)));
+
+    m_sessionStatus.clear();
+    m_sessionResults.clear();
+
+    target.setWriteResends(2);
+
+    session.sync(12000);
+    session.readPartID();
+    session.program(block, 4096);
+    session.verify(block, 4096);
+
+    QVERIFY(waitForSession(4));
+    QCOMPARE(m_sessionStatus, QList<QLpcProg::Status>() << QLpcProg::StatusNoError << QLpcProg::StatusNoError << QLpcProg::StatusNoError << QLpcProg::StatusNoError);
+    QCOMPARE(m_sessionResults.at(1).toInt(), (int)QLpcProg::LPC2148);
+    QCOMPARE(target.writeResends(), 2);
+    QCOMPARE(target.flash(4096, 4096), block);
+
+    // Past the limit the program fails and the verify behind it is canceled.
+    m_sessionStatus.clear();
+    m_sessionResults.clear();
+
+    target.setWriteResends(100);
+
+    session.program(block, 8192);
+    session.verify(block, 8192);
+
+    QVERIFY(waitForSession(2));
+    QCOMPARE(m_sessionStatus, QList<QLpcProg::Status>() << QLpcProg::StatusError << QLpcProg::StatusError);
+    QCOMPARE(target.writeResends(), 6);
+    QCOMPARE(target.commandCount('C'), 1);
+    QCOMPARE(session.state(), QLpcSession::StateIdle);
+}
+
+// run() comes back once every target is done, whether it passed, failed on the way or never
+// opened, and reports each one.
+void TestLpcProg::gangCompletion()
+{
+    QLpcSimTarget good("ganggood");
+    QLpcSimTarget bad("gangbad");
+    QLpcProg::SyncOptions options;
+    QLpcGang gang;
+    QByteArray image = pattern(4096, 11) + QByteArray(4096, (char)0xFF) + pattern(4096, 12);
+
+    options.m_Reset = false;
+    options.m_DetectSynced = false;
+
+    bad.setReturnCode('E', 9);
+
+    gang.setImage(image);
+    gang.setSyncOptions(options);
+
+    QVERIFY(!gang.run(QStringList() << "loop://ganggood" << "loop://gangbad" << "loop://gangmissing"));
+    QVERIFY(!gang.isRunning());
+
+    QList<QLpcGang::Result> results = gang.results();
+
+    QCOMPARE(results.count(), 3);
+    QCOMPARE(results.at(0).m_Port, QString("loop://ganggood"));
+    QVERIFY(results.at(0).m_Ok);
+    QVERIFY(!results.at(1).m_Ok);
+    QVERIFY(results.at(1).m_Error.contains("9"));
+    QVERIFY(!results.at(2).m_Ok);
+
+    QCOMPARE(good.flash(0, image.length()), image);
+    QCOMPARE(good.programCount(0), 1);
+    QCOMPARE(good.programCount(4096), 0); // All 0xFF, not written.
+    QCOMPARE(good.programCount(8192), 1);
+    QCOMPARE(bad.commandCount('C'), 0);
+}
+
+// Blocks come out of the encoder as chipProgram() would encode them, short ones padded, and
+// program the same flash.
+void TestLpcProg::encoder()
+{
+    QLpcSimTarget target("encoder");
+    QLpcProg prog;
+    QLpcEncoder encoder;
+    QByteArray image = pattern(3 * 4096 + 300, 13);
+    QList<int> offsets;
+
+    offsets << 12288 << 8192 << 4096 << 0;
+
+    encoder.setWindow(2);
+    encoder.start(image, offsets);
+
+    QVERIFY(connectProg(prog, "loop://encoder"));
+
+    foreach(int offset, offsets)
+    {
+        QByteArray chunk = image.mid(offset, 4096);
+        QList<QByteArray> groups = encoder.take(offset);
+
+        chunk.append(QByteArray(QLpcProg::copySize(chunk.length()) - chunk.length(), (char)0xFF));
+
+        QCOMPARE(groups, QLpcProg::encodeUUGroups(chunk));
+        QCOMPARE(groups, QLpcEncoder::encodeBlock(image, offset, 4096));
+
+        prog.chipProgram(image.mid(offset, 4096), offset, groups);
+        QCOMPARE(prog.getStatus(), QLpcProg::StatusNoError);
+    }
+
+    QCOMPARE(target.flash(0, image.length()), image);
+    QCOMPARE(target.flash(image.length(), 212), QByteArray(212, (char)0xFF));
+
+    // Only the patched block is encoded again, the rest comes from the cache of the first run.
+    QByteArray patched = image;
+    QMap<int, QByteArray> patches;
+
+    patches.insert(4100, "ABCD");
+    QLpcProg::injectData(patched, 4100, "ABCD");
+
+    encoder.setPatches(patches);
+    encoder.start(image, offsets);
+
+    foreach(int offset, offsets)
+    {
+        QCOMPARE(encoder.take(offset), QLpcEncoder::encodeBlock(patched, offset, 4096));
+    }
+}
+
+// A frame whose reply got damaged goes again with the same sequence number, the stub sends the
+// stored reply instead of running it twice. A damaged frame is sent again.
+void TestLpcProg::stubResend()
+{
+    QLpcSimTarget target("stub");
+    QLpcProg prog;
+    QLpcStubProg stub(&prog);
+    QTemporaryFile file(QDir::temp().filePath("lpcstub_XXXXXX.bin"));
+    QByteArray image = pattern(1024, 14);
+    QByteArray block = pattern(4096, 15);
+
+    target.setStubEnabled(true);
+    target.setFlash(4096, QByteArray(4096, (char)0x00));
+
+    QVERIFY(connectProg(prog, "loop://stub"));
+    QVERIFY(loadStub(stub, file, image));
+
+    QVERIFY(stub.start());
+    QVERIFY(stub.isRunning());
+    QCOMPARE(target.ram(STUB_LOAD_ADDRESS, image.length()), image);
+    QCOMPARE(target.stubCommandCount('S'), 1);
+
+    stub.chipErase(1, 1);
+    QCOMPARE(stub.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.flash(4096, 4096), QByteArray(4096, (char)0xFF));
+
+    target.setStubReplyErrors(1);
+
+    stub.chipProgram(block, 4096);
+    QCOMPARE(stub.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.stubCommandCount('W'), 1);
+    QCOMPARE(target.programCount(4096), 1);
+    QCOMPARE(target.flash(4096, 4096), block);
+
+    target.setStubFrameErrors(1);
+
+    QCOMPARE(stub.readCrc32(4096, 4096), QLpcProg::crc32(block));
+    QCOMPARE(stub.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.stubCommandCount('V'), 1);
+    QVERIFY(stub.isRunning());
+}
+
+// The stub doesn't fit in the RAM of an LPC2141, programming goes on through ISP.
+void TestLpcProg::stubTooBig()
+{
+    QLpcSimTarget target("stubsmall", QLpcProg::LPC2141);
+    QLpcProg prog;
+    QLpcStubProg stub(&prog);
+    QTemporaryFile file(QDir::temp().filePath("lpcstub_XXXXXX.bin"));
+    QByteArray block = pattern(4096, 16);
+
+    target.setStubEnabled(true);
+
+    QVERIFY(connectProg(prog, "loop://stubsmall"));
+    QVERIFY(loadStub(stub, file, pattern(4000, 17)));
+
+    QVERIFY(!stub.start());
+    QVERIFY(!stub.isRunning());
+    QCOMPARE(stub.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.commandCount('W'), 0);
+
+    stub.chipProgram(block, 4096);
+    QCOMPARE(stub.getStatus(), QLpcProg::StatusNoError);
+    QCOMPARE(target.commandCount('C'), 1);
+    QCOMPARE(target.stubCommandCount('W'), 0);
+    QCOMPARE(target.flash(4096, 4096), block);
+}
+
+QTEST_MAIN(TestLpcProg)
+
+#include "tst_lpcprog.moc"